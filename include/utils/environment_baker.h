@@ -0,0 +1,379 @@
+/*
+EnvironmentBaker class
+- builds at runtime, with compute shaders, the cube maps of the image based lighting from an equirectangular HDR image:
+  the environment cube map with its mipmaps, and the irradiance cube map (the same data built offline by cubeMapping_fromEquirectangular)
+- the source image is decoded and uploaded in background by the texture loader (see utils/texture_loader.h)
+- the work is split in slices (a few rows of a face, or a few faces of a small mip level), and each call of Update dispatches slices
+  only up to a budget of texels, so that the environment can be changed without dropping frames:
+    1) equirect_to_cube.comp: the base level of the environment
+    2) cube_downsample.comp: each mip level is the 2x2 average of the previous one (the same filter of the texture loader)
+    3) sh_projection.comp: projection of the environment (sampled on a 64x64 grid for each face) on the spherical harmonics of the
+       first 3 bands, partial sums for each face
+    4) sh_irradiance.comp: the irradiance cube map, evaluated from the 9 coefficients
+- BakeIrradiance runs only the last two passes, on a cube map given by the application (e.g. an 8 bit skybox without irradiance map)
+- when a bake is completed, the application takes the two cube maps (TakeCubeMaps), and it owns them from then on
+
+N.B. 1) compute shaders require OpenGL 4.3: if the context does not support it (e.g. on macOS, which stops at 4.1), Bake always fails
+and the cube maps can only be loaded from disk
+
+N.B. 2) the cube maps are stored as GL_RGBA16F, which can be written by the image stores (GL_RGB9_E5 and the 3 channel formats can't)
+
+N.B. 3) during the dispatches the baker uses the image units 0 and 1, the shader storage binding point 0, and the texture unit given to
+the constructor: the unit must not be used by the other textures which keep their units for the whole application
+
+Real-Time Graphics Programming - a.a. 2019/2020
+Master degree in Computer Science
+Universita' degli Studi di Milano
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <string>
+#include <iostream>
+
+#include <utils/shader_v2.h>
+#include <utils/texture_loader.h>
+
+/////////////////// ENVIRONMENT BAKER class ///////////////////////
+class EnvironmentBaker
+{
+public:
+    // maximum number of texels computed in each call of Update
+    GLuint TexelBudget;
+
+    //////////////////////////////////////////
+
+    // true if the context supports the compute shaders
+    static bool Supported() { return GLAD_GL_VERSION_4_3 != 0; }
+
+    //////////////////////////////////////////
+
+    // constructor
+    // environmentSize and irradianceSize are the sizes of the faces of the two cube maps, unit is the texture unit of the source image
+    EnvironmentBaker(TextureLoader& loader, GLuint unit, GLint environmentSize = 512, GLint irradianceSize = 32, GLuint texelBudget = 1 << 16)
+        : TexelBudget(texelBudget), loader(loader), unit(unit), environmentSize(environmentSize), irradianceSize(irradianceSize)
+    {
+        if (!Supported())
+            return;
+
+        this->cubeProgram = Shader("equirect_to_cube.comp").Program;
+        this->downsampleProgram = Shader("cube_downsample.comp").Program;
+        this->projectionProgram = Shader("sh_projection.comp").Program;
+        this->irradianceProgram = Shader("sh_irradiance.comp").Program;
+        glUseProgram(this->cubeProgram);
+        glUniform1i(glGetUniformLocation(this->cubeProgram, "equirectangularMap"), this->unit);
+
+        glUseProgram(this->projectionProgram);
+        glUniform1i(glGetUniformLocation(this->projectionProgram, "environmentMap"), this->unit);
+        glUniform1i(glGetUniformLocation(this->projectionProgram, "projectionSize"), PROJECTION_SIZE);
+        glUseProgram(0);
+
+        // the partial sums of the faces of the projection
+        glGenBuffers(1, &this->SSBO);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->SSBO);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, 6 * 9 * sizeof(glm::vec4), nullptr, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+
+    // the class owns OpenGL objects: we disallow copies
+    EnvironmentBaker(const EnvironmentBaker& copy) = delete;
+    EnvironmentBaker& operator=(const EnvironmentBaker& copy) = delete;
+
+    // destructor
+    // a bake in progress is abandoned, and the cube maps not taken by the application are deleted
+    ~EnvironmentBaker()
+    {
+        if (!Supported())
+            return;
+        this->deleteCubeMaps();
+        // while loading, the name of the source is still the placeholder owned by the loader
+        if (this->stage != LOADING)
+            glDeleteTextures(1, &this->source);
+        glDeleteBuffers(1, &this->SSBO);
+        glDeleteProgram(this->cubeProgram);
+        glDeleteProgram(this->downsampleProgram);
+        glDeleteProgram(this->projectionProgram);
+        glDeleteProgram(this->irradianceProgram);
+    }
+
+    //////////////////////////////////////////
+
+    // we start the bake of an equirectangular image, abandoning the current one.
+    // It returns false if the compute shaders are not supported, or if the source of the current bake is still loading
+    // (the loader will write its name in the baker)
+    bool Bake(const string& equirectPath)
+    {
+        if (!Supported())
+        {
+            cout << "The environment baker requires OpenGL 4.3" << endl;
+            return false;
+        }
+        if (this->stage == LOADING)
+            return false;
+
+        this->deleteCubeMaps();
+        this->deleteSource();
+        this->totalTexels = this->irradianceTexels();
+        for (GLint level = 0; level < this->levels(); level++)
+            this->totalTexels += 6 * this->levelSize(level) * this->levelSize(level);
+        this->path = equirectPath;
+        // the top of the image is at v = 1, as in cubeMapping_fromEquirectangular
+        this->loader.LoadHDR(&this->source, equirectPath, GL_RGB16F, true, true);
+        this->sourcePlaceholder = this->source;
+        this->stage = LOADING;
+        this->doneTexels = 0;
+        return true;
+    }
+
+    // we start the bake of the irradiance of a cube map, abandoning the current bake.
+    // The cube map must have mipmaps, and it must not be deleted until the bake is completed. It returns false in the same cases of Bake
+    bool BakeIrradiance(GLuint environmentMap)
+    {
+        if (!Supported() || this->stage == LOADING)
+            return false;
+
+        this->deleteCubeMaps();
+        this->deleteSource();
+        this->path = "";
+        // the texture bindings of the baker change only its own unit
+        glActiveTexture(GL_TEXTURE0 + this->unit);
+        this->environment = environmentMap;
+        this->ownsEnvironment = false;
+        this->irradiance = this->createCubeMap(this->irradianceSize, 1);
+        this->totalTexels = this->irradianceTexels();
+        this->doneTexels = 0;
+        this->stage = PROJECTION;
+        return true;
+    }
+
+    //////////////////////////////////////////
+
+    // we dispatch the next slices of the bake, up to TexelBudget texels
+    void Update()
+    {
+        if (this->stage == LOADING)
+        {
+            if (this->source == this->sourcePlaceholder)
+            {
+                // every request has been completed, and the placeholder is still there: the image can't be loaded
+                if (this->loader.Pending() == 0)
+                {
+                    cout << "Failed to bake the environment: " << this->path << endl;
+                    this->deleteSource();
+                    this->stage = IDLE;
+                }
+                return;
+            }
+            this->startBake();
+        }
+
+        long long budget = this->TexelBudget;
+        while (budget > 0 && this->stage != IDLE && this->stage != LOADING && this->stage != FINISHED)
+            budget -= this->dispatchSlice(budget);
+    }
+
+    //////////////////////////////////////////
+
+    // true while a bake is in progress (loading its source, or dispatching its slices)
+    bool Baking() const { return this->stage != IDLE && this->stage != FINISHED; }
+    // true if the cube maps of a bake are ready to be taken
+    bool Finished() const { return this->stage == FINISHED; }
+    // fraction of the work of the current bake already dispatched
+    float Progress() const { return this->stage == FINISHED ? 1.0f : (float) this->doneTexels / this->totalTexels; }
+    // the source of the last bake
+    const string& Path() const { return this->path; }
+
+    // we give the cube maps of the completed bake to the application (with BakeIrradiance, environment is the given cube map)
+    void TakeCubeMaps(GLuint& environment, GLuint& irradiance)
+    {
+        environment = this->environment;
+        irradiance = this->irradiance;
+        this->environment = this->irradiance = 0;
+        this->ownsEnvironment = true;
+        this->stage = IDLE;
+    }
+
+private:
+    // the stages of a bake
+    enum Stage { IDLE, LOADING, BASE_LEVEL, MIPMAPS, PROJECTION, IRRADIANCE, FINISHED };
+    // size of the level projected on the spherical harmonics
+    static const GLint PROJECTION_SIZE = 64;
+
+    TextureLoader& loader;
+    GLuint unit;
+    GLint environmentSize, irradianceSize;
+
+    GLuint cubeProgram = 0, downsampleProgram = 0, projectionProgram = 0, irradianceProgram = 0;
+    GLuint SSBO = 0;
+
+    // the source image (written by the loader), and the cube maps being built
+    string path;
+    GLuint source = 0, sourcePlaceholder = 0;
+    GLuint environment = 0, irradiance = 0;
+    // false if the environment has been given by the application (BakeIrradiance)
+    bool ownsEnvironment = true;
+
+    // the current stage, and the next part of it to compute: the level, the face and the row
+    Stage stage = IDLE;
+    GLint level = 0, face = 0, row = 0;
+    long long doneTexels = 0, totalTexels = 0;
+
+    //////////////////////////////////////////
+
+    // number of mip levels of the environment
+    GLint levels() const
+    {
+        GLint count = 1;
+        while ((this->environmentSize >> count) > 0)
+            count++;
+        return count;
+    }
+
+    GLint levelSize(GLint level) const { return max(this->environmentSize >> level, 1); }
+
+    // the texels computed by the projection and by the evaluation of the irradiance
+    long long irradianceTexels() const { return 6 * (PROJECTION_SIZE * PROJECTION_SIZE + this->irradianceSize * this->irradianceSize); }
+
+    //////////////////////////////////////////
+
+    // the source is loaded: we allocate the cube maps
+    void startBake()
+    {
+        // the texture bindings of the baker change only its own unit
+        glActiveTexture(GL_TEXTURE0 + this->unit);
+        glBindTexture(GL_TEXTURE_2D, this->source);
+        // the equirectangular image wraps around horizontally, but not at the poles
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        this->environment = this->createCubeMap(this->environmentSize, this->levels());
+        this->ownsEnvironment = true;
+        this->irradiance = this->createCubeMap(this->irradianceSize, 1);
+        this->stage = BASE_LEVEL;
+        this->level = this->face = this->row = 0;
+    }
+
+    GLuint createCubeMap(GLint size, GLint levels)
+    {
+        GLuint texture;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+        glTexStorage2D(GL_TEXTURE_CUBE_MAP, levels, GL_RGBA16F, size, size);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+        return texture;
+    }
+
+    void deleteSource()
+    {
+        glDeleteTextures(1, &this->source);
+        this->source = 0;
+    }
+
+    void deleteCubeMaps()
+    {
+        if (this->ownsEnvironment)
+            glDeleteTextures(1, &this->environment);
+        glDeleteTextures(1, &this->irradiance);
+        this->environment = this->irradiance = 0;
+        this->ownsEnvironment = true;
+    }
+
+    //////////////////////////////////////////
+
+    // we dispatch the next slice of the current stage, of about budget texels (at least one row). It returns the number of texels computed
+    long long dispatchSlice(long long budget)
+    {
+        if (this->stage == PROJECTION)
+        {
+            glUseProgram(this->projectionProgram);
+            glActiveTexture(GL_TEXTURE0 + this->unit);
+            glBindTexture(GL_TEXTURE_CUBE_MAP, this->environment);
+            // the mip level with faces of about PROJECTION_SIZE texels
+            GLint size;
+            glGetTexLevelParameteriv(GL_TEXTURE_CUBE_MAP_POSITIVE_X, 0, GL_TEXTURE_WIDTH, &size);
+            glUniform1f(glGetUniformLocation(this->projectionProgram, "sourceLod"), max(log2((float) size / PROJECTION_SIZE), 0.0f));
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, this->SSBO);
+            glDispatchCompute(1, 1, 6);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+            this->stage = IRRADIANCE;
+            return this->finishSlice(6 * PROJECTION_SIZE * PROJECTION_SIZE);
+        }
+        if (this->stage == IRRADIANCE)
+        {
+            GLint size = this->irradianceSize;
+            glUseProgram(this->irradianceProgram);
+            glBindImageTexture(0, this->irradiance, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, this->SSBO);
+            glDispatchCompute((size + 7) / 8, (size + 7) / 8, 6);
+            // the cube maps are read by the texture lookups of the next frames
+            glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+            glUseProgram(0);
+            this->deleteSource();
+            this->stage = FINISHED;
+            return this->finishSlice(6 * size * size);
+        }
+
+        // a level of the environment: whole faces if at least one fits in the budget, otherwise a group of rows of the current face
+        GLint size = this->levelSize(this->level);
+        GLint faces = 1, rows = size - this->row;
+        if (this->row == 0 && (long long) size * size <= budget)
+            faces = (GLint) min<long long>(6 - this->face, budget / ((long long) size * size));
+        else
+            rows = (GLint) min<long long>(rows, max<long long>(budget / size, 1));
+
+        if (this->stage == BASE_LEVEL)
+        {
+            glUseProgram(this->cubeProgram);
+            glActiveTexture(GL_TEXTURE0 + this->unit);
+            glBindTexture(GL_TEXTURE_2D, this->source);
+            // the mip level of the source whose texels cover about the same angle of the texels of the cube map (2 PI / width and PI / 2 / size)
+            GLint sourceWidth;
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &sourceWidth);
+            glUniform1f(glGetUniformLocation(this->cubeProgram, "sourceLod"), max(log2((float) sourceWidth / (4.0f * size)), 0.0f));
+            glBindImageTexture(0, this->environment, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+        }
+        else
+        {
+            glUseProgram(this->downsampleProgram);
+            glBindImageTexture(0, this->environment, this->level - 1, GL_TRUE, 0, GL_READ_ONLY, GL_RGBA16F);
+            glBindImageTexture(1, this->environment, this->level, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+        }
+        GLuint program = this->stage == BASE_LEVEL ? this->cubeProgram : this->downsampleProgram;
+        glUniform1i(glGetUniformLocation(program, "firstFace"), this->face);
+        glUniform1i(glGetUniformLocation(program, "firstRow"), this->row);
+        glUniform1i(glGetUniformLocation(program, "lastRow"), this->row + rows - 1);
+        glDispatchCompute((size + 7) / 8, (rows + 7) / 8, faces);
+
+        // next slice
+        this->row += rows;
+        if (this->row == size)
+        {
+            this->row = 0;
+            this->face += faces;
+        }
+        if (this->face == 6)
+        {
+            // the level is complete: the next one reads it with the image loads, the projection with the texture lookups
+            glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+            this->face = 0;
+            this->level++;
+            this->stage = this->level < this->levels() ? MIPMAPS : PROJECTION;
+        }
+        glUseProgram(0);
+        return this->finishSlice((long long) faces * rows * size);
+    }
+
+    long long finishSlice(long long texels)
+    {
+        this->doneTexels += texels;
+        return texels;
+    }
+};
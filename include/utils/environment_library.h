@@ -0,0 +1,466 @@
+/*
+EnvironmentLibrary class
+- the environments available to the application, found in the subfolders of a list of folders:
+    - image based lighting folders: "environment" and "irradiance" cube maps, with the faces right, left, up, down, back, front.hdr,
+      loaded in floating point in the format chosen by the application (or tone mapped to 8 bits)
+    - skyboxes: six 8 bit images (posx, negx, posy, negy, posz, negz, or right, left, top, bottom, back, front), whose irradiance
+      is baked by the environment baker (see utils/environment_baker.h)
+    - equirectangular HDR images (the .hdr files in the folder which are not faces of a cube map), baked by the environment baker
+- Select streams the cube maps of an environment in background, with the texture loader and the environment baker:
+  the current environment is replaced only when both cube maps of the new one are ready, in the same frame
+- the environments already loaded stay resident in GPU memory, up to a budget of bytes: when it is exceeded, the least recently used
+  ones are deleted (never the current one). Selecting a resident environment switches immediately
+
+N.B. 1) the library owns the cube maps of the resident environments: the application reads the current ones after each Update
+
+N.B. 2) the skyboxes and the equirectangular images need the compute shaders of the baker (OpenGL 4.3): without them,
+only the image based lighting folders are listed
+
+N.B. 3) the baker builds one environment at a time: the other selections wait for it in the queue
+
+Real-Time Graphics Programming - a.a. 2019/2020
+Master degree in Computer Science
+Universita' degli Studi di Milano
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+
+#include <utils/texture_loader.h>
+#include <utils/environment_baker.h>
+
+/////////////////// ENVIRONMENT LIBRARY class ///////////////////////
+class EnvironmentLibrary
+{
+public:
+    // the kinds of environments
+    enum Kind { IBL_FOLDER, SKYBOX, EQUIRECTANGULAR };
+    // the states of an environment
+    enum State { NOT_LOADED, LOADING, RESIDENT, FAILED };
+
+    // maximum size of the resident environments in GPU memory (the current one is always resident)
+    size_t ResidentBudget;
+
+    //////////////////////////////////////////
+
+    // constructor
+    // hdrFormat is the storage of the image based lighting folders (see TextureLoader::LoadCubeMap)
+    EnvironmentLibrary(TextureLoader& loader, EnvironmentBaker& baker, GLenum hdrFormat, size_t residentBudget = 256 << 20)
+        : ResidentBudget(residentBudget), loader(loader), baker(baker), hdrFormat(hdrFormat)
+    {
+        // until the first environment is ready, the units are bound to a grey cube map
+        glGenTextures(1, &this->placeholder);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, this->placeholder);
+        const glm::u8vec4 grey(128, 128, 128, 255);
+        for (GLuint i = 0; i < 6; i++)
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, &grey);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    }
+
+    // the class owns OpenGL objects: we disallow copies
+    EnvironmentLibrary(const EnvironmentLibrary& copy) = delete;
+    EnvironmentLibrary& operator=(const EnvironmentLibrary& copy) = delete;
+
+    // destructor
+    // the resident cube maps are deleted (the ones still loading belong to the loader and to the baker until they are completed)
+    ~EnvironmentLibrary()
+    {
+        for (unique_ptr<Environment>& environment : this->environments)
+        {
+            if (environment->state == RESIDENT)
+                this->deleteCubeMaps(*environment);
+        }
+        glDeleteTextures(1, &this->placeholder);
+    }
+
+    //////////////////////////////////////////
+
+    // we add the environments found in the subfolders of a folder (e.g. "../../textures/"), sorted by name
+    void Scan(const string& folder)
+    {
+        error_code error;
+        vector<filesystem::path> subfolders;
+        for (const filesystem::directory_entry& entry : filesystem::directory_iterator(folder, error))
+        {
+            if (entry.is_directory())
+                subfolders.push_back(entry.path());
+        }
+        sort(subfolders.begin(), subfolders.end());
+
+        for (const filesystem::path& subfolder : subfolders)
+        {
+            string name = subfolder.filename().string();
+            string path = subfolder.string() + "/";
+            if (this->hasFaces(path + "environment/", IBL_FACES, "hdr") && this->hasFaces(path + "irradiance/", IBL_FACES, "hdr"))
+                this->add(name, IBL_FOLDER, this->facePaths(path + "environment/", IBL_FACES, "hdr"), this->facePaths(path + "irradiance/", IBL_FACES, "hdr"));
+            else if (EnvironmentBaker::Supported())
+            {
+                bool found = false;
+                for (const vector<string>& faces : SKYBOX_FACES)
+                {
+                    for (const char* format : {"jpg", "png"})
+                    {
+                        if (!found && this->hasFaces(path, faces, format))
+                        {
+                            this->add(name, SKYBOX, this->facePaths(path, faces, format), {});
+                            found = true;
+                        }
+                    }
+                }
+            }
+
+            // the equirectangular images
+            if (!EnvironmentBaker::Supported())
+                continue;
+            for (const filesystem::directory_entry& entry : filesystem::directory_iterator(subfolder, error))
+            {
+                string stem = entry.path().stem().string();
+                if (entry.path().extension() == ".hdr" && find(IBL_FACES.begin(), IBL_FACES.end(), stem) == IBL_FACES.end())
+                    this->add(name + "/" + entry.path().filename().string(), EQUIRECTANGULAR, {entry.path().string()}, {});
+            }
+        }
+    }
+
+    // we add an equirectangular image (if it is not in the library yet). It returns its index
+    int AddEquirectangular(const string& path)
+    {
+        for (size_t i = 0; i < this->environments.size(); i++)
+        {
+            if (this->environments[i]->kind == EQUIRECTANGULAR && this->environments[i]->paths[0] == path)
+                return i;
+        }
+        this->add(filesystem::path(path).filename().string(), EQUIRECTANGULAR, {path}, {});
+        return this->environments.size() - 1;
+    }
+
+    // the index of the environment with the given name, or -1
+    int Find(const string& name) const
+    {
+        for (size_t i = 0; i < this->environments.size(); i++)
+        {
+            if (this->environments[i]->name == name)
+                return i;
+        }
+        return -1;
+    }
+
+    //////////////////////////////////////////
+
+    // we select an environment: if it is resident it becomes the current one, otherwise it is streamed in background
+    void Select(int index)
+    {
+        Environment& environment = *this->environments[index];
+        this->selected = index;
+        if (environment.state == RESIDENT)
+            this->makeCurrent(index);
+        else if (environment.state != LOADING)
+            this->startLoading(environment);
+    }
+
+    // we change the storage of the image based lighting folders: the resident ones are loaded again (the current one stays on screen
+    // until its new version is ready)
+    void SetHDRFormat(GLenum hdrFormat)
+    {
+        this->hdrFormat = hdrFormat;
+        for (size_t i = 0; i < this->environments.size(); i++)
+        {
+            Environment& environment = *this->environments[i];
+            if (environment.kind != IBL_FOLDER || environment.state != RESIDENT)
+                continue;
+            if ((int) i == this->current)
+                this->startLoading(environment);
+            else
+                this->evict(environment);
+        }
+    }
+
+    //////////////////////////////////////////
+
+    // we advance the loading of the selected environments: it must be called once per frame, after the Update of the loader.
+    // It returns true if the current environment has changed
+    bool Update()
+    {
+        int previous = this->current;
+        this->baker.Update();
+
+        for (size_t i = 0; i < this->environments.size(); i++)
+        {
+            Environment& environment = *this->environments[i];
+            if (environment.state == LOADING && this->advance(environment))
+            {
+                // the new cube maps replace the resident ones (after SetHDRFormat)
+                if (environment.environment != 0)
+                    this->deleteCubeMaps(environment);
+                environment.environment = environment.loading[0];
+                environment.irradiance = environment.loading[1];
+                environment.hdr = environment.loadingHDR;
+                environment.bytes = this->cubeMapBytes(environment.environment) + this->cubeMapBytes(environment.irradiance);
+                environment.state = RESIDENT;
+                // a new resident environment is the most recently used one: otherwise (lastUse 0) it would be the first to be evicted
+                environment.lastUse = ++this->useCounter;
+                if ((int) i == this->selected || (int) i == this->current)
+                    this->makeCurrent(i);
+                this->evictLeastRecentlyUsed();
+            }
+        }
+
+        // the next environment waiting for the baker
+        if (!this->bakeQueue.empty() && !this->baker.Baking() && !this->baker.Finished())
+        {
+            Environment& environment = *this->bakeQueue.front();
+            this->bakeQueue.pop_front();
+            bool started = environment.kind == EQUIRECTANGULAR ? this->baker.Bake(environment.paths[0]) : this->baker.BakeIrradiance(environment.loading[0]);
+            if (started)
+                this->baking = &environment;
+            else
+                this->fail(environment);
+        }
+        return this->current != previous;
+    }
+
+    // we block until the selected environment is ready (used when the application can't render without it)
+    void Finish()
+    {
+        while (this->selected >= 0 && this->environments[this->selected]->state == LOADING)
+        {
+            this->loader.Finish();
+            this->Update();
+        }
+    }
+
+    //////////////////////////////////////////
+
+    // the cube maps of the current environment (a grey placeholder until the first one is ready), and if they are HDR
+    GLuint EnvironmentMap() const { return this->current >= 0 ? this->environments[this->current]->environment : this->placeholder; }
+    GLuint IrradianceMap() const { return this->current >= 0 ? this->environments[this->current]->irradiance : this->placeholder; }
+    bool HDR() const { return this->current >= 0 && this->environments[this->current]->hdr; }
+
+    // the environments of the library
+    int Count() const { return this->environments.size(); }
+    const string& Name(int index) const { return this->environments[index]->name; }
+    State GetState(int index) const { return this->environments[index]->state; }
+    int Current() const { return this->current; }
+    int Selected() const { return this->selected; }
+    // GPU memory of the resident environments
+    size_t ResidentBytes() const
+    {
+        size_t bytes = 0;
+        for (const unique_ptr<Environment>& environment : this->environments)
+            bytes += environment->state == RESIDENT ? environment->bytes : 0;
+        return bytes;
+    }
+
+private:
+    // the names of the faces, in the order of the OpenGL targets (+X, -X, +Y, -Y, +Z, -Z)
+    inline static const vector<string> IBL_FACES = {"right", "left", "up", "down", "back", "front"};
+    inline static const vector<vector<string>> SKYBOX_FACES = {{"posx", "negx", "posy", "negy", "posz", "negz"},
+                                                               {"right", "left", "top", "bottom", "back", "front"}};
+
+    struct Environment
+    {
+        string name;
+        Kind kind;
+        // the faces of the environment and irradiance cube maps (IBL_FOLDER), of the environment (SKYBOX), or the image (EQUIRECTANGULAR)
+        vector<string> paths, irradiancePaths;
+        State state = NOT_LOADED;
+        // the cube maps of a resident environment, their size in GPU memory, and if they store linear HDR radiance
+        GLuint environment = 0, irradiance = 0;
+        size_t bytes = 0;
+        bool hdr = false;
+        // the frame in which the environment has been the current one for the last time
+        unsigned long lastUse = 0;
+
+        // while loading: the names written by the loader (the placeholders, then the final textures) or by the baker
+        GLuint loading[2] = {0, 0}, placeholders[2] = {0, 0};
+        bool loadingHDR = false;
+    };
+
+    TextureLoader& loader;
+    EnvironmentBaker& baker;
+    GLenum hdrFormat;
+
+    // the environments are never moved in memory: the loader writes in them
+    vector<unique_ptr<Environment>> environments;
+    int current = -1, selected = -1;
+    unsigned long useCounter = 0;
+    GLuint placeholder;
+
+    // the environments waiting for the baker, and the one being baked
+    deque<Environment*> bakeQueue;
+    Environment* baking = nullptr;
+
+    //////////////////////////////////////////
+
+    void add(const string& name, Kind kind, const vector<string>& paths, const vector<string>& irradiancePaths)
+    {
+        unique_ptr<Environment> environment(new Environment());
+        environment->name = name;
+        environment->kind = kind;
+        environment->paths = paths;
+        environment->irradiancePaths = irradiancePaths;
+        this->environments.push_back(std::move(environment));
+    }
+
+    bool hasFaces(const string& folder, const vector<string>& faces, const string& format) const
+    {
+        for (const string& face : faces)
+        {
+            error_code error;
+            if (!filesystem::is_regular_file(folder + face + "." + format, error))
+                return false;
+        }
+        return true;
+    }
+
+    vector<string> facePaths(const string& folder, const vector<string>& faces, const string& format) const
+    {
+        vector<string> paths;
+        for (const string& face : faces)
+            paths.push_back(folder + face + "." + format);
+        return paths;
+    }
+
+    //////////////////////////////////////////
+
+    // we request the cube maps of an environment
+    void startLoading(Environment& environment)
+    {
+        environment.state = LOADING;
+        environment.loading[0] = environment.loading[1] = 0;
+        environment.placeholders[0] = environment.placeholders[1] = 0;
+        if (environment.kind == IBL_FOLDER)
+        {
+            this->loader.LoadCubeMap(&environment.loading[0], environment.paths, this->hdrFormat);
+            this->loader.LoadCubeMap(&environment.loading[1], environment.irradiancePaths, this->hdrFormat);
+            environment.loadingHDR = this->hdrFormat != GL_NONE;
+        }
+        else if (environment.kind == SKYBOX)
+        {
+            this->loader.LoadCubeMap(&environment.loading[0], environment.paths);
+            environment.loadingHDR = false;
+        }
+        else
+        {
+            this->bakeQueue.push_back(&environment);
+            environment.loadingHDR = true;
+        }
+        environment.placeholders[0] = environment.loading[0];
+        environment.placeholders[1] = environment.loading[1];
+    }
+
+    // we check the loading of an environment. It returns true when its cube maps are ready
+    bool advance(Environment& environment)
+    {
+        // the loader keeps the placeholder of a texture whose images can't be loaded
+        bool loaded = environment.loading[0] != environment.placeholders[0];
+        if (environment.kind == IBL_FOLDER)
+            loaded = loaded && environment.loading[1] != environment.placeholders[1];
+        if (environment.kind != EQUIRECTANGULAR && !loaded)
+        {
+            if (this->loader.Pending() == 0)
+                this->fail(environment);
+            return false;
+        }
+        if (environment.kind == IBL_FOLDER)
+            return true;
+
+        // the skybox is loaded: its irradiance is baked
+        if (&environment != this->baking)
+        {
+            if (environment.kind == SKYBOX && find(this->bakeQueue.begin(), this->bakeQueue.end(), &environment) == this->bakeQueue.end())
+                this->bakeQueue.push_back(&environment);
+            return false;
+        }
+        if (this->baker.Finished())
+        {
+            this->baker.TakeCubeMaps(environment.loading[0], environment.loading[1]);
+            this->baking = nullptr;
+            return true;
+        }
+        // the baker has abandoned the bake (the image can't be loaded)
+        if (!this->baker.Baking())
+            this->fail(environment);
+        return false;
+    }
+
+    void fail(Environment& environment)
+    {
+        cout << "Failed to load the environment: " << environment.name << endl;
+        if (&environment == this->baking)
+            this->baking = nullptr;
+        // the textures already completed are deleted (the placeholders kept by the loader too)
+        glDeleteTextures(2, environment.loading);
+        environment.loading[0] = environment.loading[1] = 0;
+        // a resident environment being loaded again keeps its cube maps
+        environment.state = environment.environment != 0 ? RESIDENT : FAILED;
+        if (this->selected >= 0 && this->environments[this->selected].get() == &environment)
+            this->selected = this->current;
+    }
+
+    //////////////////////////////////////////
+
+    void makeCurrent(int index)
+    {
+        this->current = index;
+        this->environments[index]->lastUse = ++this->useCounter;
+    }
+
+    // we delete the least recently used environments, until the resident ones fit in the budget
+    void evictLeastRecentlyUsed()
+    {
+        while (this->ResidentBytes() > this->ResidentBudget)
+        {
+            Environment* oldest = nullptr;
+            for (size_t i = 0; i < this->environments.size(); i++)
+            {
+                Environment& environment = *this->environments[i];
+                if (environment.state == RESIDENT && (int) i != this->current && (oldest == nullptr || environment.lastUse < oldest->lastUse))
+                    oldest = &environment;
+            }
+            if (oldest == nullptr)
+                return;
+            this->evict(*oldest);
+        }
+    }
+
+    void evict(Environment& environment)
+    {
+        this->deleteCubeMaps(environment);
+        environment.state = NOT_LOADED;
+    }
+
+    void deleteCubeMaps(Environment& environment)
+    {
+        GLuint textures[2] = {environment.environment, environment.irradiance};
+        glDeleteTextures(2, textures);
+        environment.environment = environment.irradiance = 0;
+        environment.bytes = 0;
+    }
+
+    //////////////////////////////////////////
+
+    // approximate size of a cube map in GPU memory: the base level of the 6 faces with the internal format, plus a third for the mipmaps
+    size_t cubeMapBytes(GLuint texture) const
+    {
+        GLint width, format;
+        glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
+        glGetTexLevelParameteriv(GL_TEXTURE_CUBE_MAP_POSITIVE_X, 0, GL_TEXTURE_WIDTH, &width);
+        glGetTexLevelParameteriv(GL_TEXTURE_CUBE_MAP_POSITIVE_X, 0, GL_TEXTURE_INTERNAL_FORMAT, &format);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+        // the 3 channel formats are usually padded to 4 channels
+        size_t texelSize = (format == GL_RGB16F || format == GL_RGBA16F) ? 8 : 4;
+        return 6 * (size_t) width * width * texelSize * 4 / 3;
+    }
+};
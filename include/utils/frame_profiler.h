@@ -0,0 +1,259 @@
+/*
+FrameProfiler class
+- CPU timing of each frame, split in named scopes (e.g. input polling, update, draw submission, swap)
+- the thread running the frames pushes one record per frame in a lock-free ring buffer (single producer, single consumer):
+  the records are collected by the thread showing the statistics, which may be a different one
+- statistics over the most recent frames (percentiles, max, histogram of the frame times)
+- capture of every frame for a given duration, and export to CSV
+
+N.B. 1) the time of a scope is the time elapsed from the previous Mark (or from BeginFrame) to its Mark.
+The time of the frame goes from BeginFrame to EndFrame, so with vsync it includes the wait in the swap
+
+N.B. 2) if the ring buffer is full (the consumer doesn't collect the records), the new records are dropped and counted
+
+Real-Time Graphics Programming - a.a. 2019/2020
+Master degree in Computer Science
+Universita' degli Studi di Milano
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <string>
+#include <vector>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <fstream>
+
+/////////////////// RING BUFFER class ///////////////////////
+// lock-free queue with fixed capacity, for one producer thread and one consumer thread
+template <typename T, size_t Capacity>
+class RingBuffer
+{
+public:
+    // called only by the producer. Returns false if the buffer is full
+    bool Push(const T& item)
+    {
+        size_t head = this->head.load(memory_order_relaxed);
+        size_t next = (head + 1) % Capacity;
+        // the slot is free only when the consumer has moved past it
+        if (next == this->tail.load(memory_order_acquire))
+            return false;
+        this->items[head] = item;
+        // the item is written before the new head is visible to the consumer
+        this->head.store(next, memory_order_release);
+        return true;
+    }
+
+    // called only by the consumer. Returns false if the buffer is empty
+    bool Pop(T& item)
+    {
+        size_t tail = this->tail.load(memory_order_relaxed);
+        if (tail == this->head.load(memory_order_acquire))
+            return false;
+        item = this->items[tail];
+        this->tail.store((tail + 1) % Capacity, memory_order_release);
+        return true;
+    }
+
+private:
+    array<T, Capacity> items;
+    // next slot to write (producer), and next slot to read (consumer)
+    atomic<size_t> head{0}, tail{0};
+};
+
+/////////////////// FRAME PROFILER class ///////////////////////
+class FrameProfiler
+{
+public:
+    // maximum number of scopes of a frame
+    static constexpr int MAX_SCOPES = 8;
+
+    // the timings of a frame, in milliseconds
+    struct FrameRecord
+    {
+        GLuint frame;
+        GLfloat total;
+        GLfloat scopes[MAX_SCOPES];
+    };
+
+    // names of the scopes, in the order of the frame
+    vector<string> ScopeNames;
+    // number of records dropped because the ring buffer was full
+    atomic<GLuint> Dropped{0};
+
+    //////////////////////////////////////////
+
+    // constructor
+    // window is the number of recent frames used for the statistics
+    FrameProfiler(const vector<string>& scopeNames, GLuint window = 512)
+        : ScopeNames(scopeNames), history(window)
+    {
+        this->ScopeNames.resize(min<size_t>(this->ScopeNames.size(), MAX_SCOPES));
+    }
+
+    //////////////////////////////////////////
+    // PRODUCER SIDE (the thread running the frames)
+
+    // we start the timing of a frame
+    void BeginFrame()
+    {
+        this->frameStart = this->lastMark = Clock::now();
+        this->current = FrameRecord();
+        this->current.frame = this->frameCount++;
+    }
+
+    // the index of the frame started by the last BeginFrame (the same of its record)
+    GLuint CurrentFrame() const
+    {
+        return this->current.frame;
+    }
+
+    // the scope with the given index ends here
+    void Mark(int scope)
+    {
+        Clock::time_point now = Clock::now();
+        this->current.scopes[scope] += milliseconds(now - this->lastMark);
+        this->lastMark = now;
+    }
+
+    // we complete the timing of the frame, and we give it to the consumer
+    void EndFrame()
+    {
+        this->current.total = milliseconds(Clock::now() - this->frameStart);
+        if (!this->records.Push(this->current))
+            this->Dropped++;
+    }
+
+    //////////////////////////////////////////
+    // CONSUMER SIDE (the thread showing the statistics)
+
+    // we move the new records in the window of the statistics, and in the capture if it is running
+    void Collect()
+    {
+        FrameRecord record;
+        while (this->records.Pop(record))
+        {
+            this->history[this->position] = record;
+            this->position = (this->position + 1) % this->history.size();
+            this->count = min<GLuint>(this->count + 1, this->history.size());
+            if (this->capturing)
+                this->captured.push_back(record);
+        }
+    }
+
+    // number of frames in the window of the statistics
+    GLuint Count() const { return this->count; }
+
+    // percentile (p in [0,1]) of the frame times in the window, or of one scope if scope >= 0
+    GLfloat Percentile(GLfloat p, int scope = -1) const
+    {
+        vector<GLfloat> times = this->times(scope);
+        if (times.empty())
+            return 0.0f;
+        GLuint rank = min<GLuint>(times.size() - 1, (GLuint) (p * times.size()));
+        nth_element(times.begin(), times.begin() + rank, times.end());
+        return times[rank];
+    }
+
+    GLfloat Max(int scope = -1) const
+    {
+        vector<GLfloat> times = this->times(scope);
+        return times.empty() ? 0.0f : *max_element(times.begin(), times.end());
+    }
+
+    GLfloat Average(int scope = -1) const
+    {
+        vector<GLfloat> times = this->times(scope);
+        GLfloat sum = 0.0f;
+        for (GLfloat time : times)
+            sum += time;
+        return times.empty() ? 0.0f : sum / times.size();
+    }
+
+    // number of frames in each of the bins, which evenly divide [0, maxTime] (the last bin includes the longer frames)
+    vector<GLfloat> Histogram(GLuint bins, GLfloat maxTime) const
+    {
+        vector<GLfloat> histogram(bins, 0.0f);
+        for (GLfloat time : this->times(-1))
+            histogram[min<GLuint>(bins - 1, (GLuint) (time / maxTime * bins))] += 1.0f;
+        return histogram;
+    }
+
+    // the frame times in the window, from the oldest to the most recent
+    vector<GLfloat> FrameTimes() const
+    {
+        vector<GLfloat> times;
+        for (GLuint i = 0; i < this->count; i++)
+            times.push_back(this->history[(this->position + this->history.size() - this->count + i) % this->history.size()].total);
+        return times;
+    }
+
+    //////////////////////////////////////////
+
+    // every frame collected during the capture is stored
+    void StartCapture()
+    {
+        this->captured.clear();
+        this->capturing = true;
+    }
+
+    void StopCapture() { this->capturing = false; }
+
+    bool Capturing() const { return this->capturing; }
+
+    // we save the captured frames in a CSV file: one row for each frame, with the total time and the time of each scope
+    bool SaveCSV(const string& path) const
+    {
+        ofstream file(path);
+        if (!file)
+            return false;
+        file << "frame,total_ms";
+        for (const string& name : this->ScopeNames)
+            file << "," << name << "_ms";
+        file << "\n";
+        for (const FrameRecord& record : this->captured)
+        {
+            file << record.frame << "," << record.total;
+            for (size_t i = 0; i < this->ScopeNames.size(); i++)
+                file << "," << record.scopes[i];
+            file << "\n";
+        }
+        return true;
+    }
+
+private:
+    using Clock = chrono::steady_clock;
+
+    static GLfloat milliseconds(Clock::duration duration)
+    {
+        return chrono::duration<GLfloat, milli>(duration).count();
+    }
+
+    // producer state
+    Clock::time_point frameStart, lastMark;
+    FrameRecord current;
+    GLuint frameCount = 0;
+
+    // the records travel from the producer to the consumer
+    RingBuffer<FrameRecord, 256> records;
+
+    // consumer state: circular window of the recent frames, and the capture
+    vector<FrameRecord> history;
+    GLuint position = 0, count = 0;
+    vector<FrameRecord> captured;
+    bool capturing = false;
+
+    // the times of the frames (scope < 0) or of one scope in the window
+    vector<GLfloat> times(int scope) const
+    {
+        vector<GLfloat> times(this->count);
+        for (GLuint i = 0; i < this->count; i++)
+            times[i] = scope < 0 ? this->history[i].total : this->history[i].scopes[scope];
+        return times;
+    }
+};
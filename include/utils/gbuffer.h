@@ -0,0 +1,212 @@
+/*
+GBuffer class
+- framebuffer of the geometry pass of the deferred shading: the objects are rendered with the GBUFFER_PASS version of the illumination shader,
+  which does the displacement and the map lookups, and stores the resulting surface of each pixel in the G-buffer
+- Shade draws a full-screen triangle in the output framebuffer, with the DEFERRED_SHADING version of the illumination shader:
+  the environment is integrated once per pixel, whatever the overdraw of the geometry pass
+- ShadeSpecular integrates the specular term in a low resolution target (GL_RGBA16F, 1 / divisor of the pixels in each direction),
+  with the SPECULAR_PASS version: then the shading pass upsamples it with a joint bilateral filter, guided by the depth and the normals of the G-buffer
+- layout of the G-buffer (see the outputs of GBUFFER_PASS in env_bump_aniso.frag):
+    0: GL_RGBA16  octahedral encodings of the world normal and tangent (the bitangent is their cross product)
+    1: GL_RGBA8   albedo and ambient occlusion
+    2: GL_RGBA16  F0 and index of the shininess pair
+    3: GL_RG16F   motion vector (for the temporal accumulation)
+    depth: GL_DEPTH_COMPONENT24, from which the shading pass reconstructs the position of the pixel
+
+N.B. 1) the shading pass reads the G-buffer with texelFetch: it must have the same size of the output framebuffer
+
+N.B. 2) the shading pass uses the TEXTURE_UNITS texture units starting from firstUnit: they must not be used by the other textures
+which keep their units for the whole application
+
+N.B. 3) the shading pass writes the depth of the G-buffer in the output framebuffer, so that the passes after it (e.g. the skybox)
+are depth tested against the objects
+
+Real-Time Graphics Programming - a.a. 2019/2020
+Master degree in Computer Science
+Universita' degli Studi di Milano
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <iostream>
+
+/////////////////// GBUFFER class ///////////////////////
+class GBuffer
+{
+public:
+    // number of texture units used by the shading pass, starting from firstUnit
+    static const GLuint TEXTURE_UNITS = 6;
+
+    //////////////////////////////////////////
+
+    // constructor
+    // width and height are the size of the viewport
+    GBuffer(GLint width, GLint height, GLuint firstUnit)
+        : width(width), height(height), firstUnit(firstUnit)
+    {
+        glGenTextures(NUM_TARGETS, this->targets);
+        this->createTexture(this->targets[FRAME_TARGET], GL_RGBA16, GL_RGBA);
+        this->createTexture(this->targets[MATERIAL_TARGET], GL_RGBA8, GL_RGBA);
+        this->createTexture(this->targets[SURFACE_TARGET], GL_RGBA16, GL_RGBA);
+        this->createTexture(this->targets[VELOCITY_TARGET], GL_RG16F, GL_RG);
+        glGenTextures(1, &this->depthTexture);
+        this->createTexture(this->depthTexture, GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT);
+
+        glGenFramebuffers(1, &this->FBO);
+        glBindFramebuffer(GL_FRAMEBUFFER, this->FBO);
+        GLenum drawBuffers[NUM_TARGETS];
+        for (GLuint i = 0; i < NUM_TARGETS; i++)
+        {
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, this->targets[i], 0);
+            drawBuffers[i] = GL_COLOR_ATTACHMENT0 + i;
+        }
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, this->depthTexture, 0);
+        glDrawBuffers(NUM_TARGETS, drawBuffers);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            cout << "ERROR::GBUFFER: the framebuffer is not complete" << endl;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        // the full-screen triangle has no attributes, but a VAO must be bound to draw it
+        glGenVertexArrays(1, &this->emptyVAO);
+    }
+
+    // the class owns OpenGL objects: we disallow copies
+    GBuffer(const GBuffer& copy) = delete;
+    GBuffer& operator=(const GBuffer& copy) = delete;
+
+    // destructor
+    ~GBuffer()
+    {
+        this->freeSpecularTarget();
+        glDeleteVertexArrays(1, &this->emptyVAO);
+        glDeleteFramebuffers(1, &this->FBO);
+        glDeleteTextures(1, &this->depthTexture);
+        glDeleteTextures(NUM_TARGETS, this->targets);
+    }
+
+    //////////////////////////////////////////
+
+    // we assign the texture units of the G-buffer to the samplers of the shading pass
+    void SetupTextureUnits(GLuint program)
+    {
+        glUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, "gFrame"), this->firstUnit + FRAME_TARGET);
+        glUniform1i(glGetUniformLocation(program, "gMaterial"), this->firstUnit + MATERIAL_TARGET);
+        glUniform1i(glGetUniformLocation(program, "gSurface"), this->firstUnit + SURFACE_TARGET);
+        glUniform1i(glGetUniformLocation(program, "gVelocity"), this->firstUnit + VELOCITY_TARGET);
+        glUniform1i(glGetUniformLocation(program, "gDepth"), this->firstUnit + NUM_TARGETS);
+        glUniform1i(glGetUniformLocation(program, "lowResSpecular"), this->firstUnit + NUM_TARGETS + 1);
+        glUseProgram(0);
+    }
+
+    // we bind and clear the G-buffer, for the geometry pass
+    void Begin()
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, this->FBO);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+
+    // we integrate the specular term in the low resolution target, with the Shader Program in use
+    // (the target is created again when the divisor changes)
+    void ShadeSpecular(GLuint divisor)
+    {
+        GLint lowResWidth = (this->width + divisor - 1) / divisor, lowResHeight = (this->height + divisor - 1) / divisor;
+        if (divisor != this->specularDivisor)
+        {
+            this->freeSpecularTarget();
+            glGenTextures(1, &this->specularTexture);
+            this->createTexture(this->specularTexture, GL_RGBA16F, GL_RGBA, lowResWidth, lowResHeight);
+            glGenFramebuffers(1, &this->specularFBO);
+            glBindFramebuffer(GL_FRAMEBUFFER, this->specularFBO);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, this->specularTexture, 0);
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+                cout << "ERROR::GBUFFER: the specular framebuffer is not complete" << endl;
+            this->specularDivisor = divisor;
+        }
+
+        glBindFramebuffer(GL_FRAMEBUFFER, this->specularFBO);
+        glViewport(0, 0, lowResWidth, lowResHeight);
+        // the target has no depth buffer
+        glDisable(GL_DEPTH_TEST);
+        this->drawTriangle();
+        glEnable(GL_DEPTH_TEST);
+        glViewport(0, 0, this->width, this->height);
+    }
+
+    // we shade the G-buffer in the output framebuffer (which stays bound), with the Shader Program in use
+    // (the pixels without objects are discarded, so the output must have been cleared)
+    void Shade(GLuint outputFBO)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, outputFBO);
+        // it always writes the depth of the G-buffer
+        glDepthFunc(GL_ALWAYS);
+        this->drawTriangle();
+        glDepthFunc(GL_LESS);
+    }
+
+private:
+    // the color attachments, in the order of the outputs of the geometry pass
+    enum Target { FRAME_TARGET, MATERIAL_TARGET, SURFACE_TARGET, VELOCITY_TARGET, NUM_TARGETS };
+
+    GLint width, height;
+    GLuint firstUnit;
+
+    GLuint targets[NUM_TARGETS], depthTexture, FBO;
+    GLuint emptyVAO;
+    // the low resolution specular term (0 until ShadeSpecular is called), and its divisor of the resolution
+    GLuint specularTexture = 0, specularFBO = 0, specularDivisor = 0;
+
+    //////////////////////////////////////////
+
+    // we bind the G-buffer to its texture units, and we draw the full-screen triangle
+    void drawTriangle()
+    {
+        for (GLuint i = 0; i < NUM_TARGETS; i++)
+        {
+            glActiveTexture(GL_TEXTURE0 + this->firstUnit + i);
+            glBindTexture(GL_TEXTURE_2D, this->targets[i]);
+        }
+        glActiveTexture(GL_TEXTURE0 + this->firstUnit + NUM_TARGETS);
+        glBindTexture(GL_TEXTURE_2D, this->depthTexture);
+        glActiveTexture(GL_TEXTURE0 + this->firstUnit + NUM_TARGETS + 1);
+        glBindTexture(GL_TEXTURE_2D, this->specularTexture);
+
+        // the triangle must be filled also in wireframe mode
+        GLint polygonMode[2];
+        glGetIntegerv(GL_POLYGON_MODE, polygonMode);
+        glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+        glBindVertexArray(this->emptyVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(0);
+        glPolygonMode(GL_FRONT_AND_BACK, polygonMode[0]);
+    }
+
+    void freeSpecularTarget()
+    {
+        if (this->specularTexture)
+        {
+            glDeleteFramebuffers(1, &this->specularFBO);
+            glDeleteTextures(1, &this->specularTexture);
+        }
+    }
+
+    // the shading pass reads the texels of its pixels: no filtering
+    void createTexture(GLuint texture, GLint internalFormat, GLenum format)
+    {
+        this->createTexture(texture, internalFormat, format, this->width, this->height);
+    }
+
+    void createTexture(GLuint texture, GLint internalFormat, GLenum format, GLint width, GLint height)
+    {
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, GL_FLOAT, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+};
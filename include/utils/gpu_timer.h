@@ -0,0 +1,262 @@
+/*
+GPUTimer class
+- measurement of the GPU time of a render pass, with GL_TIME_ELAPSED queries placed around its commands
+- the queries are used in rotation: the result of a query is read only when the query is reused some frames later,
+  when the GPU has already executed it, so reading it never stalls the pipeline
+- rolling statistics (last, min, average, percentiles) over the most recent frames
+- recording of every measured sample between StartRecording and StopRecording, and export of the recordings of a set of timers to CSV and JSON.
+  Each query is tagged with the index of its frame: the results arrive some frames later, and a timer measures only the frames where its pass runs,
+  so the samples of the timers are matched by frame
+
+N.B. 1) only one GL_TIME_ELAPSED query can be active at a time: the passes measured with different timers must not overlap
+
+N.B. 2) the timers measure what the driver reports: software renderers (e.g. llvmpipe) rasterize when the commands are flushed,
+so their queries may measure only a part of the work
+
+Real-Time Graphics Programming - a.a. 2019/2020
+Master degree in Computer Science
+Universita' degli Studi di Milano
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+
+/////////////////// GPU TIMER class ///////////////////////
+class GPUTimer
+{
+public:
+    // name of the measured pass
+    string Name;
+    // the most recent measurement, in milliseconds
+    GLfloat Last = 0.0f;
+    // number of queries used in rotation: a query is reused (and read) NUM_QUERIES frames after it has been issued,
+    // so Last is the measurement of the pass of NUM_QUERIES frames ago
+    static constexpr int NUM_QUERIES = 3;
+
+    // a recorded measurement, with the index of the frame of its pass
+    struct Sample
+    {
+        GLuint frame;
+        GLfloat time;
+    };
+
+    //////////////////////////////////////////
+
+    // constructor
+    // window is the number of recent samples used for the statistics
+    GPUTimer(const string& name, GLuint window = 256)
+        : Name(name), samples(window, 0.0f)
+    {
+        glGenQueries(NUM_QUERIES, this->queries);
+    }
+
+    // the timer owns OpenGL queries: we disallow copies
+    GPUTimer(const GPUTimer& copy) = delete;
+    GPUTimer& operator=(const GPUTimer& copy) = delete;
+
+    // destructor
+    ~GPUTimer()
+    {
+        glDeleteQueries(NUM_QUERIES, this->queries);
+    }
+
+    //////////////////////////////////////////
+
+    // we start the measurement of the pass in the given frame. The result of the query we reuse is collected first
+    void Begin(GLuint frame)
+    {
+        this->collect(this->next);
+        this->frames[this->next] = frame;
+        glBeginQuery(GL_TIME_ELAPSED, this->queries[this->next]);
+    }
+
+    // we end the measurement of the pass
+    void End()
+    {
+        glEndQuery(GL_TIME_ELAPSED);
+        this->pending[this->next] = true;
+        this->next = (this->next + 1) % NUM_QUERIES;
+    }
+
+    // we collect the results of all of the queries still pending (it waits for the GPU)
+    void Flush()
+    {
+        // from the oldest query to the most recent, so that the samples are stored in order
+        for (int i = 0; i < NUM_QUERIES; i++)
+            this->collect((this->next + i) % NUM_QUERIES);
+    }
+
+    //////////////////////////////////////////
+
+    // statistics of the samples in the window, in milliseconds
+    GLfloat Min() const
+    {
+        return this->count == 0 ? 0.0f : *min_element(this->samples.begin(), this->samples.begin() + this->count);
+    }
+
+    GLfloat Average() const
+    {
+        GLfloat sum = 0.0f;
+        for (GLuint i = 0; i < this->count; i++)
+            sum += this->samples[i];
+        return this->count == 0 ? 0.0f : sum / this->count;
+    }
+
+    // p in [0,1] (e.g. 0.99 for the 99th percentile)
+    GLfloat Percentile(GLfloat p) const
+    {
+        if (this->count == 0)
+            return 0.0f;
+        vector<GLfloat> sorted(this->samples.begin(), this->samples.begin() + this->count);
+        GLuint rank = min<GLuint>(this->count - 1, (GLuint) (p * this->count));
+        nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        return sorted[rank];
+    }
+
+    //////////////////////////////////////////
+
+    // every sample measured while recording is stored, in order of frame. The results of the queries of the frames before firstFrame
+    // (still pending when the recording starts) are not recorded
+    void StartRecording(GLuint firstFrame)
+    {
+        this->recorded.clear();
+        this->recording = true;
+        this->firstFrame = firstFrame;
+    }
+
+    void StopRecording() { this->recording = false; }
+
+    const vector<Sample>& Recorded() const { return this->recorded; }
+
+    // the recorded sample of a frame, or nullptr if the pass has not been measured in that frame
+    const Sample* RecordedFrame(GLuint frame) const
+    {
+        auto sample = lower_bound(this->recorded.begin(), this->recorded.end(), frame,
+                                  [](const Sample& sample, GLuint frame) { return sample.frame < frame; });
+        return sample != this->recorded.end() && sample->frame == frame ? &*sample : nullptr;
+    }
+
+    //////////////////////////////////////////
+
+    // we save the recordings of the timers in a CSV file: one row for each frame, one column for each timer.
+    // The cell of a pass which did not run in the frame is empty
+    static bool SaveCSV(const vector<GPUTimer*>& timers, const string& path)
+    {
+        ofstream file(path);
+        if (!file)
+            return false;
+        file << "frame";
+        for (const GPUTimer* timer : timers)
+            file << "," << timer->Name << "_ms";
+        file << "\n";
+        GLuint first, last;
+        if (!recordedFrames(timers, first, last))
+            return true;
+        // the samples of each timer are in order of frame: we walk them in parallel
+        vector<size_t> cursors(timers.size(), 0);
+        for (GLuint frame = first; frame <= last; frame++)
+        {
+            file << frame;
+            for (size_t t = 0; t < timers.size(); t++)
+            {
+                const vector<Sample>& samples = timers[t]->recorded;
+                file << ",";
+                if (cursors[t] < samples.size() && samples[cursors[t]].frame == frame)
+                    file << samples[cursors[t]++].time;
+            }
+            file << "\n";
+        }
+        return true;
+    }
+
+    // we save the recordings of the timers in a JSON file: a summary, the array of samples and the array of their frames for each timer
+    static bool SaveJSON(const vector<GPUTimer*>& timers, const string& path)
+    {
+        ofstream file(path);
+        if (!file)
+            return false;
+        file << "{\n  \"unit\": \"ms\",\n  \"passes\": [";
+        for (size_t t = 0; t < timers.size(); t++)
+        {
+            const vector<Sample>& samples = timers[t]->recorded;
+            vector<GLfloat> sorted;
+            GLfloat sum = 0.0f;
+            for (const Sample& sample : samples)
+            {
+                sorted.push_back(sample.time);
+                sum += sample.time;
+            }
+            sort(sorted.begin(), sorted.end());
+            file << (t == 0 ? "\n" : ",\n") << "    {\"name\": \"" << timers[t]->Name << "\", \"count\": " << samples.size();
+            if (!samples.empty())
+                file << ", \"min\": " << sorted.front() << ", \"avg\": " << sum / samples.size()
+                     << ", \"p50\": " << sorted[sorted.size() / 2] << ", \"p99\": " << sorted[min(sorted.size() - 1, sorted.size() * 99 / 100)]
+                     << ", \"max\": " << sorted.back();
+            file << ", \"samples\": [";
+            for (size_t i = 0; i < samples.size(); i++)
+                file << (i == 0 ? "" : ", ") << samples[i].time;
+            file << "], \"frames\": [";
+            for (size_t i = 0; i < samples.size(); i++)
+                file << (i == 0 ? "" : ", ") << samples[i].frame;
+            file << "]}";
+        }
+        file << "\n  ]\n}\n";
+        return true;
+    }
+
+private:
+    GLuint queries[NUM_QUERIES];
+    bool pending[NUM_QUERIES] = {false, false, false};
+    // the frame of the pass measured by each query
+    GLuint frames[NUM_QUERIES] = {0, 0, 0};
+    int next = 0;
+
+    // circular buffer of the recent samples
+    vector<GLfloat> samples;
+    GLuint position = 0, count = 0;
+
+    vector<Sample> recorded;
+    bool recording = false;
+    GLuint firstFrame = 0;
+
+    //////////////////////////////////////////
+
+    // we read the result of a query, if it has been issued and not read yet
+    void collect(int query)
+    {
+        if (!this->pending[query])
+            return;
+        GLuint64 elapsed;
+        glGetQueryObjectui64v(this->queries[query], GL_QUERY_RESULT, &elapsed);
+        this->pending[query] = false;
+
+        this->Last = elapsed * 1e-6f;
+        this->samples[this->position] = this->Last;
+        this->position = (this->position + 1) % this->samples.size();
+        this->count = min<GLuint>(this->count + 1, this->samples.size());
+        if (this->recording && this->frames[query] >= this->firstFrame)
+            this->recorded.push_back({this->frames[query], this->Last});
+    }
+
+    // the range of frames of the exported tables. Returns false if no timer has recorded samples
+    static bool recordedFrames(const vector<GPUTimer*>& timers, GLuint& first, GLuint& last)
+    {
+        bool found = false;
+        for (const GPUTimer* timer : timers)
+        {
+            if (timer->recorded.empty())
+                continue;
+            first = found ? min(first, timer->recorded.front().frame) : timer->recorded.front().frame;
+            last = found ? max(last, timer->recorded.back().frame) : timer->recorded.back().frame;
+            found = true;
+        }
+        return found;
+    }
+};
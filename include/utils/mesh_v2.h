@@ -16,7 +16,12 @@ Moreover, we want to have, CPU-side, a Mesh instance, with associated GPU resour
 
 N.B. 2) no texturing in this version of the class
 
-N.B. 3) based on https://github.com/JoeyDeVries/LearnOpenGL/blob/master/includes/learnopengl/mesh.h
+N.B. 3) instanced rendering: SetInstanceBuffer adds to the VAO the attributes of the instances (InstanceData, one element for each instance),
+then DrawInstanced renders all of the instances with a single draw call. The buffer is owned by the caller.
+The attributes of the instances use all of the remaining locations (up to 15, the minimum GL_MAX_VERTEX_ATTRIBS is 16):
+the normal matrix is not an attribute, the vertex shader computes it from the model matrix
+
+N.B. 4) based on https://github.com/JoeyDeVries/LearnOpenGL/blob/master/includes/learnopengl/mesh.h
 
 author: Davide Gadia, Michael Marchesan
 
@@ -46,6 +51,23 @@ struct Vertex {
     glm::vec3 Bitangent;
 };
 
+// data structure for the attributes of an instance (instanced rendering)
+struct InstanceData {
+    // model matrix
+    glm::mat4 ModelMatrix;
+    // model matrix of the previous frame (motion vectors)
+    glm::mat4 PreviousModelMatrix;
+    // Fresnel reflectance at normal incidence
+    glm::vec3 F0;
+    // UV repetitions
+    glm::vec2 Repeat;
+    // index of the material, and index of the (nU, nV) shininess pair
+    glm::ivec2 Material;
+};
+
+// the first location of the attributes of the instances in the shaders, after the attributes of the vertices
+const GLuint INSTANCE_ATTRIBUTES_LOCATION = 5;
+
 /////////////////// MESH class ///////////////////////
 class Mesh {
 public:
@@ -138,6 +160,50 @@ public:
         glBindVertexArray(0);
     }
 
+    // rendering of the given number of instances of the mesh (SetInstanceBuffer must have been called)
+    void DrawInstanced(GLsizei instances)
+    {
+        glBindVertexArray(this->VAO);
+        glDrawElementsInstanced(GL_TRIANGLES, this->indices.size(), GL_UNSIGNED_INT, 0, instances);
+        glBindVertexArray(0);
+    }
+
+    //////////////////////////////////////////
+
+    // we set in the VAO the pointers to the attributes of the instances, stored in buffer as an array of InstanceData
+    // the attributes advance once per instance instead of once per vertex (divisor = 1)
+    void SetInstanceBuffer(GLuint buffer)
+    {
+        glBindVertexArray(this->VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        GLuint location = INSTANCE_ATTRIBUTES_LOCATION;
+        // a matrix attribute occupies one location for each column
+        for (GLuint i = 0; i < 4; i++, location++)
+        {
+            glEnableVertexAttribArray(location);
+            glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (GLvoid*)(offsetof(InstanceData, ModelMatrix) + i * sizeof(glm::vec4)));
+            glVertexAttribDivisor(location, 1);
+        }
+        for (GLuint i = 0; i < 4; i++, location++)
+        {
+            glEnableVertexAttribArray(location);
+            glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (GLvoid*)(offsetof(InstanceData, PreviousModelMatrix) + i * sizeof(glm::vec4)));
+            glVertexAttribDivisor(location, 1);
+        }
+        glEnableVertexAttribArray(location);
+        glVertexAttribPointer(location, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (GLvoid*)offsetof(InstanceData, F0));
+        glVertexAttribDivisor(location++, 1);
+        glEnableVertexAttribArray(location);
+        glVertexAttribPointer(location, 2, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (GLvoid*)offsetof(InstanceData, Repeat));
+        glVertexAttribDivisor(location++, 1);
+        // integer attribute: it must not be converted to float
+        glEnableVertexAttribArray(location);
+        glVertexAttribIPointer(location, 2, GL_INT, sizeof(InstanceData), (GLvoid*)offsetof(InstanceData, Material));
+        glVertexAttribDivisor(location, 1);
+
+        glBindVertexArray(0);
+    }
+
 private:
 
     // VBO and EBO
@@ -84,6 +84,19 @@ public:
             this->meshes[i].Draw();
     }
 
+    // instanced rendering: each mesh reads the attributes of the instances from the same buffer (see InstanceData in mesh_v2.h)
+    void SetInstanceBuffer(GLuint buffer)
+    {
+        for(GLuint i = 0; i < this->meshes.size(); i++)
+            this->meshes[i].SetInstanceBuffer(buffer);
+    }
+
+    void DrawInstanced(GLsizei instances)
+    {
+        for(GLuint i = 0; i < this->meshes.size(); i++)
+            this->meshes[i].DrawInstanced(instances);
+    }
+
     //////////////////////////////////////////
 
 
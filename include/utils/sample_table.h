@@ -0,0 +1,115 @@
+/*
+SampleTable class
+- table of the half vectors of the specular integration (see Table_Samples in env_bump_aniso.frag), stored in a uniform buffer:
+  for each (nU, nV) shininess pair, the half vectors of the Hammersley points of the unit square, for the current sample count
+- the half vectors are computed with the closed form of the Ashikhmin-Shirley importance sampling (the same mapping of the LUTs
+  built by halfVectorSampling.cpp, see Analytic_Samples), in full precision: xyz is the half vector in tangent space,
+  w is its probability density without the normalization constant
+- Update builds the table again only when the sample count changes
+
+N.B. 1) the table holds MAX_SAMPLES entries (the 16 KB which every implementation supports for a uniform block): if the samples
+of all of the shininess pairs do not fit, the table is left empty, and the shader falls back to the closed form
+
+N.B. 2) the uniform block of the shaders ("SampleTable") must be assigned to the binding point of the table with glUniformBlockBinding:
+OpenGL 4.1 has no binding layout qualifier for the blocks
+
+Real-Time Graphics Programming - a.a. 2019/2020
+Master degree in Computer Science
+Universita' degli Studi di Milano
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <vector>
+
+#include <glm/glm.hpp>
+
+/////////////////// SAMPLE TABLE class ///////////////////////
+class SampleTable
+{
+public:
+    // number of vec4 entries of the table (MAX_TABLE_SAMPLES in env_bump_aniso.frag)
+    static const GLuint MAX_SAMPLES = 1024;
+
+    //////////////////////////////////////////
+
+    // constructor
+    // binding is the binding point of the uniform buffer
+    SampleTable(GLuint binding)
+        : binding(binding)
+    {
+        glGenBuffers(1, &this->UBO);
+        glBindBuffer(GL_UNIFORM_BUFFER, this->UBO);
+        glBufferData(GL_UNIFORM_BUFFER, MAX_SAMPLES * sizeof(glm::vec4), nullptr, GL_STATIC_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        glBindBufferBase(GL_UNIFORM_BUFFER, this->binding, this->UBO);
+    }
+
+    // the class owns OpenGL objects: we disallow copies
+    SampleTable(const SampleTable& copy) = delete;
+    SampleTable& operator=(const SampleTable& copy) = delete;
+
+    // destructor
+    ~SampleTable()
+    {
+        glDeleteBuffers(1, &this->UBO);
+    }
+
+    //////////////////////////////////////////
+
+    // we build the table of the given sample count, if it is not the current one.
+    // It returns the number of samples of each pair in the table (0 if they do not fit)
+    GLuint Update(const vector<glm::vec2>& shininessPairs, GLuint sampleCount)
+    {
+        if (sampleCount == this->requestedSamples)
+            return this->tableSamples;
+        this->requestedSamples = sampleCount;
+        this->tableSamples = shininessPairs.size() * sampleCount <= MAX_SAMPLES ? sampleCount : 0;
+        if (this->tableSamples == 0)
+            return 0;
+
+        // the samples of pair p are the entries from p * sampleCount
+        vector<glm::vec4> samples;
+        samples.reserve(shininessPairs.size() * sampleCount);
+        for (const glm::vec2& pair : shininessPairs)
+            for (GLuint i = 0; i < sampleCount; i++)
+                samples.push_back(this->halfVector(pair, glm::vec2((float) i / sampleCount, this->radicalInverse(i))));
+
+        glBindBuffer(GL_UNIFORM_BUFFER, this->UBO);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, samples.size() * sizeof(glm::vec4), samples.data());
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        return this->tableSamples;
+    }
+
+private:
+    GLuint binding, UBO;
+    // the sample count of the last Update, and the one stored in the table
+    GLuint requestedSamples = 0, tableSamples = 0;
+
+    //////////////////////////////////////////
+
+    // Van der Corput sequence (the second coordinate of the Hammersley points, as in env_bump_aniso.frag)
+    float radicalInverse(GLuint bits)
+    {
+        bits = (bits << 16u) | (bits >> 16u);
+        bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+        bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+        bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+        bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+        return (float) bits * 2.3283064365386963e-10f; // / 0x100000000
+    }
+
+    // Ashikhmin-Shirley importance sampling of the half vector, for the point Xi of the unit square (see Analytic_Samples)
+    glm::vec4 halfVector(const glm::vec2& shininess, const glm::vec2& Xi)
+    {
+        const float PI = 3.14159265359f;
+        glm::vec2 phi = glm::normalize(glm::vec2(glm::cos(2.0f * PI * Xi.x), glm::sqrt((shininess.x + 1.0f) / (shininess.y + 1.0f)) * glm::sin(2.0f * PI * Xi.x)));
+        float exponent = shininess.x * phi.x * phi.x + shininess.y * phi.y * phi.y;
+        float cosTheta = glm::pow(1.0f - Xi.y, 1.0f / (exponent + 1.0f));
+        float sinTheta = glm::sqrt(glm::max(1.0f - cosTheta * cosTheta, 0.0f));
+        return glm::vec4(sinTheta * phi, cosTheta, glm::pow(cosTheta, exponent));
+    }
+};
@@ -0,0 +1,411 @@
+/*
+Scene class
+- container of the instances of the models in the scene: each instance has its attributes (transformations and material parameters, InstanceData in mesh_v2.h)
+  and its bounding box in world coordinates
+- Bounding Volume Hierarchy (BVH) of the bounding boxes: built top-down, splitting the instances at the median of the axis with the largest extent.
+  When an instance moves, the boxes of its leaf and of the ancestors are refitted; the tree is rebuilt only when the refits have made it too loose
+- frustum culling: the planes of the view frustum are extracted from the projection and view matrices (Gribb-Hartmann method),
+  and the BVH is traversed skipping the subtrees outside of the frustum (and accepting without tests the subtrees completely inside)
+- the visible instances are grouped by model, and uploaded in the instance buffers of the models for instanced rendering
+- each instance keeps also its model matrix of the previous frame (for the motion vectors): NextFrame must be called once per frame, before the instances are moved
+
+N.B. 1) the Scene creates an instance buffer for each model, and it assigns it to the model (Model::SetInstanceBuffer). The models must outlive the Scene
+
+N.B. 2) the bounding box of an instance is the box of its model transformed by the model matrix (it contains the instance, but it may be larger than its tight box)
+
+Real-Time Graphics Programming - a.a. 2019/2020
+Master degree in Computer Science
+Universita' degli Studi di Milano
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+// Model and InstanceData
+#include <utils/model_v2.h>
+
+/////////////////// AABB struct ///////////////////////
+// axis aligned bounding box
+struct AABB
+{
+    glm::vec3 Min = glm::vec3(numeric_limits<GLfloat>::max());
+    glm::vec3 Max = glm::vec3(-numeric_limits<GLfloat>::max());
+
+    void Merge(const glm::vec3& point)
+    {
+        this->Min = glm::min(this->Min, point);
+        this->Max = glm::max(this->Max, point);
+    }
+
+    void Merge(const AABB& box)
+    {
+        this->Min = glm::min(this->Min, box.Min);
+        this->Max = glm::max(this->Max, box.Max);
+    }
+
+    glm::vec3 Center() const { return 0.5f * (this->Min + this->Max); }
+
+    // half of the surface area (the constant factor does not matter for the comparisons)
+    GLfloat Area() const
+    {
+        glm::vec3 size = glm::max(this->Max - this->Min, glm::vec3(0.0f));
+        return size.x * size.y + size.y * size.z + size.z * size.x;
+    }
+
+    // the box containing this box transformed by the matrix (Arvo's method: each column of the matrix moves the minimum and the maximum)
+    AABB Transform(const glm::mat4& matrix) const
+    {
+        AABB box;
+        box.Min = box.Max = glm::vec3(matrix[3]);
+        for (int i = 0; i < 3; i++)
+        {
+            glm::vec3 a = glm::vec3(matrix[i]) * this->Min[i];
+            glm::vec3 b = glm::vec3(matrix[i]) * this->Max[i];
+            box.Min += glm::min(a, b);
+            box.Max += glm::max(a, b);
+        }
+        return box;
+    }
+};
+
+/////////////////// FRUSTUM struct ///////////////////////
+struct Frustum
+{
+    // result of the test of a box against the frustum
+    enum Test { OUTSIDE, INTERSECTING, INSIDE };
+
+    // left, right, bottom, top, near, far planes: (a, b, c, d) with a*x + b*y + c*z + d >= 0 for the points inside
+    glm::vec4 Planes[6];
+
+    // the planes in world coordinates are combinations of the rows of projection * view (Gribb-Hartmann):
+    // a point is inside if -w <= x, y, z <= w in clip coordinates
+    Frustum(const glm::mat4& projection, const glm::mat4& view)
+    {
+        glm::mat4 clip = projection * view;
+        // GLM matrices are stored by columns: row i is (clip[0][i], clip[1][i], clip[2][i], clip[3][i])
+        glm::vec4 rows[4];
+        for (int i = 0; i < 4; i++)
+            rows[i] = glm::vec4(clip[0][i], clip[1][i], clip[2][i], clip[3][i]);
+        for (int i = 0; i < 3; i++)
+        {
+            this->Planes[2 * i] = rows[3] + rows[i];
+            this->Planes[2 * i + 1] = rows[3] - rows[i];
+        }
+        // normalized planes give the signed distances (useful for debugging, not needed by the tests)
+        for (glm::vec4& plane : this->Planes)
+            plane /= glm::length(glm::vec3(plane));
+    }
+
+    // for each plane, we test the corner of the box farthest along the normal of the plane (the "positive vertex"):
+    // if it is behind the plane, the whole box is outside. If also the nearest corner is in front of every plane, the box is inside
+    Test TestBox(const AABB& box) const
+    {
+        Test result = INSIDE;
+        for (const glm::vec4& plane : this->Planes)
+        {
+            glm::vec3 normal = glm::vec3(plane);
+            glm::vec3 positive = glm::mix(box.Min, box.Max, glm::greaterThanEqual(normal, glm::vec3(0.0f)));
+            glm::vec3 negative = glm::mix(box.Max, box.Min, glm::greaterThanEqual(normal, glm::vec3(0.0f)));
+            if (glm::dot(normal, positive) + plane.w < 0.0f)
+                return OUTSIDE;
+            if (glm::dot(normal, negative) + plane.w < 0.0f)
+                result = INTERSECTING;
+        }
+        return result;
+    }
+};
+
+/////////////////// SCENE class ///////////////////////
+class Scene
+{
+public:
+    // the instances of a model which are visible in the current frame
+    struct Batch
+    {
+        Model* model;
+        GLuint instanceBuffer;
+        // the bounding box of the model, in model coordinates
+        AABB modelBounds;
+        vector<InstanceData> instances;
+    };
+
+    // if false, Cull considers all of the instances visible (to measure the cost of the culling)
+    GLboolean Culling = GL_TRUE;
+    // statistics of the last culling: visible instances, and nodes of the BVH tested against the frustum
+    GLuint VisibleInstances = 0, TestedNodes = 0;
+    // number of times the BVH has been built
+    GLuint Builds = 0;
+
+    //////////////////////////////////////////
+
+    Scene() = default;
+
+    // the scene owns OpenGL buffers: we disallow copies
+    Scene(const Scene& copy) = delete;
+    Scene& operator=(const Scene& copy) = delete;
+
+    ~Scene()
+    {
+        for (Batch& batch : this->batches)
+            glDeleteBuffers(1, &batch.instanceBuffer);
+    }
+
+    //////////////////////////////////////////
+
+    // we add an instance of a model, and we return its index. The BVH is built again at the next Cull
+    GLuint Add(Model& model, const InstanceData& data)
+    {
+        Instance instance;
+        instance.batch = this->batchOf(model);
+        instance.data = data;
+        instance.data.PreviousModelMatrix = data.ModelMatrix;
+        instance.bounds = this->batches[instance.batch].modelBounds.Transform(data.ModelMatrix);
+        this->instances.push_back(instance);
+        this->dirty = true;
+        return this->instances.size() - 1;
+    }
+
+    // we remove all of the instances (the models keep their buffers)
+    void Clear()
+    {
+        this->instances.clear();
+        this->movedInstances.clear();
+        this->nodes.clear();
+        this->dirty = true;
+    }
+
+    GLuint Size() const { return this->instances.size(); }
+
+    // the visible instances of each model, after the last Cull
+    const vector<Batch>& Batches() const { return this->batches; }
+
+    // the attributes of an instance (e.g. to change its material parameters). The transformations must be changed with SetTransform
+    InstanceData& Data(GLuint instance) { return this->instances[instance].data; }
+
+    // we move an instance: its bounding box changes, and the BVH is refitted
+    void SetTransform(GLuint instance, const glm::mat4& modelMatrix)
+    {
+        Instance& moved = this->instances[instance];
+        moved.data.ModelMatrix = modelMatrix;
+        this->movedInstances.push_back(instance);
+        moved.bounds = this->batches[moved.batch].modelBounds.Transform(modelMatrix);
+        if (!this->dirty)
+            this->refit(moved.leaf);
+    }
+
+    // the current transformations become the ones of the previous frame. Only the instances moved since the last call have to be updated
+    void NextFrame()
+    {
+        for (GLuint instance : this->movedInstances)
+            this->instances[instance].data.PreviousModelMatrix = this->instances[instance].data.ModelMatrix;
+        this->movedInstances.clear();
+    }
+
+    //////////////////////////////////////////
+
+    // we collect the instances inside the frustum, grouped by model
+    const vector<Batch>& Cull(const Frustum& frustum)
+    {
+        if (this->dirty || this->leafArea > REBUILD_THRESHOLD * this->builtLeafArea)
+            this->build();
+
+        for (Batch& batch : this->batches)
+            batch.instances.clear();
+        this->TestedNodes = 0;
+        if (!this->nodes.empty())
+            this->cullNode(0, frustum, !this->Culling);
+
+        this->VisibleInstances = 0;
+        for (Batch& batch : this->batches)
+            this->VisibleInstances += batch.instances.size();
+        return this->batches;
+    }
+
+    // we upload the visible instances of each model in its instance buffer
+    // the buffer is orphaned before the upload, so that the driver does not wait for the draw calls of the previous frame which are still reading it
+    void UploadVisible()
+    {
+        for (Batch& batch : this->batches)
+        {
+            if (batch.instances.empty())
+                continue;
+            glBindBuffer(GL_ARRAY_BUFFER, batch.instanceBuffer);
+            glBufferData(GL_ARRAY_BUFFER, batch.instances.size() * sizeof(InstanceData), nullptr, GL_STREAM_DRAW);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, batch.instances.size() * sizeof(InstanceData), batch.instances.data());
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+private:
+    // maximum number of instances in a leaf of the BVH
+    static constexpr GLuint LEAF_SIZE = 4;
+    // the BVH is rebuilt when the total area of the leaves is grown by this factor since the last build
+    static constexpr GLfloat REBUILD_THRESHOLD = 2.0f;
+
+    struct Instance
+    {
+        GLuint batch;
+        InstanceData data;
+        AABB bounds;
+        // the leaf of the BVH containing the instance
+        GLuint leaf;
+    };
+
+    // a node of the BVH. The children of an inner node are consecutive: left and left + 1.
+    // A leaf refers to count instances, starting from first in the order vector
+    struct Node
+    {
+        AABB bounds;
+        GLint parent;
+        GLuint left, first, count;
+    };
+
+    vector<Instance> instances;
+    // the instances moved since the last NextFrame
+    vector<GLuint> movedInstances;
+    // a batch (and an instance buffer) for each model
+    vector<Batch> batches;
+
+    vector<Node> nodes;
+    // the indices of the instances, ordered so that each leaf refers to a contiguous range
+    vector<GLuint> order;
+    GLboolean dirty = GL_TRUE;
+    // the sum of the areas of the leaves, now and after the last build
+    GLfloat leafArea = 0.0f, builtLeafArea = 0.0f;
+
+    //////////////////////////////////////////
+
+    // the batch of the model: the first time we meet the model, we create its instance buffer and we compute its bounding box
+    GLuint batchOf(Model& model)
+    {
+        for (GLuint i = 0; i < this->batches.size(); i++)
+            if (this->batches[i].model == &model)
+                return i;
+
+        Batch batch;
+        batch.model = &model;
+        glGenBuffers(1, &batch.instanceBuffer);
+        model.SetInstanceBuffer(batch.instanceBuffer);
+        for (const Mesh& mesh : model.meshes)
+            for (const Vertex& vertex : mesh.vertices)
+                batch.modelBounds.Merge(vertex.Position);
+        this->batches.push_back(batch);
+        return this->batches.size() - 1;
+    }
+
+    //////////////////////////////////////////
+
+    // top-down construction of the whole BVH
+    void build()
+    {
+        this->nodes.clear();
+        this->order.resize(this->instances.size());
+        for (GLuint i = 0; i < this->order.size(); i++)
+            this->order[i] = i;
+        this->leafArea = 0.0f;
+        if (!this->instances.empty())
+        {
+            this->nodes.push_back(Node());
+            this->buildNode(0, -1, 0, this->instances.size());
+        }
+        this->builtLeafArea = this->leafArea;
+        this->dirty = GL_FALSE;
+        this->Builds++;
+    }
+
+    // the node receives the instances in order[first, first + count): if they are too many, they are split between two children
+    void buildNode(GLuint node, GLint parent, GLuint first, GLuint count)
+    {
+        AABB bounds, centers;
+        for (GLuint i = first; i < first + count; i++)
+        {
+            bounds.Merge(this->instances[this->order[i]].bounds);
+            centers.Merge(this->instances[this->order[i]].bounds.Center());
+        }
+        this->nodes[node].bounds = bounds;
+        this->nodes[node].parent = parent;
+
+        if (count <= LEAF_SIZE)
+        {
+            this->nodes[node].first = first;
+            this->nodes[node].count = count;
+            for (GLuint i = first; i < first + count; i++)
+                this->instances[this->order[i]].leaf = node;
+            this->leafArea += bounds.Area();
+            return;
+        }
+
+        // we split at the median of the centers, along the axis where they are more spread
+        glm::vec3 extent = centers.Max - centers.Min;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        GLuint half = count / 2;
+        nth_element(this->order.begin() + first, this->order.begin() + first + half, this->order.begin() + first + count,
+                    [this, axis](GLuint a, GLuint b) { return this->instances[a].bounds.Center()[axis] < this->instances[b].bounds.Center()[axis]; });
+
+        // the children are allocated together (the vector may be reallocated: we don't keep references to the nodes)
+        GLuint left = this->nodes.size();
+        this->nodes.resize(left + 2);
+        this->nodes[node].left = left;
+        this->nodes[node].count = 0;
+        this->buildNode(left, node, first, half);
+        this->buildNode(left + 1, node, first + half, count - half);
+    }
+
+    //////////////////////////////////////////
+
+    // we recompute the box of the leaf from its instances, and the boxes of its ancestors from their children
+    void refit(GLuint leaf)
+    {
+        Node& node = this->nodes[leaf];
+        AABB bounds;
+        for (GLuint i = node.first; i < node.first + node.count; i++)
+            bounds.Merge(this->instances[this->order[i]].bounds);
+        this->leafArea += bounds.Area() - node.bounds.Area();
+        node.bounds = bounds;
+
+        for (GLint parent = node.parent; parent >= 0; parent = this->nodes[parent].parent)
+        {
+            Node& inner = this->nodes[parent];
+            inner.bounds = this->nodes[inner.left].bounds;
+            inner.bounds.Merge(this->nodes[inner.left + 1].bounds);
+        }
+    }
+
+    //////////////////////////////////////////
+
+    // we traverse the subtree: once a node is completely inside the frustum, its descendants are accepted without tests
+    void cullNode(GLuint index, const Frustum& frustum, bool inside)
+    {
+        const Node& node = this->nodes[index];
+        if (!inside)
+        {
+            this->TestedNodes++;
+            Frustum::Test test = frustum.TestBox(node.bounds);
+            if (test == Frustum::OUTSIDE)
+                return;
+            inside = test == Frustum::INSIDE;
+        }
+
+        if (node.count > 0)
+        {
+            for (GLuint i = node.first; i < node.first + node.count; i++)
+            {
+                const Instance& instance = this->instances[this->order[i]];
+                // the instances of a leaf intersecting the frustum are tested one by one
+                if (inside || frustum.TestBox(instance.bounds) != Frustum::OUTSIDE)
+                    this->batches[instance.batch].instances.push_back(instance.data);
+            }
+        }
+        else
+        {
+            this->cullNode(node.left, frustum, inside);
+            this->cullNode(node.left + 1, frustum, inside);
+        }
+    }
+};
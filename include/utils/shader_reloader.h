@@ -0,0 +1,361 @@
+/*
+ShaderReloader class
+- hot reload of the Shader Programs: the modification times of their source files are checked a few times per second, and
+  the programs using a modified file are rebuilt in background
+- the programs are built by a worker thread, in a context which shares the objects with the one of the application
+  (created by the application, which gives the functions to make it current on the worker and to release it):
+  the main thread only swaps the completed programs
+- without a shared context, we use GL_KHR_parallel_shader_compile (or the ARB version): the driver links the programs on its own threads,
+  and the main thread polls GL_COMPLETION_STATUS_KHR once per frame. The worker is preferred because the extension does not make
+  the whole build asynchronous on every driver: with Mesa, glCompileShader still runs the GLSL compiler on the calling thread
+  (about 180 ms for env_bump_aniso.frag with llvmpipe), and only the code generation is deferred
+- a new program replaces the old one only if it is linked successfully (see Shader::FinishRebuild): after a compilation error,
+  the application keeps running with the last working version. The callback given to Watch is then called,
+  so that the application can set again the state stored in the program (e.g. texture units, subroutine tables)
+
+N.B. 1) Update() must be called once per frame by the thread owning the OpenGL context of the application
+
+N.B. 2) without a shared context and without the extension, the programs are rebuilt synchronously in Update (the frame stalls,
+but the reload still works)
+
+N.B. 3) the Shader objects must not be moved in memory while they are watched
+
+Real-Time Graphics Programming - a.a. 2019/2020
+Master degree in Computer Science
+Universita' degli Studi di Milano
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <filesystem>
+#include <cstring>
+#include <iostream>
+
+#include <utils/shader_v2.h>
+
+// glad does not load the extension: we define its token (the same for the KHR and the ARB versions)
+#ifndef GL_COMPLETION_STATUS_KHR
+    #define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+/////////////////// SHADER RELOADER class ///////////////////////
+class ShaderReloader
+{
+public:
+    // if false, the source files are not checked
+    GLboolean Enabled = GL_TRUE;
+    // seconds between two checks of the modification times
+    float PollInterval = 0.5f;
+    // number of successful reloads and of failed builds, since the application started
+    GLuint Reloads = 0, Failures = 0;
+
+    //////////////////////////////////////////
+
+    // true if the driver compiles the programs in background (GL_KHR_parallel_shader_compile or GL_ARB_parallel_shader_compile).
+    // glad does not load the extension, so we search it in the list of the context
+    static bool ParallelCompile()
+    {
+        GLint count = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+        for (GLint i = 0; i < count; i++)
+        {
+            const char* name = (const char*) glGetStringi(GL_EXTENSIONS, i);
+            if (strcmp(name, "GL_KHR_parallel_shader_compile") == 0 || strcmp(name, "GL_ARB_parallel_shader_compile") == 0)
+                return true;
+        }
+        return false;
+    }
+
+    //////////////////////////////////////////
+
+    // constructor
+    // bindWorkerContext and releaseWorkerContext make a shared context current on the calling thread, and release it.
+    // If they are not given, we use the parallel compile extension, or we rebuild the programs synchronously
+    ShaderReloader(function<void()> bindWorkerContext = nullptr, function<void()> releaseWorkerContext = nullptr)
+        : parallel(!bindWorkerContext && ParallelCompile()), lastPoll(chrono::steady_clock::now())
+    {
+        if (bindWorkerContext)
+        {
+            this->worker = thread([this, bindWorkerContext, releaseWorkerContext]()
+            {
+                bindWorkerContext();
+                this->workerLoop();
+                if (releaseWorkerContext)
+                    releaseWorkerContext();
+            });
+        }
+        else if (!this->parallel)
+            cout << "Shader hot reload: no shared context and no parallel compilation, the programs are rebuilt synchronously" << endl;
+    }
+
+    // the class owns a thread: we disallow copies
+    ShaderReloader(const ShaderReloader& copy) = delete;
+    ShaderReloader& operator=(const ShaderReloader& copy) = delete;
+
+    // destructor
+    ~ShaderReloader()
+    {
+        this->Stop();
+    }
+
+    // we stop the worker thread, and we discard the programs still being built (the files are not checked anymore).
+    // It must be called before the application destroys the shared context
+    void Stop()
+    {
+        if (this->worker.joinable())
+        {
+            {
+                lock_guard<mutex> lock(this->jobsMutex);
+                this->stopping = true;
+            }
+            this->jobsCondition.notify_one();
+            this->worker.join();
+        }
+        for (unique_ptr<Watched>& watched : this->watched)
+        {
+            if (watched->building && watched->program != 0)
+                this->discard(watched->program);
+            watched->building = watched->dirty = false;
+            watched->program = 0;
+        }
+        for (Result& result : this->results)
+            this->discard(result.program);
+        this->results.clear();
+        this->Enabled = GL_FALSE;
+    }
+
+    //////////////////////////////////////////
+
+    // we watch the source files of a Shader Program. onReload is called after a new version has replaced the program
+    void Watch(Shader& shader, function<void(Shader&)> onReload = nullptr)
+    {
+        unique_ptr<Watched> watched(new Watched());
+        watched->shader = &shader;
+        watched->onReload = onReload;
+        for (const string& path : {shader.VertexPath, shader.FragmentPath, shader.ComputePath})
+        {
+            if (path.empty())
+                continue;
+            watched->paths.push_back(path);
+            if (this->modificationTimes.find(path) == this->modificationTimes.end())
+                this->modificationTimes[path] = modificationTime(path);
+        }
+        this->watched.push_back(std::move(watched));
+    }
+
+    //////////////////////////////////////////
+
+    // we check the source files (at most once per PollInterval), we start the rebuilds of the programs using the modified ones,
+    // and we swap the programs whose build is completed. It returns true if at least one program has been replaced
+    bool Update()
+    {
+        if (this->Enabled && chrono::duration<float>(chrono::steady_clock::now() - this->lastPoll).count() >= this->PollInterval)
+        {
+            this->lastPoll = chrono::steady_clock::now();
+            this->poll();
+        }
+
+        bool replaced = false;
+        if (this->parallel)
+        {
+            for (unique_ptr<Watched>& watched : this->watched)
+            {
+                if (!watched->building)
+                    continue;
+                // the query does not wait for the driver
+                GLint completed = GL_FALSE;
+                glGetProgramiv(watched->program, GL_COMPLETION_STATUS_KHR, &completed);
+                if (completed)
+                    replaced |= this->finish(*watched, watched->program, watched->cachePath);
+            }
+        }
+        else if (this->worker.joinable())
+        {
+            deque<Result> completed;
+            {
+                lock_guard<mutex> lock(this->resultsMutex);
+                completed.swap(this->results);
+            }
+            for (Result& result : completed)
+                replaced |= this->finish(*result.watched, result.program, result.cachePath);
+        }
+
+        // the programs modified again while they were being built
+        for (unique_ptr<Watched>& watched : this->watched)
+        {
+            if (watched->dirty && !watched->building)
+                this->start(*watched);
+        }
+        return replaced;
+    }
+
+    // number of programs being rebuilt
+    GLuint Pending() const
+    {
+        GLuint pending = 0;
+        for (const unique_ptr<Watched>& watched : this->watched)
+            pending += watched->building ? 1 : 0;
+        return pending;
+    }
+
+private:
+    // a watched Shader Program
+    struct Watched
+    {
+        Shader* shader;
+        function<void(Shader&)> onReload;
+        vector<string> paths;
+        // true if a source has been modified after the start of the current build
+        bool dirty = false;
+        // the build in progress (program is 0 while a worker has not started it)
+        bool building = false;
+        GLuint program = 0;
+        string cachePath;
+    };
+
+    // a program built by the worker thread
+    struct Result
+    {
+        Watched* watched;
+        GLuint program;
+        string cachePath;
+    };
+
+    bool parallel;
+    vector<unique_ptr<Watched>> watched;
+    map<string, filesystem::file_time_type> modificationTimes;
+    chrono::steady_clock::time_point lastPoll;
+
+    // the worker thread of the builds without the extension, its jobs and its results
+    thread worker;
+    deque<Watched*> jobs;
+    mutex jobsMutex;
+    condition_variable jobsCondition;
+    bool stopping = false;
+    deque<Result> results;
+    mutex resultsMutex;
+
+    //////////////////////////////////////////
+
+    static filesystem::file_time_type modificationTime(const string& path)
+    {
+        error_code error;
+        filesystem::file_time_type time = filesystem::last_write_time(path, error);
+        return error ? filesystem::file_time_type::min() : time;
+    }
+
+    // we mark the programs using the modified files
+    void poll()
+    {
+        for (pair<const string, filesystem::file_time_type>& file : this->modificationTimes)
+        {
+            filesystem::file_time_type time = modificationTime(file.first);
+            // a file being saved by an editor may be missing for a moment: we wait for it
+            if (time == file.second || time == filesystem::file_time_type::min())
+                continue;
+            file.second = time;
+            cout << "Shader source modified: " << file.first << endl;
+            for (unique_ptr<Watched>& watched : this->watched)
+            {
+                if (find(watched->paths.begin(), watched->paths.end(), file.first) != watched->paths.end())
+                    watched->dirty = true;
+            }
+        }
+    }
+
+    //////////////////////////////////////////
+
+    // we start the build of a new version of a program
+    void start(Watched& watched)
+    {
+        watched.dirty = false;
+        watched.building = true;
+        if (this->parallel)
+            watched.program = watched.shader->BeginRebuild(watched.cachePath);
+        else if (this->worker.joinable())
+        {
+            {
+                lock_guard<mutex> lock(this->jobsMutex);
+                this->jobs.push_back(&watched);
+            }
+            this->jobsCondition.notify_one();
+        }
+        else
+        {
+            string cachePath;
+            GLuint program = watched.shader->BeginRebuild(cachePath);
+            this->finish(watched, program, cachePath);
+        }
+    }
+
+    // the build of a program is completed: if it has been linked, it replaces the current one
+    bool finish(Watched& watched, GLuint program, const string& cachePath)
+    {
+        watched.building = false;
+        watched.program = 0;
+        if (!watched.shader->FinishRebuild(program, cachePath))
+        {
+            cout << "Shader reload failed, the previous version stays in use: " << watched.paths.back() << endl;
+            this->Failures++;
+            return false;
+        }
+        this->Reloads++;
+        if (watched.onReload)
+            watched.onReload(*watched.shader);
+        return true;
+    }
+
+    // we delete a program which has not been used, with its shaders
+    void discard(GLuint program)
+    {
+        GLuint shaders[2];
+        GLsizei count;
+        glGetAttachedShaders(program, 2, &count, shaders);
+        for (GLsizei i = 0; i < count; i++)
+            glDeleteShader(shaders[i]);
+        glDeleteProgram(program);
+    }
+
+    //////////////////////////////////////////
+
+    // the loop of the worker thread, with the shared context current
+    void workerLoop()
+    {
+        while (true)
+        {
+            Watched* watched;
+            {
+                unique_lock<mutex> lock(this->jobsMutex);
+                this->jobsCondition.wait(lock, [this]{ return this->stopping || !this->jobs.empty(); });
+                if (this->stopping)
+                    return;
+                watched = this->jobs.front();
+                this->jobs.pop_front();
+            }
+
+            Result result;
+            result.watched = watched;
+            result.program = watched->shader->BeginRebuild(result.cachePath);
+            // the query waits for the link, and glFinish makes the program complete for the other contexts sharing it
+            GLint linked;
+            glGetProgramiv(result.program, GL_LINK_STATUS, &linked);
+            glFinish();
+
+            lock_guard<mutex> lock(this->resultsMutex);
+            this->results.push_back(result);
+        }
+    }
+};
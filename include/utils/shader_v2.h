@@ -0,0 +1,382 @@
+/*
+Shader class - v2
+- loading Shader source code, Shader Program creation
+- optional block of preprocessor directives, injected right after the #version line of both shaders,
+  used to generate compile-time specializations ("permutations") of the same source files
+- on-disk cache of the linked programs (glGetProgramBinary / glProgramBinary), so that the same sources are compiled only once per driver
+- compute Shader Programs, from a single source file (they require an OpenGL 4.3 context)
+- the program can be rebuilt from its source files in two steps (BeginRebuild, FinishRebuild), without waiting for the driver
+  between them (see utils/shader_reloader.h): the current program stays in use until the new one is linked
+
+N.B. 1) same interface as v1: a Shader built without defines behaves exactly like the v1 class
+
+N.B. 2) a cached binary is identified by a hash of the final sources (defines included) and of the vendor, renderer and version strings of the driver.
+The binary format is opaque and may be rejected by the driver anyway (e.g. after an update): in that case the program is compiled from the sources and the cache entry is rewritten
+
+N.B. 3) adaptation of https://github.com/JoeyDeVries/LearnOpenGL/blob/master/includes/learnopengl/shader.h
+
+Real-Time Graphics Programming - a.a. 2019/2020
+Master degree in Computer Science
+Universita' degli Studi di Milano
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <filesystem>
+#include <vector>
+
+/////////////////// SHADER class ///////////////////////
+class Shader
+{
+public:
+    GLuint Program;
+    // true if the program has been loaded from the binary cache instead of being compiled
+    GLboolean FromCache = GL_FALSE;
+
+    // folder for the program binaries (relative to the working directory); an empty string disables the cache
+    inline static string CacheFolder = "shader_cache/";
+    // number of programs loaded from the cache, and number of programs compiled from sources, since the application started
+    inline static GLuint CacheHits = 0, CacheMisses = 0;
+
+    // the source files of the program (an empty string for the stages it does not have), and its defines
+    string VertexPath, FragmentPath, ComputePath, Defines;
+
+    //////////////////////////////////////////
+
+    //constructor
+    // defines is a block of "#define NAME VALUE\n" lines, which is inserted in both sources after the #version directive
+    Shader(const GLchar* vertexPath, const GLchar* fragmentPath, const string& defines = "")
+        : VertexPath(vertexPath), FragmentPath(fragmentPath), Defines(defines)
+    {
+        // Step 1: we retrieve shaders source code from provided filepaths
+        string vertexCode = injectDefines(readSource(vertexPath), defines);
+        string fragmentCode = injectDefines(readSource(fragmentPath), defines);
+
+        // if the same sources have already been linked by this driver, we reload the binary and skip compilation
+        string cachePath = binaryCachePath(vertexCode, fragmentCode);
+        if (loadBinary(cachePath))
+        {
+            this->FromCache = GL_TRUE;
+            CacheHits++;
+            return;
+        }
+        CacheMisses++;
+
+        // Convert strings to char pointers
+        const GLchar* vShaderCode = vertexCode.c_str();
+        const GLchar * fShaderCode = fragmentCode.c_str();
+
+        // Step 2: we compile the shaders
+        GLuint vertex, fragment;
+
+        // Vertex Shader
+        vertex = glCreateShader(GL_VERTEX_SHADER);
+        glShaderSource(vertex, 1, &vShaderCode, NULL);
+        glCompileShader(vertex);
+        // check compilation errors
+        checkCompileErrors(vertex, "VERTEX");
+
+        // Fragment Shader
+        fragment = glCreateShader(GL_FRAGMENT_SHADER);
+        glShaderSource(fragment, 1, &fShaderCode, NULL);
+        glCompileShader(fragment);
+        // check compilation errors
+        checkCompileErrors(fragment, "FRAGMENT");
+
+        // Step 3: Shader Program creation
+        this->Program = glCreateProgram();
+        glAttachShader(this->Program, vertex);
+        glAttachShader(this->Program, fragment);
+        // we tell the driver that we are going to retrieve the binary of the program
+        if (!cachePath.empty())
+            glProgramParameteri(this->Program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glLinkProgram(this->Program);
+        // check linking errors
+        checkCompileErrors(this->Program, "PROGRAM");
+        // we store the linked program for the next runs
+        saveBinary(cachePath);
+
+        // Step 4: we delete the shaders because they are linked to the Shader Program, and we do not need them anymore
+        glDeleteShader(vertex);
+        glDeleteShader(fragment);
+    }
+
+    // constructor of a compute Shader Program
+    Shader(const GLchar* computePath)
+        : ComputePath(computePath)
+    {
+        string computeCode = readSource(computePath);
+        string cachePath = binaryCachePath(computeCode, "");
+        if (loadBinary(cachePath))
+        {
+            this->FromCache = GL_TRUE;
+            CacheHits++;
+            return;
+        }
+        CacheMisses++;
+
+        const GLchar* cShaderCode = computeCode.c_str();
+        GLuint compute = glCreateShader(GL_COMPUTE_SHADER);
+        glShaderSource(compute, 1, &cShaderCode, NULL);
+        glCompileShader(compute);
+        checkCompileErrors(compute, "COMPUTE");
+
+        this->Program = glCreateProgram();
+        glAttachShader(this->Program, compute);
+        if (!cachePath.empty())
+            glProgramParameteri(this->Program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glLinkProgram(this->Program);
+        checkCompileErrors(this->Program, "PROGRAM");
+        saveBinary(cachePath);
+
+        glDeleteShader(compute);
+    }
+
+    //////////////////////////////////////////
+
+    // We activate the Shader Program as part of the current rendering process
+    void Use() { glUseProgram(this->Program); }
+
+    // We delete the Shader Program when application closes
+    void Delete() {    glDeleteProgram(this->Program); }
+
+    //////////////////////////////////////////
+
+    // we start the build of a new program from the current content of the source files: the shaders are compiled and linked,
+    // but their status is not queried, so that the driver can build them in background (GL_KHR_parallel_shader_compile).
+    // It returns the new program, with its shaders still attached, and the path of its cache entry
+    GLuint BeginRebuild(string& cachePath)
+    {
+        vector<pair<GLenum, string>> stages;
+        if (!this->ComputePath.empty())
+            stages.push_back({GL_COMPUTE_SHADER, readSource(this->ComputePath.c_str())});
+        else
+        {
+            stages.push_back({GL_VERTEX_SHADER, injectDefines(readSource(this->VertexPath.c_str()), this->Defines)});
+            stages.push_back({GL_FRAGMENT_SHADER, injectDefines(readSource(this->FragmentPath.c_str()), this->Defines)});
+        }
+        cachePath = binaryCachePath(stages[0].second, stages.size() > 1 ? stages[1].second : "");
+
+        GLuint program = glCreateProgram();
+        for (const pair<GLenum, string>& stage : stages)
+        {
+            const GLchar* code = stage.second.c_str();
+            GLuint shader = glCreateShader(stage.first);
+            glShaderSource(shader, 1, &code, NULL);
+            glCompileShader(shader);
+            glAttachShader(program, shader);
+        }
+        if (!cachePath.empty())
+            glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glLinkProgram(program);
+        return program;
+    }
+
+    // we complete a build started by BeginRebuild, once the driver has finished it: if the new program is linked, it replaces
+    // the current one (which is deleted) and it is saved in the cache. Otherwise we print the errors, and the current program stays in use
+    bool FinishRebuild(GLuint program, const string& cachePath)
+    {
+        GLuint shaders[2];
+        GLsizei count;
+        glGetAttachedShaders(program, 2, &count, shaders);
+        for (GLsizei i = 0; i < count; i++)
+        {
+            GLint type;
+            glGetShaderiv(shaders[i], GL_SHADER_TYPE, &type);
+            checkCompileErrors(shaders[i], type == GL_VERTEX_SHADER ? "VERTEX" : type == GL_FRAGMENT_SHADER ? "FRAGMENT" : "COMPUTE");
+            glDetachShader(program, shaders[i]);
+            glDeleteShader(shaders[i]);
+        }
+        checkCompileErrors(program, "PROGRAM");
+
+        GLint success;
+        glGetProgramiv(program, GL_LINK_STATUS, &success);
+        if (!success)
+        {
+            glDeleteProgram(program);
+            return false;
+        }
+        glDeleteProgram(this->Program);
+        this->Program = program;
+        saveBinary(cachePath);
+        return true;
+    }
+
+private:
+    //////////////////////////////////////////
+
+    // we read the whole content of a shader source file
+    string readSource(const GLchar* path)
+    {
+        ifstream shaderFile;
+        // ensure ifstream objects can throw exceptions:
+        shaderFile.exceptions (ifstream::failbit | ifstream::badbit);
+        try
+        {
+            shaderFile.open(path);
+            stringstream shaderStream;
+            shaderStream << shaderFile.rdbuf();
+            shaderFile.close();
+            return shaderStream.str();
+        }
+        catch (ifstream::failure& e)
+        {
+            cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ: " << path << endl;
+        }
+        return "";
+    }
+
+    //////////////////////////////////////////
+
+    // GLSL requires #version to be the first directive, so the defines are placed on the line after it
+    string injectDefines(string source, const string& defines)
+    {
+        if (defines.empty())
+            return source;
+
+        size_t versionLine = source.find("#version");
+        size_t insertAt = versionLine == string::npos ? 0 : source.find('\n', versionLine);
+        insertAt = insertAt == string::npos ? source.size() : insertAt + 1;
+        source.insert(insertAt, defines);
+        return source;
+    }
+
+    //////////////////////////////////////////
+
+    // 64 bit FNV-1a hash, used to identify the binaries in the cache
+    static void hashString(uint64_t& hash, const string& text)
+    {
+        for (unsigned char c : text)
+        {
+            hash ^= c;
+            hash *= 1099511628211ull;
+        }
+        // separator, so that moving text between two consecutive strings changes the hash
+        hash ^= 0xFF;
+        hash *= 1099511628211ull;
+    }
+
+    //////////////////////////////////////////
+
+    // the path of the cache entry for the given sources, or an empty string if the binary cache can't be used
+    string binaryCachePath(const string& vertexCode, const string& fragmentCode)
+    {
+        GLint numFormats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+        if (CacheFolder.empty() || numFormats == 0)
+            return "";
+
+        uint64_t hash = 14695981039346656037ull;
+        hashString(hash, vertexCode);
+        hashString(hash, fragmentCode);
+        hashString(hash, (const char*) glGetString(GL_VENDOR));
+        hashString(hash, (const char*) glGetString(GL_RENDERER));
+        hashString(hash, (const char*) glGetString(GL_VERSION));
+
+        stringstream name;
+        name << CacheFolder << hex << hash << ".bin";
+        return name.str();
+    }
+
+    //////////////////////////////////////////
+
+    // we try to create the Shader Program from a cached binary. If it is missing or rejected by the driver, we return false
+    bool loadBinary(const string& path)
+    {
+        if (path.empty())
+            return false;
+
+        ifstream binaryFile(path, ios::binary);
+        if (!binaryFile)
+            return false;
+
+        GLenum format;
+        GLint length;
+        binaryFile.read((char*) &format, sizeof(format));
+        binaryFile.read((char*) &length, sizeof(length));
+        if (!binaryFile || length <= 0)
+            return false;
+        vector<char> binary(length);
+        binaryFile.read(binary.data(), length);
+        if (!binaryFile)
+            return false;
+
+        this->Program = glCreateProgram();
+        glProgramBinary(this->Program, format, binary.data(), length);
+
+        // the driver may refuse a binary produced by a different version: we fall back to a full compilation
+        GLint success;
+        glGetProgramiv(this->Program, GL_LINK_STATUS, &success);
+        if (!success)
+        {
+            cout << "Shader binary rejected by the driver, recompiling: " << path << endl;
+            glDeleteProgram(this->Program);
+            return false;
+        }
+        return true;
+    }
+
+    //////////////////////////////////////////
+
+    // we write the binary of the linked Shader Program in the cache
+    void saveBinary(const string& path)
+    {
+        GLint success, length = 0;
+        glGetProgramiv(this->Program, GL_LINK_STATUS, &success);
+        if (path.empty() || !success)
+            return;
+
+        glGetProgramiv(this->Program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0)
+            return;
+        GLenum format;
+        vector<char> binary(length);
+        glGetProgramBinary(this->Program, length, &length, &format, binary.data());
+
+        error_code error;
+        filesystem::create_directories(CacheFolder, error);
+        ofstream binaryFile(path, ios::binary);
+        if (!binaryFile)
+        {
+            cout << "Unable to write the shader binary cache: " << path << endl;
+            return;
+        }
+        binaryFile.write((const char*) &format, sizeof(format));
+        binaryFile.write((const char*) &length, sizeof(length));
+        binaryFile.write(binary.data(), length);
+    }
+
+    //////////////////////////////////////////
+
+    // Check compilation and linking errors
+    void checkCompileErrors(GLuint shader, string type)
+	{
+		GLint success;
+		GLchar infoLog[1024];
+		if(type != "PROGRAM")
+		{
+			glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+			if(!success)
+			{
+				glGetShaderInfoLog(shader, 1024, NULL, infoLog);
+                cout << "| ERROR::::SHADER-COMPILATION-ERROR of type: " << type << "|\n" << infoLog << "\n| -- --------------------------------------------------- -- |" << endl;
+			}
+		}
+		else
+		{
+			glGetProgramiv(shader, GL_LINK_STATUS, &success);
+			if(!success)
+			{
+				glGetProgramInfoLog(shader, 1024, NULL, infoLog);
+                cout << "| ERROR::::PROGRAM-LINKING-ERROR of type: " << type << "|\n" << infoLog << "\n| -- --------------------------------------------------- -- |" << endl;
+			}
+		}
+	}
+};
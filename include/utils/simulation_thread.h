@@ -0,0 +1,215 @@
+/*
+SimulationThread class
+- the simulation of the application (e.g. camera movements, animations, physics) runs on its own thread, with a fixed time step,
+  while the thread owning the OpenGL context submits the frames
+- each step reads the most recent input published by the rendering thread, and it produces an immutable packet with the state
+  of a frame (e.g. camera, transforms, parameters of the objects). The packets are exchanged through a lock-free triple buffer:
+  the simulation never waits for the rendering, and the rendering takes the most recent packet without waiting for the current step,
+  so a slow step (e.g. a heavy physics simulation) never delays the submission of a frame
+- the same step function can be called by the rendering thread instead, once per frame (e.g. for reproducible benchmarks)
+
+N.B. 1) the step function owns the state of the simulation: it must not read data modified by the other threads, except for its input
+
+N.B. 2) if a step takes longer than the time step, the simulation does not try to catch up: it slows down, while the frames go on
+rendering the last packet
+
+Real-Time Graphics Programming - a.a. 2019/2020
+Master degree in Computer Science
+Universita' degli Studi di Milano
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <algorithm>
+
+/////////////////// TRIPLE BUFFER class ///////////////////////
+// lock-free exchange of the most recent value, from one producer thread to one consumer thread.
+// The producer writes in its own slot, the consumer reads its own slot, and the third slot holds the most recent published value:
+// publishing and acquiring swap a private slot with the shared one, so no thread waits for the other, and the values not acquired in time
+// are overwritten
+template <typename T>
+class TripleBuffer
+{
+public:
+    // called only by the producer: the slot to fill before publishing it
+    T& Write()
+    {
+        return this->slots[this->back];
+    }
+
+    // called only by the producer: the written slot becomes the most recent value, and we take the old shared slot for the next write
+    void Publish()
+    {
+        // acq_rel: the slot is written before the consumer can see it, and the consumer has finished reading the slot we take
+        this->back = this->shared.exchange(this->back | FRESH, memory_order_acq_rel) & INDEX;
+    }
+
+    // called only by the consumer: if a value has been published after the last call, it becomes the one returned by Read.
+    // Returns false if there is no new value
+    bool Acquire()
+    {
+        if (!(this->shared.load(memory_order_relaxed) & FRESH))
+            return false;
+        this->front = this->shared.exchange(this->front, memory_order_acq_rel) & INDEX;
+        return true;
+    }
+
+    // called only by the consumer: the last acquired value
+    const T& Read() const
+    {
+        return this->slots[this->front];
+    }
+
+private:
+    // the shared index stores the slot, and a bit set by the producer and cleared by the consumer
+    static const unsigned INDEX = 3, FRESH = 4;
+
+    T slots[3];
+    // the slot of the producer and the one of the consumer: each one is used only by its thread
+    unsigned back = 0, front = 1;
+    // on its own cache line, so that writing it does not invalidate the private indices
+    alignas(64) atomic<unsigned> shared{2};
+};
+
+/////////////////// SIMULATION THREAD class ///////////////////////
+template <typename Input, typename Packet>
+class SimulationThread
+{
+public:
+    // the step advances the simulation by a time, reading the input, and it returns the state of the frame
+    using StepFunction = function<Packet(const Input&, float)>;
+
+    // duration of the last step and number of steps (also the ones called by the rendering thread), for the statistics
+    atomic<float> StepTime{0.0f};
+    atomic<unsigned> Steps{0};
+
+    //////////////////////////////////////////
+
+    // constructor
+    // timeStep: seconds simulated by each step of the thread, which is also the interval between the steps
+    SimulationThread(StepFunction step, float timeStep)
+        : step(step), timeStep(timeStep)
+    {
+        this->inputs.Write() = Input();
+        this->inputs.Publish();
+    }
+
+    // the class owns a thread: we disallow copies
+    SimulationThread(const SimulationThread& copy) = delete;
+    SimulationThread& operator=(const SimulationThread& copy) = delete;
+
+    // destructor
+    ~SimulationThread()
+    {
+        this->Stop();
+    }
+
+    //////////////////////////////////////////
+
+    // we start the steps on the thread
+    void Start()
+    {
+        if (this->worker.joinable())
+            return;
+        this->stopping = false;
+        this->worker = thread(&SimulationThread::loop, this);
+    }
+
+    // we wait for the end of the current step, and we stop the thread
+    void Stop()
+    {
+        if (!this->worker.joinable())
+            return;
+        {
+            lock_guard<mutex> lock(this->stopMutex);
+            this->stopping = true;
+        }
+        this->stopCondition.notify_one();
+        this->worker.join();
+    }
+
+    bool Running() const
+    {
+        return this->worker.joinable();
+    }
+
+    //////////////////////////////////////////
+
+    // called by the rendering thread: the input read by the next step
+    void SetInput(const Input& input)
+    {
+        this->inputs.Write() = input;
+        this->inputs.Publish();
+    }
+
+    // called by the rendering thread while the thread is stopped: a step of the given time, on the calling thread
+    void Step(float time)
+    {
+        this->advance(time);
+    }
+
+    // called by the rendering thread: the most recent packet becomes the one returned by Frame.
+    // Returns false if no step has been completed since the last call
+    bool Acquire()
+    {
+        return this->packets.Acquire();
+    }
+
+    // the last acquired packet
+    const Packet& Frame() const
+    {
+        return this->packets.Read();
+    }
+
+private:
+    StepFunction step;
+    float timeStep;
+    // input from the rendering thread, packets to the rendering thread
+    TripleBuffer<Input> inputs;
+    TripleBuffer<Packet> packets;
+
+    thread worker;
+    mutex stopMutex;
+    condition_variable stopCondition;
+    bool stopping = false;
+
+    //////////////////////////////////////////
+
+    // a step, with the most recent input, and the publication of its packet
+    // (with the thread stopped, the rendering thread is the consumer of the input and the producer of the packets)
+    void advance(float time)
+    {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        this->inputs.Acquire();
+        this->packets.Write() = this->step(this->inputs.Read(), time);
+        this->packets.Publish();
+        this->StepTime.store(chrono::duration<float>(chrono::steady_clock::now() - start).count(), memory_order_relaxed);
+        this->Steps.fetch_add(1, memory_order_relaxed);
+    }
+
+    // the loop of the thread: a step every timeStep seconds
+    void loop()
+    {
+        chrono::steady_clock::duration interval = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<float>(this->timeStep));
+        chrono::steady_clock::time_point next = chrono::steady_clock::now();
+        unique_lock<mutex> lock(this->stopMutex);
+        while (!this->stopping)
+        {
+            lock.unlock();
+            this->advance(this->timeStep);
+            lock.lock();
+            // a late step does not accumulate steps to catch up with (see N.B. 2)
+            next = max(next + interval, chrono::steady_clock::now());
+            this->stopCondition.wait_until(lock, next, [this]{ return this->stopping; });
+        }
+    }
+};
@@ -0,0 +1,207 @@
+/*
+TemporalAccumulation class
+- accumulation over the frames of the Monte-Carlo estimates of the shaders: each frame uses a few samples, rotated differently in each frame,
+  and the history (the average of the previous frames) converges to the integral
+- the scene is rendered in an offscreen framebuffer with two color attachments: the color, and the motion vectors of the pixels (in UV units)
+- resolve pass (temporal_resolve.frag): the history is reprojected with the motion vectors, clamped in the neighbourhood of the pixel
+  in the current frame, and blended with the current frame in the new history. The two history textures are used in rotation (ping-pong):
+  the resolve reads one and writes the other
+- the history stores linear colors: the resolve pass writes also its tone mapped version, which is copied in the output framebuffer
+  (the default one, or the offscreen one of the headless mode)
+
+N.B. 1) the shaders of the scene must write the color at location 0 and the motion vector at location 1
+
+N.B. 2) the resolve pass uses the three texture units starting from firstUnit: they must not be used by the other textures
+which keep their units for the whole application
+
+N.B. 3) the histories are stored in GL_RGBA16F textures: the alpha channel counts the accumulated frames
+
+Real-Time Graphics Programming - a.a. 2019/2020
+Master degree in Computer Science
+Universita' degli Studi di Milano
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <iostream>
+
+#include <glm/gtc/type_ptr.hpp>
+
+#include <utils/shader_v2.h>
+
+/////////////////// TEMPORAL ACCUMULATION class ///////////////////////
+class TemporalAccumulation
+{
+public:
+    // number of texture units used by the resolve pass, starting from firstUnit
+    static const GLuint TEXTURE_UNITS = 3;
+
+    // number of frames since the last reset: the shaders use it to rotate their samples
+    GLuint FrameIndex = 0;
+
+    //////////////////////////////////////////
+
+    // constructor
+    // width and height are the size of the viewport
+    TemporalAccumulation(GLint width, GLint height, GLuint firstUnit)
+        : width(width), height(height), firstUnit(firstUnit), resolveShader("fullscreen_triangle.vert", "temporal_resolve.frag")
+    {
+        // the scene: color, motion vectors and depth
+        glGenTextures(2, this->sceneTextures);
+        this->createTexture(this->sceneTextures[0], GL_RGBA16F, GL_RGBA, GL_NEAREST);
+        this->createTexture(this->sceneTextures[1], GL_RG16F, GL_RG, GL_NEAREST);
+        glGenRenderbuffers(1, &this->depthBuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, this->depthBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+        glGenFramebuffers(1, &this->sceneFBO);
+        glBindFramebuffer(GL_FRAMEBUFFER, this->sceneFBO);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, this->sceneTextures[0], 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, this->sceneTextures[1], 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, this->depthBuffer);
+        GLenum drawBuffers[2] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+        glDrawBuffers(2, drawBuffers);
+        this->checkFramebuffer("scene");
+
+        // the histories are read at the reprojected positions, between the pixels: they are filtered.
+        // The framebuffers of both of the histories write the tone mapped color in the same texture
+        glGenTextures(1, &this->displayTexture);
+        this->createTexture(this->displayTexture, GL_RGBA8, GL_RGBA, GL_NEAREST);
+        glGenTextures(2, this->historyTextures);
+        glGenFramebuffers(2, this->historyFBOs);
+        for (int i = 0; i < 2; i++)
+        {
+            this->createTexture(this->historyTextures[i], GL_RGBA16F, GL_RGBA, GL_LINEAR);
+            glBindFramebuffer(GL_FRAMEBUFFER, this->historyFBOs[i]);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, this->historyTextures[i], 0);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, this->displayTexture, 0);
+            glDrawBuffers(2, drawBuffers);
+            glReadBuffer(GL_COLOR_ATTACHMENT1);
+            this->checkFramebuffer("history");
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        // the full-screen triangle has no attributes, but a VAO must be bound to draw it
+        glGenVertexArrays(1, &this->emptyVAO);
+
+        this->resolveShader.Use();
+        glUniform1i(glGetUniformLocation(this->resolveShader.Program, "currentColor"), firstUnit);
+        glUniform1i(glGetUniformLocation(this->resolveShader.Program, "velocity"), firstUnit + 1);
+        glUniform1i(glGetUniformLocation(this->resolveShader.Program, "history"), firstUnit + 2);
+        glUseProgram(0);
+    }
+
+    // the class owns OpenGL objects: we disallow copies
+    TemporalAccumulation(const TemporalAccumulation& copy) = delete;
+    TemporalAccumulation& operator=(const TemporalAccumulation& copy) = delete;
+
+    // destructor
+    ~TemporalAccumulation()
+    {
+        this->resolveShader.Delete();
+        glDeleteVertexArrays(1, &this->emptyVAO);
+        glDeleteFramebuffers(2, this->historyFBOs);
+        glDeleteTextures(2, this->historyTextures);
+        glDeleteTextures(1, &this->displayTexture);
+        glDeleteFramebuffers(1, &this->sceneFBO);
+        glDeleteRenderbuffers(1, &this->depthBuffer);
+        glDeleteTextures(2, this->sceneTextures);
+    }
+
+    //////////////////////////////////////////
+
+    // the history is discarded at the next resolve (e.g. when the accumulation is enabled again after some frames)
+    void Reset()
+    {
+        this->reset = GL_TRUE;
+        this->FrameIndex = 0;
+    }
+
+    // we bind and clear the framebuffer of the scene. The motion vectors are cleared to zero
+    void BeginScene(const glm::vec4& clearColor)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, this->sceneFBO);
+        const GLfloat noMotion[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        glClearBufferfv(GL_COLOR, 0, glm::value_ptr(clearColor));
+        glClearBufferfv(GL_COLOR, 1, noMotion);
+        glClear(GL_DEPTH_BUFFER_BIT);
+    }
+
+    // the framebuffer of the scene, for the passes which draw in it after BeginScene (e.g. the deferred shading)
+    GLuint SceneFramebuffer() const
+    {
+        return this->sceneFBO;
+    }
+
+    // we blend the current frame into the history, and we copy the new history in the output framebuffer (which stays bound)
+    // historyLength is the maximum number of accumulated frames. toneMapped is true if the scene is tone mapped (see temporal_resolve.frag)
+    void Resolve(GLuint outputFBO, GLfloat historyLength, GLboolean toneMapped)
+    {
+        GLuint previous = this->current, next = 1 - this->current;
+
+        glBindFramebuffer(GL_FRAMEBUFFER, this->historyFBOs[next]);
+        glDisable(GL_DEPTH_TEST);
+        glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+        this->resolveShader.Use();
+        glUniform1i(glGetUniformLocation(this->resolveShader.Program, "resetHistory"), this->reset);
+        glUniform1f(glGetUniformLocation(this->resolveShader.Program, "historyLength"), historyLength);
+        glUniform1i(glGetUniformLocation(this->resolveShader.Program, "hdrEnvironment"), toneMapped);
+        glActiveTexture(GL_TEXTURE0 + this->firstUnit);
+        glBindTexture(GL_TEXTURE_2D, this->sceneTextures[0]);
+        glActiveTexture(GL_TEXTURE0 + this->firstUnit + 1);
+        glBindTexture(GL_TEXTURE_2D, this->sceneTextures[1]);
+        glActiveTexture(GL_TEXTURE0 + this->firstUnit + 2);
+        glBindTexture(GL_TEXTURE_2D, this->historyTextures[previous]);
+        glBindVertexArray(this->emptyVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(0);
+        glEnable(GL_DEPTH_TEST);
+
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, this->historyFBOs[next]);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, outputFBO);
+        glBlitFramebuffer(0, 0, this->width, this->height, 0, 0, this->width, this->height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, outputFBO);
+
+        this->current = next;
+        this->reset = GL_FALSE;
+        this->FrameIndex++;
+    }
+
+private:
+    GLint width, height;
+    GLuint firstUnit;
+    Shader resolveShader;
+
+    // color and motion vectors of the scene, and its framebuffer
+    GLuint sceneTextures[2], depthBuffer, sceneFBO;
+    // the two histories, and their framebuffers. current is the index of the most recent one
+    GLuint historyTextures[2], historyFBOs[2];
+    // the tone mapped history
+    GLuint displayTexture;
+    GLuint current = 0;
+    GLboolean reset = GL_TRUE;
+
+    GLuint emptyVAO;
+
+    //////////////////////////////////////////
+
+    void createTexture(GLuint texture, GLint internalFormat, GLenum format, GLint filter)
+    {
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, this->width, this->height, 0, format, GL_FLOAT, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    void checkFramebuffer(const string& name)
+    {
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            cout << "ERROR::TEMPORAL_ACCUMULATION: the " << name << " framebuffer is not complete" << endl;
+    }
+};
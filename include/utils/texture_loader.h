@@ -0,0 +1,611 @@
+/*
+TextureLoader class
+- asynchronous loading of 2D textures, 2D texture arrays and cube maps
+- the images are decoded (stb_image) by a pool of worker threads, so the main thread never waits for the disk or the decoder
+- the decoded images are uploaded from the main thread through Pixel Buffer Objects, a few rows at a time,
+  without exceeding a budget of bytes per frame
+- each texture is immediately replaced by a 1x1 placeholder of a given color, and the final texture takes its place once all of its data is on the GPU
+- HDR cube maps and 2D textures can be loaded in floating point (stbi_loadf) and stored as GL_RGB16F, GL_R11F_G11F_B10F or GL_RGB9_E5:
+  the worker threads build the whole mipmap chain and pack the texels in the final format, so the upload is a plain copy
+- the worker threads build the mipmaps of the 8 bit cube maps too: glGenerateMipmap on six large faces can stall the frame
+  in which the texture is completed (it is used only for the 2D textures and the arrays)
+
+N.B. 1) the loader writes the name of the texture in a GLuint provided by the application: first the placeholder, then the final texture.
+The GLuint must remain valid (= not moved in memory) until the loading is finished
+
+N.B. 2) GL_RGB9_E5 is not color-renderable, so glGenerateMipmap is not guaranteed to work with it on every driver: this is one more reason to build the mipmaps of the HDR cube maps on the CPU
+
+N.B. 3) Update() must be called once per frame by the thread owning the OpenGL context, which is also the only thread issuing OpenGL calls.
+stb_image must be included (with its implementation) before this header
+
+Real-Time Graphics Programming - a.a. 2019/2020
+Master degree in Computer Science
+Universita' degli Studi di Milano
+*/
+
+#pragma once
+
+using namespace std;
+
+// Std. Includes
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+// the placeholder colors are given as GLM vectors, and GLM provides the packing functions of the floating point formats
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+
+/////////////////// TEXTURE LOADER class ///////////////////////
+class TextureLoader
+{
+public:
+    // maximum number of bytes uploaded to the GPU in each call of Update()
+    size_t UploadBudget;
+
+    //////////////////////////////////////////
+
+    // constructor
+    // we start the pool of decoding threads, and we create the ring of Pixel Buffer Objects used for the uploads
+    TextureLoader(unsigned int threads = max(2u, thread::hardware_concurrency()) - 1, size_t uploadBudget = 4 << 20)
+        : UploadBudget(uploadBudget)
+    {
+        glGenBuffers(NUM_PBO, this->pbo);
+        for (unsigned int i = 0; i < threads; i++)
+            this->workers.emplace_back(&TextureLoader::workerLoop, this);
+    }
+
+    // the loader owns threads and GPU buffers: we disallow copies
+    TextureLoader(const TextureLoader& copy) = delete;
+    TextureLoader& operator=(const TextureLoader& copy) = delete;
+
+    // destructor
+    // pending decodes are abandoned, and the images already decoded are released
+    ~TextureLoader()
+    {
+        {
+            lock_guard<mutex> lock(this->jobsMutex);
+            this->stopping = true;
+            this->jobs.clear();
+        }
+        this->jobsCondition.notify_all();
+        for (thread& worker : this->workers)
+            worker.join();
+
+        for (DecodedImage& image : this->decoded)
+            stbi_image_free(image.stbiData);
+        if (this->uploading)
+            stbi_image_free(this->current.stbiData);
+
+        glDeleteBuffers(NUM_PBO, this->pbo);
+    }
+
+    //////////////////////////////////////////
+
+    // we request the loading of a 2D texture. *destination immediately receives a placeholder of the given color
+    void Load2D(GLuint* destination, const string& path, bool repeat, bool flipVertically, const glm::u8vec4& placeholder = glm::u8vec4(128, 128, 128, 255))
+    {
+        TextureRequest* request = addRequest(destination, GL_TEXTURE_2D, repeat, 1, {placeholder});
+        addJob(request, GL_TEXTURE_2D, path, flipVertically, STBI_default);
+    }
+
+    // we request the loading of an HDR 2D texture (e.g. an equirectangular environment), in floating point, stored in hdrFormat
+    void LoadHDR(GLuint* destination, const string& path, GLenum hdrFormat, bool repeat, bool flipVertically, const glm::u8vec4& placeholder = glm::u8vec4(128, 128, 128, 255))
+    {
+        TextureRequest* request = addRequest(destination, GL_TEXTURE_2D, repeat, 1, {placeholder});
+        request->hdrFormat = hdrFormat;
+        request->cpuMipmaps = true;
+        addJob(request, GL_TEXTURE_2D, path, flipVertically, STBI_rgb);
+    }
+
+    // we request the loading of a cube map, from the six images "right", "left", "up", "down", "back", "front" in the folder
+    // with hdrFormat = GL_RGB16F, GL_R11F_G11F_B10F or GL_RGB9_E5, the images are loaded in floating point and stored in that format.
+    // with hdrFormat = GL_NONE, they are loaded as 8 bit images (HDR files are tone mapped by stb_image)
+    void LoadCubeMap(GLuint* destination, const string& folder, const string& format, GLenum hdrFormat = GL_NONE, const glm::u8vec4& placeholder = glm::u8vec4(128, 128, 128, 255))
+    {
+        vector<string> paths;
+        for (const char* face : {"right", "left", "up", "down", "back", "front"})
+            paths.push_back(folder + face + "." + format);
+        this->LoadCubeMap(destination, paths, hdrFormat, placeholder);
+    }
+
+    // we request the loading of a cube map from the paths of its six faces, in the order of the OpenGL targets (+X, -X, +Y, -Y, +Z, -Z)
+    void LoadCubeMap(GLuint* destination, const vector<string>& paths, GLenum hdrFormat = GL_NONE, const glm::u8vec4& placeholder = glm::u8vec4(128, 128, 128, 255))
+    {
+        TextureRequest* request = addRequest(destination, GL_TEXTURE_CUBE_MAP, false, 6, {placeholder});
+        request->hdrFormat = hdrFormat;
+        request->cpuMipmaps = true;
+        for (GLuint i = 0; i < 6; i++)
+            addJob(request, GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, paths[i], false, STBI_rgb);
+    }
+
+    // we request the loading of a 2D texture array, with one image for each layer (converted to RGBA).
+    // All of the images must have the same size of the first decoded one: a layer which can't be loaded is left black.
+    // The placeholder has one texel for each layer, with the given colors
+    void LoadArray(GLuint* destination, const vector<string>& paths, bool repeat, bool flipVertically, const vector<glm::u8vec4>& placeholders)
+    {
+        TextureRequest* request = addRequest(destination, GL_TEXTURE_2D_ARRAY, repeat, paths.size(), placeholders);
+        for (GLuint i = 0; i < paths.size(); i++)
+            addJob(request, i, paths[i], flipVertically, STBI_rgb_alpha);
+    }
+
+    //////////////////////////////////////////
+
+    // size in bytes of a texel of the floating point formats, in the client memory (the driver may pad GL_RGB16F to 8 bytes on the GPU)
+    static int HDRTexelSize(GLenum hdrFormat)
+    {
+        return hdrFormat == GL_RGB16F ? 6 : 4;
+    }
+
+    //////////////////////////////////////////
+
+    // we upload the decoded data, up to UploadBudget bytes, and we replace the placeholders of the completed textures
+    void Update()
+    {
+        this->upload(this->UploadBudget);
+    }
+
+    // we block until every requested texture has been loaded (used when the application can't render without them)
+    void Finish()
+    {
+        while (this->Pending() > 0)
+        {
+            if (!this->upload(SIZE_MAX))
+            {
+                // nothing to upload: we wait for the decoding threads
+                unique_lock<mutex> lock(this->decodedMutex);
+                this->decodedCondition.wait(lock, [this]{ return !this->decoded.empty(); });
+            }
+        }
+    }
+
+    // number of textures requested and not yet completed
+    GLuint Pending() const { return this->requested - this->completed; }
+    // number of textures requested since the creation of the loader
+    GLuint Requested() const { return this->requested; }
+
+private:
+    // number of Pixel Buffer Objects used in rotation: the driver can still be reading a buffer while we fill the next one
+    static constexpr int NUM_PBO = 3;
+    // maximum size of a single transfer through a Pixel Buffer Object
+    static constexpr size_t CHUNK_SIZE = 1 << 20;
+
+    // a texture requested by the application
+    struct TextureRequest
+    {
+        GLuint* destination;
+        GLuint placeholder;
+        // the final texture, created when its first image has been decoded
+        GLuint texture = 0;
+        // size of the images, which must be the same for all of the faces or layers
+        int width, height;
+        GLenum target;
+        bool repeat;
+        // floating point internal format, or GL_NONE for 8 bit textures
+        GLenum hdrFormat = GL_NONE;
+        // true if the worker threads build the mipmaps (HDR images and cube maps), false if the driver generates them
+        bool cpuMipmaps = false;
+        // number of images (1 for 2D textures, 6 for cube maps, the number of layers for arrays), and images not yet completely uploaded
+        int images, pendingImages;
+    };
+
+    // a level of the mipmap chain of a decoded image
+    struct MipLevel
+    {
+        int width, height;
+        const unsigned char* data;
+    };
+
+    // an image decoded by a worker thread, waiting to be uploaded
+    struct DecodedImage
+    {
+        TextureRequest* request;
+        // GL_TEXTURE_2D, the face of the cube map, or the layer of the texture array
+        GLenum imageTarget;
+        string path;
+        // pixel transfer format and type, and size of a texel in client memory
+        GLenum format = GL_RGBA, type = GL_UNSIGNED_BYTE;
+        int texelSize = 0;
+        // the levels to upload: only the base one if the driver generates the mipmaps, otherwise the whole chain
+        vector<MipLevel> levels;
+        // memory owned by the image: the output of stb_image, and the packed HDR texels or the mipmaps built by the worker threads
+        unsigned char* stbiData = nullptr;
+        vector<unsigned char> packed;
+        // level being uploaded, and rows of that level already uploaded to the GPU
+        int uploadLevel = 0, uploadedRows = 0;
+    };
+
+    // requests are kept until the loader is destroyed: the decoded images point to them
+    vector<unique_ptr<TextureRequest>> requests;
+    GLuint requested = 0, completed = 0;
+
+    // decoding jobs, consumed by the worker threads
+    vector<thread> workers;
+    deque<function<void()>> jobs;
+    mutex jobsMutex;
+    condition_variable jobsCondition;
+    bool stopping = false;
+
+    // decoded images, produced by the worker threads and consumed by the main thread
+    deque<DecodedImage> decoded;
+    mutex decodedMutex;
+    condition_variable decodedCondition;
+
+    // the image currently being uploaded
+    DecodedImage current;
+    bool uploading = false;
+
+    GLuint pbo[NUM_PBO];
+    int nextPBO = 0;
+
+    //////////////////////////////////////////
+
+    // we create the placeholder texture, and we give it to the application
+    TextureRequest* addRequest(GLuint* destination, GLenum target, bool repeat, int images, const vector<glm::u8vec4>& colors)
+    {
+        unique_ptr<TextureRequest> request(new TextureRequest());
+        request->destination = destination;
+        request->target = target;
+        request->repeat = repeat;
+        request->images = request->pendingImages = images;
+
+        glGenTextures(1, &request->placeholder);
+        glBindTexture(target, request->placeholder);
+        if (target == GL_TEXTURE_CUBE_MAP)
+        {
+            for (GLuint i = 0; i < 6; i++)
+                glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, colors.data());
+        }
+        else if (target == GL_TEXTURE_2D_ARRAY)
+            glTexImage3D(target, 0, GL_RGBA, 1, 1, colors.size(), 0, GL_RGBA, GL_UNSIGNED_BYTE, colors.data());
+        else
+            glTexImage2D(target, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, colors.data());
+        glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(target, 0);
+
+        *destination = request->placeholder;
+        this->requested++;
+        this->requests.push_back(std::move(request));
+        return this->requests.back().get();
+    }
+
+    //////////////////////////////////////////
+
+    // we queue the decoding of an image on the worker threads
+    void addJob(TextureRequest* request, GLenum imageTarget, const string& path, bool flipVertically, int desiredChannels)
+    {
+        {
+            lock_guard<mutex> lock(this->jobsMutex);
+            this->jobs.emplace_back([this, request, imageTarget, path, flipVertically, desiredChannels]()
+            {
+                DecodedImage image;
+                image.request = request;
+                image.imageTarget = imageTarget;
+                image.path = path;
+                // the flip flag of stb_image is global: we use the per-thread version
+                stbi_set_flip_vertically_on_load_thread(flipVertically);
+                int width, height, channels;
+                if (request->hdrFormat != GL_NONE)
+                {
+                    float* data = stbi_loadf(path.c_str(), &width, &height, &channels, STBI_rgb);
+                    if (data != nullptr)
+                        packHDR(image, data, width, height, request->hdrFormat);
+                    stbi_image_free(data);
+                }
+                else
+                {
+                    image.stbiData = stbi_load(path.c_str(), &width, &height, &channels, desiredChannels);
+                    if (desiredChannels != STBI_default)
+                        channels = desiredChannels;
+                    if (image.stbiData != nullptr)
+                    {
+                        image.format = pixelFormat(channels);
+                        image.texelSize = channels;
+                        image.levels.push_back({width, height, image.stbiData});
+                        if (request->cpuMipmaps)
+                            buildMipmaps(image);
+                    }
+                }
+
+                {
+                    lock_guard<mutex> lock(this->decodedMutex);
+                    this->decoded.push_back(std::move(image));
+                }
+                this->decodedCondition.notify_one();
+            });
+        }
+        this->jobsCondition.notify_one();
+    }
+
+    //////////////////////////////////////////
+
+    // the loop executed by each worker thread
+    void workerLoop()
+    {
+        while (true)
+        {
+            function<void()> job;
+            {
+                unique_lock<mutex> lock(this->jobsMutex);
+                this->jobsCondition.wait(lock, [this]{ return this->stopping || !this->jobs.empty(); });
+                if (this->stopping)
+                    return;
+                job = std::move(this->jobs.front());
+                this->jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    //////////////////////////////////////////
+
+    // same mapping between number of channels and formats used by the synchronous loading functions
+    static GLenum pixelFormat(int channels)
+    {
+        switch (channels)
+        {
+            case 1: return GL_RED;
+            case 2: return GL_RG;
+            case 3: return GL_RGB;
+            default: return GL_RGBA;
+        }
+    }
+
+    //////////////////////////////////////////
+
+    // executed by the worker threads: we build the mipmap chain of an HDR image (2x2 box filter), and we pack it in the requested format
+    static void packHDR(DecodedImage& image, const float* data, int width, int height, GLenum hdrFormat)
+    {
+        // mipmap chain, in floating point
+        vector<vector<glm::vec3>> chain(1, vector<glm::vec3>((const glm::vec3*) data, (const glm::vec3*) data + width * height));
+        vector<glm::ivec2> sizes(1, glm::ivec2(width, height));
+        while (sizes.back().x > 1 || sizes.back().y > 1)
+        {
+            glm::ivec2 src = sizes.back();
+            glm::ivec2 dst = glm::max(src / 2, 1);
+            const vector<glm::vec3>& upper = chain.back();
+            vector<glm::vec3> level(dst.x * dst.y);
+            for (int y = 0; y < dst.y; y++)
+                for (int x = 0; x < dst.x; x++)
+                {
+                    int x0 = min(2 * x, src.x - 1), x1 = min(2 * x + 1, src.x - 1);
+                    int y0 = min(2 * y, src.y - 1), y1 = min(2 * y + 1, src.y - 1);
+                    level[y * dst.x + x] = 0.25f * (upper[y0 * src.x + x0] + upper[y0 * src.x + x1] + upper[y1 * src.x + x0] + upper[y1 * src.x + x1]);
+                }
+            chain.push_back(std::move(level));
+            sizes.push_back(dst);
+        }
+
+        image.format = GL_RGB;
+        image.texelSize = HDRTexelSize(hdrFormat);
+        image.type = hdrFormat == GL_RGB9_E5 ? GL_UNSIGNED_INT_5_9_9_9_REV : hdrFormat == GL_R11F_G11F_B10F ? GL_UNSIGNED_INT_10F_11F_11F_REV : GL_HALF_FLOAT;
+
+        size_t total = 0;
+        for (const glm::ivec2& size : sizes)
+            total += (size_t) size.x * size.y * image.texelSize;
+        image.packed.resize(total);
+
+        // packing of the texels
+        unsigned char* out = image.packed.data();
+        for (size_t l = 0; l < chain.size(); l++)
+        {
+            image.levels.push_back({sizes[l].x, sizes[l].y, out});
+            for (const glm::vec3& texel : chain[l])
+            {
+                if (hdrFormat == GL_RGB9_E5)
+                {
+                    glm::uint32 value = glm::packF3x9_E1x5(texel);
+                    memcpy(out, &value, 4);
+                }
+                else if (hdrFormat == GL_R11F_G11F_B10F)
+                {
+                    glm::uint32 value = glm::packF2x11_1x10(glm::max(texel, 0.0f));
+                    memcpy(out, &value, 4);
+                }
+                else
+                {
+                    glm::uint16 value[3] = {glm::packHalf1x16(texel.x), glm::packHalf1x16(texel.y), glm::packHalf1x16(texel.z)};
+                    memcpy(out, value, 6);
+                }
+                out += image.texelSize;
+            }
+        }
+    }
+
+    //////////////////////////////////////////
+
+    // executed by the worker threads: we build the mipmap chain of an 8 bit image (2x2 box filter, as glGenerateMipmap), after its base level
+    static void buildMipmaps(DecodedImage& image)
+    {
+        int channels = image.texelSize;
+        vector<glm::ivec2> sizes(1, glm::ivec2(image.levels[0].width, image.levels[0].height));
+        size_t total = 0;
+        while (sizes.back().x > 1 || sizes.back().y > 1)
+        {
+            sizes.push_back(glm::max(sizes.back() / 2, 1));
+            total += (size_t) sizes.back().x * sizes.back().y * channels;
+        }
+        image.packed.resize(total);
+
+        unsigned char* out = image.packed.data();
+        for (size_t l = 1; l < sizes.size(); l++)
+        {
+            const unsigned char* upper = image.levels[l - 1].data;
+            glm::ivec2 src = sizes[l - 1], dst = sizes[l];
+            for (int y = 0; y < dst.y; y++)
+                for (int x = 0; x < dst.x; x++)
+                {
+                    int x0 = min(2 * x, src.x - 1), x1 = min(2 * x + 1, src.x - 1);
+                    int y0 = min(2 * y, src.y - 1), y1 = min(2 * y + 1, src.y - 1);
+                    for (int c = 0; c < channels; c++)
+                    {
+                        int sum = upper[(y0 * src.x + x0) * channels + c] + upper[(y0 * src.x + x1) * channels + c] +
+                                  upper[(y1 * src.x + x0) * channels + c] + upper[(y1 * src.x + x1) * channels + c];
+                        out[(y * dst.x + x) * channels + c] = (unsigned char) ((sum + 2) / 4);
+                    }
+                }
+            image.levels.push_back({dst.x, dst.y, out});
+            out += (size_t) dst.x * dst.y * channels;
+        }
+    }
+
+    //////////////////////////////////////////
+
+    // we take the next decoded image. Returns false if there is none
+    bool nextImage()
+    {
+        {
+            lock_guard<mutex> lock(this->decodedMutex);
+            if (this->decoded.empty())
+                return false;
+            this->current = std::move(this->decoded.front());
+            this->decoded.pop_front();
+        }
+
+        if (this->current.levels.empty())
+        {
+            std::cout << "Failed to load texture! Image: " << this->current.path << std::endl;
+            this->finishImage();
+            return true;
+        }
+
+        // the first image of a texture determines its size: we allocate the storage of the final texture
+        TextureRequest* request = this->current.request;
+        if (request->texture == 0)
+        {
+            const DecodedImage& image = this->current;
+            request->width = image.levels[0].width;
+            request->height = image.levels[0].height;
+            GLenum internalFormat = request->hdrFormat != GL_NONE ? request->hdrFormat : image.format;
+            GLuint faces = request->target == GL_TEXTURE_CUBE_MAP ? 6 : 1;
+            GLenum firstFace = request->target == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X : request->target;
+            glGenTextures(1, &request->texture);
+            glBindTexture(request->target, request->texture);
+            if (request->target == GL_TEXTURE_2D_ARRAY)
+                glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, request->width, request->height, request->images, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+            else
+            {
+                for (GLuint i = 0; i < faces; i++)
+                    for (GLint level = 0; level < (GLint) image.levels.size(); level++)
+                        glTexImage2D(firstFace + i, level, internalFormat, image.levels[level].width, image.levels[level].height, 0, image.format, image.type, nullptr);
+            }
+            // when the mipmaps are provided, the chain is complete only up to the last uploaded level
+            if (request->cpuMipmaps)
+                glTexParameteri(request->target, GL_TEXTURE_MAX_LEVEL, (GLint) image.levels.size() - 1);
+            glBindTexture(request->target, 0);
+        }
+        // the layers of an array (and the faces of a cube map) share the same size
+        else if (this->current.levels[0].width != request->width || this->current.levels[0].height != request->height)
+        {
+            std::cout << "Texture size mismatch, image skipped! Image: " << this->current.path << std::endl;
+            stbi_image_free(this->current.stbiData);
+            this->current.packed = vector<unsigned char>();
+            this->finishImage();
+            return true;
+        }
+
+        this->uploading = true;
+        return true;
+    }
+
+    //////////////////////////////////////////
+
+    // we upload at most budget bytes. Returns false if there was nothing to upload
+    bool upload(size_t budget)
+    {
+        bool uploaded = false;
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+        while (budget > 0)
+        {
+            if (!this->uploading && !this->nextImage())
+                break;
+            uploaded = true;
+            if (!this->uploading) // the image failed to load
+                continue;
+
+            DecodedImage& image = this->current;
+            const MipLevel& level = image.levels[image.uploadLevel];
+            size_t rowSize = (size_t) level.width * image.texelSize;
+            int rows = (int) max<size_t>(1, min(min(budget, CHUNK_SIZE), (size_t) (level.height - image.uploadedRows) * rowSize) / rowSize);
+            size_t chunkSize = rows * rowSize;
+
+            // we orphan the previous storage of the buffer, so that mapping doesn't wait for a transfer still in progress
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo[this->nextPBO]);
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, chunkSize, nullptr, GL_STREAM_DRAW);
+            void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, chunkSize, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+            memcpy(mapped, level.data + image.uploadedRows * rowSize, chunkSize);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+            // with a Pixel Buffer Object bound, the last parameter is an offset in the buffer, and the copy is performed asynchronously by the driver
+            glBindTexture(image.request->target, image.request->texture);
+            if (image.request->target == GL_TEXTURE_2D_ARRAY)
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, image.uploadLevel, 0, image.uploadedRows, image.imageTarget, level.width, rows, 1, image.format, image.type, (GLvoid*)0);
+            else
+                glTexSubImage2D(image.imageTarget, image.uploadLevel, 0, image.uploadedRows, level.width, rows, image.format, image.type, (GLvoid*)0);
+            glBindTexture(image.request->target, 0);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            this->nextPBO = (this->nextPBO + 1) % NUM_PBO;
+
+            image.uploadedRows += rows;
+            budget -= min(budget, chunkSize);
+
+            if (image.uploadedRows == level.height)
+            {
+                image.uploadedRows = 0;
+                if (++image.uploadLevel == (int) image.levels.size())
+                {
+                    stbi_image_free(image.stbiData);
+                    image.packed = vector<unsigned char>();
+                    this->uploading = false;
+                    this->finishImage();
+                }
+            }
+        }
+
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        return uploaded;
+    }
+
+    //////////////////////////////////////////
+
+    // one of the images of a texture has been uploaded: when it is the last one, the texture replaces its placeholder
+    void finishImage()
+    {
+        TextureRequest* request = this->current.request;
+        if (--request->pendingImages > 0)
+            return;
+        this->completed++;
+
+        // every image failed: the placeholder is kept
+        if (request->texture == 0)
+            return;
+
+        GLenum target = request->target;
+        glBindTexture(target, request->texture);
+        if (!request->cpuMipmaps)
+            glGenerateMipmap(target);
+        // we set how to consider UVs outside [0,1] range
+        GLenum wrap = request->repeat ? GL_REPEAT : GL_CLAMP_TO_EDGE;
+        glTexParameteri(target, GL_TEXTURE_WRAP_S, wrap);
+        glTexParameteri(target, GL_TEXTURE_WRAP_T, wrap);
+        if (target == GL_TEXTURE_CUBE_MAP)
+            glTexParameteri(target, GL_TEXTURE_WRAP_R, wrap);
+        // we set the filtering for minification and magnification
+        glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glBindTexture(target, 0);
+
+        *request->destination = request->texture;
+        glDeleteTextures(1, &request->placeholder);
+    }
+};
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Linux build: GLFW, Assimp and EGL are the ones of the system (e.g. the packages libglfw3-dev, libassimp-dev and libegl-dev)
+#   ./MakefileLinux.sh            builds Aniso, with the GLFW window
+#   ./MakefileLinux.sh headless   builds AnisoHeadless, where --headless creates the context with EGL, without a display server (HEADLESS_EGL)
+#   ./MakefileLinux.sh ci         builds AnisoHeadless and runs the headless benchmark on Mesa llvmpipe: the exit status is the one of the run
+set -e
+cd "$(dirname "$0")"
+
+compilerflags="-O2 -g -std=c++17"
+includedirs="-I../../include"
+imGuiSrc="../../include/imgui/imgui*.cpp"
+linkerflags="-lglfw -lassimp -ldl -lpthread"
+
+# glad is C code
+gcc -O2 $includedirs -c ../../include/glad/glad.c -o glad.o
+
+if [ "$1" = "headless" ] || [ "$1" = "ci" ]; then
+    g++ $compilerflags -DHEADLESS_EGL $includedirs glad.o $imGuiSrc aniso.cpp -o AnisoHeadless $linkerflags -lEGL
+else
+    g++ $compilerflags $includedirs glad.o $imGuiSrc aniso.cpp -o Aniso $linkerflags
+fi
+
+if [ "$1" = "ci" ]; then
+    # the software rasterizer of Mesa, on the surfaceless platform
+    LIBGL_ALWAYS_SOFTWARE=1 GALLIUM_DRIVER=llvmpipe ./AnisoHeadless --headless --frames 100 --size 1280x720 --timings headless_timings.csv
+fi
@@ -4,7 +4,7 @@ IF EXIST "C:\Program Files (x86)\Microsoft Visual Studio\2019\BuildTools\VC\Auxi
 ) ELSE (
     call "C:\Program Files (x86)\Microsoft Visual Studio\2019\Community\VC\Auxiliary\Build\vcvarsall.bat" x64
 )
-set compilerflags=/Od /Zi /EHsc /MT
+set compilerflags=/Od /Zi /EHsc /MT /std:c++17
 set includedirs=/I../../include
 set imGuiSrc=../../include/imgui/imgui*.cpp
 set linkerflags=/LIBPATH:../../libs/win glfw3.lib assimp-vc142-mt.lib zlib.lib IrrXML.lib gdi32.lib user32.lib Shell32.lib
@@ -4,6 +4,9 @@
 // Std. Includes
 #include <string>
 #include <map>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
 
 // Loader for OpenGL extensions
 // http://glad.dav1d.de/
@@ -16,6 +19,12 @@
 
 #include <glad/glad.h>
 
+// in headless mode, the context can be created with EGL, without any display server (see HEADLESS MODE)
+#ifdef HEADLESS_EGL
+    #include <EGL/egl.h>
+    #include <EGL/eglext.h>
+#endif
+
 // GLFW library to create window and to manage I/O
 #include <glfw/glfw3.h>
 
@@ -27,7 +36,7 @@
 
 // classes developed during lab lectures to manage shaders, to load models, and for FPS camera
 // in this example, the Model and Mesh classes support texturing
-#include <utils/shader_v1.h>
+#include <utils/shader_v2.h>
 #include <utils/model_v2.h>
 #include <utils/camera.h>
 
@@ -40,6 +49,31 @@
 // we include the library for images loading
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image/stb_image.h>
+// in headless mode, the frames can be saved on disk
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image/stb_image_write.h>
+// asynchronous decoding and streaming of the textures
+#include <utils/texture_loader.h>
+// GPU time of the render passes
+#include <utils/gpu_timer.h>
+// CPU time of the frames
+#include <utils/frame_profiler.h>
+// instances of the models, BVH and frustum culling
+#include <utils/scene.h>
+// accumulation of the Monte-Carlo estimates over the frames
+#include <utils/temporal_accumulation.h>
+// G-buffer of the deferred shading
+#include <utils/gbuffer.h>
+// half vectors of the specular integration, computed on the CPU
+#include <utils/sample_table.h>
+// cube maps baked at runtime from equirectangular images
+#include <utils/environment_baker.h>
+// the environments available in the textures folder, streamed in background
+#include <utils/environment_library.h>
+// hot reload of the Shader Programs when their sources are modified
+#include <utils/shader_reloader.h>
+// simulation on its own thread, and exchange of the frame state with the rendering
+#include <utils/simulation_thread.h>
 
 // we include Dear ImGui for parameter tweaking and performance evaluation
 #include <imgui/imgui.h>
@@ -50,19 +84,94 @@
 #define MY_MAX_SUB_UNIF 32
 
 ///////////////////////////////////////////////////////////
-// directional shininess(es) for Ashikhmin-Shirley model and sample count for Monte-Carlo integration
-GLfloat nU = 20000.0f, nV = 5.0f;
+// directional shininess(es) (nU, nV) for Ashikhmin-Shirley model: the LUTs of each pair (BRDF integral and half-vector sampling)
+// are the layers of two texture arrays, so each object chooses its pair with an index (see LUTPaths)
+const std::vector<glm::vec2> shininessPairs = {{20000, 5}, {1, 1}, {5, 5}, {70, 70}, {20000, 20000}, {5, 70}, {20000, 70}, {70, 20000}, {1, 20000}};
+// the shininess of the objects (index in shininessPairs)
+GLint currentShininess = 0;
+// sample count for Monte-Carlo integration
 GLuint sampleCount = 5u;
+// with adaptive sampling, sampleCount is the budget of each fragment, which chooses its own number of samples from the width of the lobe,
+// the view angle and the screen-space derivatives of the reflection (see AdaptiveSampleCount in env_bump_aniso.frag)
+GLboolean adaptiveSampling = GL_FALSE;
+// scale of the adaptive number of samples
+GLfloat adaptiveQuality = 1.0f;
+// debug view of the number of samples of each fragment
+GLboolean sampleCountView = GL_FALSE;
+// with temporal accumulation, each frame uses temporalSampleCount samples (instead of sampleCount), rotated differently in each pixel and frame,
+// and the frames are blended in a history reprojected with motion vectors (see utils/temporal_accumulation.h)
+GLboolean temporalAccumulation = GL_FALSE;
+GLuint temporalSampleCount = 4u;
+// maximum number of frames in the history: the more frames, the less noise, but the slower the history adapts to changes
+GLuint historyLength = 32u;
+// with deferred shading, a geometry pass stores the surface of each pixel in a G-buffer (see utils/gbuffer.h),
+// then a full-screen pass integrates the environment once per pixel, instead of once per rasterized fragment
+GLboolean deferredShading = GL_FALSE;
+// divisor of the resolution of the specular integration in the deferred shading (1, 2 or 4): above 1, the specular term is integrated
+// in a low resolution target, and upsampled with a bilateral filter guided by the depth and the normals of the G-buffer
+GLuint specularDownsample = 1u;
+// with the depth pre-pass, the objects are first rendered only in the depth buffer, and then shaded with an equal depth test:
+// the fragment shader of the forward (or geometry) pass runs only on the visible fragments.
+// With parallaxDepth, the pre-pass writes the depth of the point hit by the parallax mapping, so that the silhouettes and the intersections
+// of the displaced surfaces are correct: the shading pass computes and writes the same depth, and it keeps the equal depth test.
+// The depth is known only after the displacement, so the shading pass always runs the displacement of the hidden fragments
+// (the rest of the shading is skipped only if the driver uses the conservative depth, see PARALLAX_DEPTH in env_bump_aniso.frag)
+GLboolean depthPrepass = GL_FALSE;
+GLboolean parallaxDepth = GL_FALSE;
 
 // the paths for the various textures
 std::string texturesFolder = "../../textures/";
-std::string materialFolder = "hammered_metal/";
-std::string materialPath = texturesFolder + materialFolder;
 
-std::string cubeMapsFolder = "arches/";
-std::string cubeMapsPath = texturesFolder + cubeMapsFolder;
-std::string environmentPath = cubeMapsPath + "environment/";
-std::string irradiancePath = cubeMapsPath + "irradiance/";
+// the environments are the subfolders of texturesFolder and of texturesFolder + "cube/" (see utils/environment_library.h):
+// environmentName is the one selected at start (--environment). Selecting another one streams its cube maps in background
+std::string environmentName = "arches";
+// GPU memory for the environments which stay resident after they have been replaced, so that switching back to them is immediate
+GLuint environmentBudgetMB = 256;
+// true if the current environment stores linear HDR radiance (false for the tone mapped and the 8 bit ones)
+GLboolean hdrEnvironment = GL_FALSE;
+
+// storage of the HDR cube maps ("environment" and "irradiance"): GL_RGB9_E5, GL_R11F_G11F_B10F, GL_RGB16F, or GL_NONE for the 8 bit tone mapped version
+// the Monte-Carlo loop in Specular_Irradiance reads the environment map along scattered directions, so it is bound by texture cache misses:
+// - GL_RGB9_E5 (4 bytes/texel): full HDR range, 9 bit mantissas with a shared exponent (dark channels of saturated colors lose precision)
+// - GL_R11F_G11F_B10F (4 bytes/texel): independent exponents, but only 6/6/5 bit mantissas, which may shift hues
+// - GL_RGB16F (6 bytes/texel, usually padded to 8 on the GPU): best precision, but each cache line holds half of the texels of the 4 byte formats
+GLenum cubeMapFormat = GL_RGB9_E5;
+
+// with the compute shaders of OpenGL 4.3, the cube maps can also be baked at runtime from an equirectangular HDR image (see utils/environment_baker.h),
+// computing bakeBudget texels per frame, so that the environment can be changed without stalls.
+// With bakeAtStart (--equirect), the image is baked during the first frames, and it replaces the environment selected at start
+std::string equirectPath = texturesFolder + "arches/Arches_E_PineTree_Env.hdr";
+GLboolean bakeAtStart = GL_FALSE;
+GLuint bakeBudget = 1 << 16;
+// the minor versions of the OpenGL 4 contexts we try to create, in order: 4.3 enables the environment baker
+const int CONTEXT_MINOR_VERSIONS[] = {3, 1};
+
+///////////////////////////////////////////////////////////
+// MATERIALS
+
+// the maps of all of the materials are layers of a single texture array: each material occupies NUM_MATERIAL_MAPS consecutive layers,
+// in the order of materialMaps (the same order of the constants in env_bump_aniso.frag).
+// All of the maps must have the same size. Choosing the material of an object is then a single uniform, and the array is bound once for all of the objects
+std::vector<std::string> materialFolders = {"hammered_metal/", "metal_pattern/", "metal_tiles/"};
+const std::vector<std::string> materialMaps = {"albedo.jpg", "normal.jpg", "depth.png", "ao.jpg", "metallic.jpg", "quaternion.png", "rotation.png", "cone.png", "quadtree.png"};
+const GLuint NUM_MATERIAL_MAPS = 9;
+// until the array is loaded, each map is replaced by a neutral value for its content:
+// grey albedo, unperturbed normal, no displacement, no occlusion, no metalness, identity rotations, flat cone map (depth 0, null cones), flat quadtree
+const std::vector<glm::u8vec4> materialPlaceholders = {
+    glm::u8vec4(128, 128, 128, 255), glm::u8vec4(128, 128, 255, 255), glm::u8vec4(0, 0, 0, 255), glm::u8vec4(255, 255, 255, 255),
+    glm::u8vec4(0, 0, 0, 255), glm::u8vec4(255, 128, 128, 255), glm::u8vec4(255, 128, 128, 255), glm::u8vec4(0, 0, 0, 255), glm::u8vec4(0, 0, 0, 255)};
+// the material of the objects (index in materialFolders)
+GLint currentMaterial = 0;
+
+// the textures shared by all of the objects, each one with its own texture unit.
+// The sampler uniforms are assigned once, when a Shader Program is created (see SetupTextureUnits)
+enum TextureUnit { BRDF_LUT_UNIT, HALF_VECTOR_UNIT, MATERIAL_UNIT, ENVIRONMENT_UNIT, IRRADIANCE_UNIT, NUM_TEXTURE_UNITS };
+// the texture target of each unit
+const GLenum textureUnitTargets[NUM_TEXTURE_UNITS] = {GL_TEXTURE_2D_ARRAY, GL_TEXTURE_2D_ARRAY, GL_TEXTURE_2D_ARRAY, GL_TEXTURE_CUBE_MAP, GL_TEXTURE_CUBE_MAP};
+// the binding point of the uniform buffer of the half vectors (see utils/sample_table.h), assigned with the texture units
+const GLuint SAMPLE_TABLE_BINDING = 0;
+// the number of samples of each shininess pair in the table (0 if the current sample count does not fit)
+GLuint tableSampleCount = 0;
 
 ///////////////////////////////////////////////////////////
 // USER INPUT
@@ -70,8 +179,6 @@ std::string irradiancePath = cubeMapsPath + "irradiance/";
 // callback functions for keyboard and mouse events
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mode);
 void mouse_callback(GLFWwindow* window, double xpos, double ypos);
-// if one of the WASD keys is pressed, we call the corresponding method of the Camera class
-void apply_camera_movements();
 
 // we initialize an array of booleans for each keybord key
 bool keys[1024];
@@ -81,6 +188,8 @@ GLfloat lastX, lastY;
 
 // when rendering the first frame, we do not have a "previous state" for the mouse, so we need to manage this situation
 bool firstMouse = true;
+// sum of the offsets of the mouse cursor, read by the simulation (see SIMULATION THREAD)
+glm::vec2 mouseOffset = glm::vec2(0.0f);
 // control the state of the application
 GLboolean optionsOverlayActive = GL_FALSE;
 
@@ -102,6 +211,51 @@ vector<std::string> subroutines_names;
 std::map<std::string, int> sub_uniform_location; 
 // a dictionary that matches active subroutine names to their indices
 std::map<std::string, GLuint> subroutine_index; 
+// true for the subroutine uniforms selected on the command line (--subroutine): the sweep does not change them
+vector<GLboolean> fixed_subroutines;
+
+///////////////////////////////////////////////////////////
+// SHADER PERMUTATIONS
+
+// if true, the illumination shader is specialized at compile time for the current selection of subroutines
+// if false, the subroutine uniforms of the generic Shader Program are used (fallback path)
+GLboolean staticPermutations = GL_TRUE;
+// the specialized Shader Programs compiled so far, keyed by the block of defines which generated them
+std::map<std::string, Shader> shader_permutations;
+// average GPU time of the objects pass measured with each dispatch method (index 0: subroutines, index 1: static permutations)
+GLfloat dispatchGPUTime[2] = {0.0f, 0.0f};
+// the measurements start again when the Shader Program of the objects or the subroutines change (see the OBJECTS pass)
+Shader* measuredShader = nullptr;
+vector<GLuint> measuredSubroutines;
+GLuint measuredFrames = 0;
+
+// build the block of #define directives which maps each subroutine uniform to the currently selected subroutine
+std::string PermutationDefines();
+// return the Shader Program specialized for the given defines, compiling it the first time it is requested (then it is watched by the reloader)
+Shader& GetPermutation(const std::string& defines, GLboolean& compiled, ShaderReloader& shaderReloader);
+
+// the passes which use a permutation of the illumination shader, as flags combined with the defines of the selected subroutines
+enum PermutationPass { PASS_FORWARD = 0, PASS_GBUFFER = 1, PASS_DEPTH_PREPASS = 2, PASS_PARALLAX_DEPTH = 4, NUM_PERMUTATION_PASSES = 8 };
+// the permutation used by each combination of the flags, and the selection of the subroutines it has been specialized for:
+// the defines are built, and the permutation is searched, only when the selection changes
+Shader* cachedPermutations[NUM_PERMUTATION_PASSES] = {};
+vector<GLuint> cachedSelections[NUM_PERMUTATION_PASSES];
+// return the permutation of a pass for the current selection of subroutines (compiled is true if it has been compiled now)
+Shader& CurrentPermutation(GLuint passes, GLboolean& compiled, ShaderReloader& shaderReloader);
+
+///////////////////////////////////////////////////////////
+// SHADER HOT RELOAD
+
+// the sources of the Shader Programs are watched, and the modified programs are rebuilt in background (see utils/shader_reloader.h)
+GLboolean shaderHotReload = GL_TRUE;
+// the programs are built in a context which shares the objects with the one of the application: a hidden window,
+// or a second EGL context in headless mode. The reloader makes it current on its worker thread
+bool CreateWorkerContext(GLFWwindow* window);
+void BindWorkerContext();
+void ReleaseWorkerContext();
+void DestroyWorkerContext();
+// after a reload of the illumination shader, we rebuild the tables of the subroutines (see SetupShader), keeping the current selections
+void ReloadSubroutines(GLuint program);
 
 ///////////////////////////////////////////////////////////
 // SHADER AND TEXTURES SETUP
@@ -114,7 +268,17 @@ void PrintCurrentShader(int subroutine);
 
 // load image from disk and create an OpenGL texture
 GLint LoadTexture(const char* path, bool repeat);
-GLint LoadCubeMap(const char* path, const char* format);
+GLint LoadTextureArray(const vector<std::string>& paths, bool repeat);
+// the paths of the maps of all of the materials, in the order of the layers of the texture array
+vector<std::string> MaterialMapPaths();
+// the paths of the LUTs with the given name ("brdfIntegration" or "halfVectorSampling"), one for each shininess pair
+vector<std::string> LUTPaths(const std::string& name);
+// we assign the texture units to the sampler uniforms of a Shader Program
+void SetupTextureUnits(GLuint program);
+// we assign the uniforms of the lighting (sampling of the environment) to a Shader Program: the illumination shader, or the deferred shading pass
+void SetLightingUniforms(GLuint program, GLuint frameIndex);
+// we assign the matrices of the camera (in this frame and in the previous one) and its position to a Shader Program
+void SetViewUniforms(GLuint program, const glm::mat4& projection, const glm::mat4& view, const glm::mat4& previousProjection, const glm::mat4& previousView);
 
 ///////////////////////////////////////////////////////////
 // GUI MANAGEMENT
@@ -127,6 +291,7 @@ GLint LoadCubeMap(const char* path, const char* format);
 namespace ImGui {
     bool RadioButton(const char* label, GLuint* v, GLuint v_button);
     bool SliderInt(const char* label, GLuint* v, GLuint v_min, GLuint v_max, const char* format, ImGuiSliderFlags flags);
+    bool Checkbox(const char* label, GLboolean* v);
 }
 
 // return true if the subroutine passed as the second parameter is compatible and currently selected for the subroutine uniform passed as the first parameter
@@ -141,7 +306,7 @@ GLfloat setupTime = 0.0f;
 GLfloat deltaTime = 0.0f;
 GLfloat lastFrame = 0.0f;
 
-// rotation angle on Y axis
+// rotation angle on Y axis (modified only by the steps of the simulation)
 GLfloat orientationY = 0.0f;
 // rotation speed on Y axis
 GLfloat spin_speed = 30.0f;
@@ -152,6 +317,7 @@ GLboolean spinning = GL_TRUE;
 GLboolean wireframe = GL_FALSE;
 
 // we create a camera. We pass the initial position as a paramenter to the constructor. The last boolean tells that we want a camera "anchored" to the ground
+// The camera is moved only by the steps of the simulation: the rendering reads the view of the FramePacket
 Camera camera(glm::vec3(0.0f, 0.0f, 7.0f), GL_TRUE);
 
 // Fresnel reflectance at 0 degree (Schlik's approximation)
@@ -160,8 +326,13 @@ glm::vec3 F0(0.14, 0.14, 0.14);
 // directional shininess(es) for Ashikhmin-Shirley model
 GLfloat nX = 1.5f, nY = 100.0f;
 
-// vector for the textures IDs
+// vector for the textures IDs, indexed by texture unit
 vector<GLuint> textureID;
+// true if the textures must be bound again to their units: the loader binds textures while uploading, and replaces the placeholders
+GLboolean rebindTextures = GL_TRUE;
+// if true, textures are decoded in background and streamed to the GPU during the first frames (see utils/texture_loader.h)
+// if false, they are all loaded before the first frame
+GLboolean asyncTextureLoading = GL_TRUE;
 
 // UV repetitions
 glm::vec2 repeat = glm::vec2(1.0f, 1.0f);
@@ -169,67 +340,254 @@ glm::vec2 repeat = glm::vec2(1.0f, 1.0f);
 // height scale for Parallax Occlusion Mapping
 GLfloat heightScale = 0.01;
 
+///////////////////////////////////////////////////////////
+// SCENE
+
+// the objects are instances in a Scene (see utils/scene.h): the central sphere, and the objects of the stress test.
+// Each frame, only the instances inside the view frustum are drawn.
+// With instancedRendering, the visible instances of each model are drawn with one draw call, reading their parameters from the instance buffer;
+// otherwise each object is drawn with its own uniforms and draw call, to measure the cost of the draw calls
+GLboolean instancedRendering = GL_TRUE;
+// initial state of the frustum culling (then it is a setting of the scene)
+GLboolean frustumCulling = GL_TRUE;
+
+// the stress test adds a grid of stressGridSize x stressGridSize objects (spheres and cubes alternated),
+// each one with its own material, shininess, F0 and UV repetitions
+GLboolean stressTest = GL_FALSE;
+GLint stressGridSize = 40;
+// distance between the centers of two neighbouring objects
+const GLfloat STRESS_GRID_SPACING = 2.0f;
+// the index of the central sphere in the scene
+const GLuint CENTRAL_SPHERE = 0;
+
+// we place the objects in the scene
+void BuildScene(Scene& scene, Model& sphereModel, Model& cubeModel);
+// we draw the visible instances with a Shader Program (the illumination shader, or the depth pre-pass): with instanced rendering,
+// a draw call for each model (UploadVisible must have been called), otherwise a draw call for each object, with its uniforms
+void DrawObjects(GLuint program, const vector<Scene::Batch>& batches);
+
+///////////////////////////////////////////////////////////
+// SIMULATION THREAD
+
+// the camera movements and the animation of the central sphere run on a simulation thread, with a fixed time step (see utils/simulation_thread.h).
+// Each step produces a FramePacket, and the main thread renders the most recent one: the next steps run while the frame is submitted
+// and drawn, and a slow step never delays a frame.
+// GLFW processes the events only on the main thread, which keeps the input polling and the GUI: after the polling, it publishes a SimulationInput.
+// In headless mode (and if simulationThread is false), the main thread calls a step in each frame, of deltaTime seconds
+GLboolean simulationThread = GL_TRUE;
+const GLfloat SIMULATION_TIME_STEP = 1.0f / 120.0f;
+
+// the input of a step
+struct SimulationInput
+{
+    // the WASD, SPACE and LEFT SHIFT keys, in the order of Camera_Movement
+    bool Movements[6] = {false, false, false, false, false, false};
+    // the sum of the offsets of the mouse cursor: the step uses the difference with the sum read by the previous one,
+    // so the movements of the inputs published between two steps are not lost
+    glm::vec2 MouseOffset = glm::vec2(0.0f);
+    // false while the GUI uses the mouse
+    GLboolean CameraActive = GL_TRUE;
+    GLboolean Spinning = GL_TRUE;
+};
+
+// the state of a frame, produced by a step and never modified after its publication
+struct FramePacket
+{
+    glm::mat4 View = glm::mat4(1.0f);
+    glm::vec3 CameraPosition = glm::vec3(0.0f);
+    glm::mat4 SphereModelMatrix = glm::mat4(1.0f);
+    // seconds simulated since the start
+    GLfloat Time = 0.0f;
+};
+
+// the packet rendered in the current frame
+FramePacket frame;
+
+// the step of the simulation: the state (camera, orientationY) is used only by the thread running the steps
+FramePacket SimulateStep(const SimulationInput& input, GLfloat timeStep);
+// if one of the WASD keys is pressed, we call the corresponding method of the Camera class
+void apply_camera_movements(const SimulationInput& input, GLfloat timeStep);
+
+///////////////////////////////////////////////////////////
+// HEADLESS MODE
+
+// with --headless, the application renders a fixed number of frames in an offscreen framebuffer, without window, input and GUI,
+// and it reports the CPU and GPU time of each frame (e.g. for automated benchmarks on Mesa llvmpipe).
+// If the application is compiled with HEADLESS_EGL (Linux, linking libEGL), the context is created by EGL without a display server
+// (surfaceless platform); otherwise GLFW creates a hidden window (on Linux, under a virtual X server like Xvfb).
+// MakefileLinux.sh builds the EGL version with "headless", and with "ci" it runs the benchmark on llvmpipe.
+// Command line options:
+//   --headless          enables the headless mode
+//   --frames N          number of rendered frames (default: 100)
+//   --size WxH          size of the offscreen framebuffer (default: 1280x720)
+//   --dump FOLDER       saves each frame as a PNG image (the readback stalls the pipeline: timings of these runs are not representative)
+//   --timings FILE      saves the CPU and GPU time of each frame in a CSV file
+//   --material N        material of the objects (index in materialFolders)
+//   --shininess N       shininess of the objects (index in shininessPairs)
+//   --stress N          renders the stress test scene, with a grid of NxN objects
+//   --no-instancing     draws each object with its own draw call
+//   --no-culling        draws also the objects outside of the view frustum
+//   --no-hot-reload     the Shader Programs are not rebuilt when their sources are modified
+//   --samples N         number of samples of the specular integration (with --adaptive, the maximum of each fragment)
+//   --adaptive Q        adaptive number of samples, with quality Q
+//   --sample-view       renders the number of samples of each fragment
+//   --temporal N        temporal accumulation, with N samples per frame
+//   --deferred          deferred shading
+//   --specular-res N    deferred shading, with the specular term integrated at 1/N of the resolution (N = 1, 2 or 4)
+//   --prepass           depth pre-pass
+//   --parallax-depth    depth pre-pass with the depth of the parallax mapping
+//   --subroutine U=S    selects the subroutine S for the subroutine uniform U (repeatable)
+//   --dynamic           uses the subroutine uniforms instead of the compile-time permutations
+//   --environment NAME  environment selected at start (the name of its folder, e.g. arches or NissiBeach)
+//   --equirect FILE     bakes the cube maps from an equirectangular HDR image, during the first frames (requires OpenGL 4.3)
+//   --bake-budget N     texels computed in each frame by the environment baker
+//   --sweep N           benchmark of every combination of subroutines, except the ones selected with --subroutine (enables the headless mode, see SUBROUTINE SWEEP)
+GLboolean headless = GL_FALSE;
+GLuint headlessFrames = 100;
+int headlessWidth = 1280, headlessHeight = 720;
+std::string dumpFolder, timingsPath;
+// the "Uniform=Subroutine" selections of the command line
+vector<std::string> subroutineSelections;
+// in headless mode the animations advance by a fixed time step, so that the frames don't depend on the speed of the machine
+const GLfloat HEADLESS_TIME_STEP = 1.0f / 60.0f;
+
+// the time of the application is measured from here: glfwGetTime can't be used if GLFW is not initialized (HEADLESS_EGL)
+const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+// seconds since the start of the application
+GLfloat GetTime();
+
+// we read the options of the command line. Returns false if they are not valid
+bool ParseCommandLine(int argc, char** argv);
+// we apply the subroutine selections of the command line. Returns false if a name is unknown or the subroutine is not compatible with the uniform
+bool SelectSubroutines(const vector<std::string>& selections);
+// we create the OpenGL context of the headless mode (window is a hidden window, or nullptr with EGL), and we load the OpenGL functions
+bool CreateHeadlessContext(GLFWwindow*& window);
+void DestroyHeadlessContext();
+// we print the statistics of the timings of the headless frames, and we save them in the CSV file
+// cpuTimes: submission of the commands; frameTimes: from the start of the frame to the end of its execution
+void ReportHeadlessTimings(const vector<GLfloat>& cpuTimes, const vector<GLfloat>& frameTimes);
+// the GPU time of each of the first headless frames: the sum of the recorded samples of the pass timers
+vector<GLfloat> HeadlessGPUTimes(GLuint frames);
+
+///////////////////////////////////////////////////////////
+// SUBROUTINE SWEEP
+
+// with --sweep N, the headless mode renders every combination in the cartesian product of the compatible subroutines of each uniform:
+// SWEEP_WARMUP_FRAMES frames, which are discarded (they include the compilation of the permutation), then N measured frames.
+// The combinations are ranked by the median of their GPU time, printed on console and saved in the --timings file.
+// The subroutine uniforms selected with --subroutine keep their selection: only the other ones are swept
+GLuint sweepFrames = 0;
+const GLuint SWEEP_WARMUP_FRAMES = 5;
+
+// number of combinations of subroutines
+GLuint NumCombinations();
+// we select the subroutines of a combination: its index is a mixed radix number, with a digit for each subroutine uniform
+void SelectCombination(GLuint combination);
+// we print and save the table of the combinations, ranked by GPU time
+void ReportSweep(const vector<GLfloat>& frameTimes);
+
+///////////////////////////////////////////////////////////
+// GPU TIME OF THE RENDER PASSES
+
+// a timer for each pass of the frame (objects, skybox, GUI), see utils/gpu_timer.h
+vector<GPUTimer*> passTimers;
+
+///////////////////////////////////////////////////////////
+// CPU TIME OF THE FRAMES
+
+// the scopes of a frame, in order (see utils/frame_profiler.h)
+enum FrameScope { SCOPE_UPDATE, SCOPE_POLL, SCOPE_DRAW, SCOPE_GUI, SCOPE_SWAP };
+FrameProfiler frameProfiler({"update", "poll", "draw", "gui", "swap"});
+
+///////////////////////////////////////////////////////////
+// TIMINGS CAPTURE
+
+// a capture records every frame (CPU scopes) and every sample of the pass timers (GPU) for captureDuration seconds,
+// then it saves them in capturePath + "_gpu.csv", "_gpu.json" and "_frames.csv"
+GLfloat captureDuration = 5.0f;
+// end time of the current capture (0 if there is no capture running)
+GLfloat captureEnd = 0.0f;
+std::string capturePath = "timings";
+
+// we start a capture, or we complete it when its time is over
+void StartCapture();
+void UpdateCapture();
+
+// the windows of the GUI
+void RenderGUI(TextureLoader& textureLoader, EnvironmentBaker& environmentBaker, EnvironmentLibrary& environmentLibrary, ShaderReloader& shaderReloader, SimulationThread<SimulationInput, FramePacket>& simulation, Scene& scene);
+
+// the scene and the render loop, and the release of the context at the end
+int RunApplication(GLFWwindow* window);
+void DestroyContext(GLFWwindow* window);
+
 /////////////////// MAIN function ///////////////////////
-int main()
-{
-    // Determine the names of the LUTs based on the shininess values
-    std::string strNU = std::to_string(nU);
-    strNU.erase(strNU.find_last_not_of('0') + 1, std::string::npos);
-    strNU.erase(strNU.find_last_not_of('.') + 1, std::string::npos);
-    std::string strNV = std::to_string(nV);
-    strNV.erase(strNV.find_last_not_of('0') + 1, std::string::npos);
-    strNV.erase(strNV.find_last_not_of('.') + 1, std::string::npos);
-
-    std::string brdfLUTName = "brdfIntegration [" + strNU + "," + strNV + "].png";
-    std::string brdfLUTPath = texturesFolder + brdfLUTName;
-    std::string hvLUTName = "halfVectorSampling [" + strNU + "," + strNV + "].png";
-    std::string hvLUTPath = texturesFolder + hvLUTName;
-
-    // Initialization of OpenGL context using GLFW
-    glfwInit();
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
-    const char* glsl_version = "#version 410";
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-    // we set if the window is resizable
-    glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
+int main(int argc, char** argv)
+{
+    if (!ParseCommandLine(argc, argv))
+        return -1;
 
-    // Get monitor information
-    const GLFWvidmode* mode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+    const char* glsl_version = "#version 410";
+    GLFWwindow* window = nullptr;
+    if (headless)
+    {
+        if (!CreateHeadlessContext(window))
+        {
+            std::cout << "Failed to create the headless OpenGL context" << std::endl;
+            return -1;
+        }
+    }
+    else
+    {
+        // Initialization of OpenGL context using GLFW
+        glfwInit();
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+        // we set if the window is resizable
+        glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
+
+        // Get monitor information
+        const GLFWvidmode* mode = glfwGetVideoMode(glfwGetPrimaryMonitor());
     
-    glfwWindowHint(GLFW_RED_BITS, mode->redBits);
-    glfwWindowHint(GLFW_GREEN_BITS, mode->greenBits);
-    glfwWindowHint(GLFW_BLUE_BITS, mode->blueBits);
-    glfwWindowHint(GLFW_REFRESH_RATE, mode->refreshRate);
+        glfwWindowHint(GLFW_RED_BITS, mode->redBits);
+        glfwWindowHint(GLFW_GREEN_BITS, mode->greenBits);
+        glfwWindowHint(GLFW_BLUE_BITS, mode->blueBits);
+        glfwWindowHint(GLFW_REFRESH_RATE, mode->refreshRate);
     
-    GLFWwindow* window = glfwCreateWindow(mode->width, mode->height, "Anisotropic with Tangent Mapping given by Normal Mapping Perturbation", NULL, NULL);
+        // the environment baker needs OpenGL 4.3 (compute shaders): where it is not available (e.g. macOS), we fall back to OpenGL 4.1
+        for (int minor : CONTEXT_MINOR_VERSIONS)
+        {
+            glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, minor);
+            window = glfwCreateWindow(mode->width, mode->height, "Anisotropic with Tangent Mapping given by Normal Mapping Perturbation", NULL, NULL);
+            if (window)
+                break;
+        }
 
-    if (!window)
-    {
-        std::cout << "Failed to create GLFW window" << std::endl;
-        glfwTerminate();
-        return -1;
-    }
-    glfwSetWindowPos(window, 0, 30);
-    glfwMakeContextCurrent(window);
+        if (!window)
+        {
+            std::cout << "Failed to create GLFW window" << std::endl;
+            glfwTerminate();
+            return -1;
+        }
+        glfwSetWindowPos(window, 0, 30);
+        glfwMakeContextCurrent(window);
 
-    // we put in relation the window and the callbacks
-    glfwSetKeyCallback(window, key_callback);
-    glfwSetCursorPosCallback(window, mouse_callback);
+        // we put in relation the window and the callbacks
+        glfwSetKeyCallback(window, key_callback);
+        glfwSetCursorPosCallback(window, mouse_callback);
     
 
-    // we disable the mouse cursor
-    glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+        // we disable the mouse cursor
+        glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 
-    // GLAD tries to load the context set by GLFW
-    if (!gladLoadGLLoader((GLADloadproc) glfwGetProcAddress))
-    {
-        std::cout << "Failed to initialize OpenGL context" << std::endl;
-        return -1;
+        // GLAD tries to load the context set by GLFW
+        if (!gladLoadGLLoader((GLADloadproc) glfwGetProcAddress))
+        {
+            std::cout << "Failed to initialize OpenGL context" << std::endl;
+            return -1;
+        }
     }
 
-
   // setup Dear ImGui Context
     IMGUI_CHECKVERSION();
     ImGui::CreateContext();
@@ -238,20 +596,59 @@ int main()
     // Setup Dear ImGui style
     ImGui::StyleColorsDark();
 
-    // Setup Platform/Renderer backends
-    ImGui_ImplGlfw_InitForOpenGL(window, true);
-    ImGui_ImplOpenGL3_Init(glsl_version);
+    // Setup Platform/Renderer backends (there is no GUI in headless mode)
+    if (!headless)
+    {
+        ImGui_ImplGlfw_InitForOpenGL(window, true);
+        ImGui_ImplOpenGL3_Init(glsl_version);
+    }
+
+    // the objects which own OpenGL resources (their destructors delete them) are locals of RunApplication:
+    // they are destroyed before the context
+    int result = RunApplication(window);
+    DestroyContext(window);
+    return result;
+}
 
+//////////////////////////////////////////
+// The function creates the scene and runs the render loop: it returns when the application is closing
+int RunApplication(GLFWwindow* window)
+{
 
 // SCENE SETUP
 
     // we define the viewport dimensions
     int width, height;
-    glfwGetFramebufferSize(window, &width, &height);
+    // in headless mode there is no default framebuffer to draw in: we render in a framebuffer with color and depth renderbuffers
+    GLuint offscreenFBO = 0, offscreenBuffers[2] = {0, 0};
+    if (headless)
+    {
+        width = headlessWidth;
+        height = headlessHeight;
+        glGenFramebuffers(1, &offscreenFBO);
+        glBindFramebuffer(GL_FRAMEBUFFER, offscreenFBO);
+        glGenRenderbuffers(2, offscreenBuffers);
+        glBindRenderbuffer(GL_RENDERBUFFER, offscreenBuffers[0]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, offscreenBuffers[0]);
+        glBindRenderbuffer(GL_RENDERBUFFER, offscreenBuffers[1]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, offscreenBuffers[1]);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        {
+            std::cout << "Failed to create the offscreen framebuffer" << std::endl;
+            return -1;
+        }
+    }
+    else
+        glfwGetFramebufferSize(window, &width, &height);
     glViewport(0, 0, width, height);
 
     // we enable Z test
     glEnable(GL_DEPTH_TEST);
+    // the lookups of the cube maps filter across the edges of the faces: otherwise the coarse mip levels read by the
+    // filtered importance sampling (Specular_Filtered in env_bump_aniso.frag) show the seams of the cube
+    glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
 
     //the "clear" color for the frame buffer
     glm::vec4 clear_color = glm::vec4(0.26f, 0.46f, 0.98f, 1.0f);
@@ -260,67 +657,231 @@ int main()
     // we create the Shader Program used for objects (which presents different subroutines we can switch)
     Shader illumination_shader = Shader("env_bump_aniso.vert", "env_bump_aniso.frag");
     Shader skybox_shader = Shader("skybox.vert", "skybox.frag");
+    // the skybox triangle has no attributes, but a VAO must be bound to draw it
+    GLuint skyboxVAO;
+    glGenVertexArrays(1, &skyboxVAO);
+    // the framebuffers of the temporal accumulation: its textures use the units after the ones of the textures of the scene
+    TemporalAccumulation temporal(width, height, NUM_TEXTURE_UNITS);
+    // true if the previous frame has been accumulated: otherwise, the history is discarded
+    GLboolean accumulating = GL_FALSE;
+    // the deferred shading: the geometry pass is a permutation of the illumination shader (see GBUFFER_PASS in env_bump_aniso.frag),
+    // the shading pass is the same fragment shader on a full-screen triangle. The G-buffer uses the units after the ones of the accumulation
+    Shader deferred_shader = Shader("fullscreen_triangle.vert", "env_bump_aniso.frag", "#define DEFERRED_SHADING\n");
+    // the low resolution specular integration is another permutation of the shading pass
+    Shader specular_shader = Shader("fullscreen_triangle.vert", "env_bump_aniso.frag", "#define DEFERRED_SHADING\n#define SPECULAR_PASS\n");
+    GBuffer gbuffer(width, height, NUM_TEXTURE_UNITS + TemporalAccumulation::TEXTURE_UNITS);
+    // the half vectors of the Table_Samples provider
+    SampleTable sampleTable(SAMPLE_TABLE_BINDING);
     // we parse the Shader Program to search for the number and names of the subroutines. 
     // the names are placed in the shaders vector
     SetupShader(illumination_shader.Program);
+    if (!SelectSubroutines(subroutineSelections))
+        return -1;
+    // the sweep renders the same number of frames for each combination
+    if (sweepFrames > 0)
+        headlessFrames = NumCombinations() * (SWEEP_WARMUP_FRAMES + sweepFrames);
+    SetupTextureUnits(illumination_shader.Program);
+    SetupTextureUnits(skybox_shader.Program);
+    SetupTextureUnits(deferred_shader.Program);
+    gbuffer.SetupTextureUnits(deferred_shader.Program);
+    SetupTextureUnits(specular_shader.Program);
+    gbuffer.SetupTextureUnits(specular_shader.Program);
+    // after a reload, the new programs need the same setup
+    bool workerContext = CreateWorkerContext(window);
+    ShaderReloader shaderReloader(workerContext ? BindWorkerContext : std::function<void()>(), workerContext ? ReleaseWorkerContext : std::function<void()>());
+    shaderReloader.Enabled = shaderHotReload;
+    shaderReloader.Watch(illumination_shader, [](Shader& shader)
+    {
+        SetupTextureUnits(shader.Program);
+        ReloadSubroutines(shader.Program);
+    });
+    shaderReloader.Watch(skybox_shader, [](Shader& shader) { SetupTextureUnits(shader.Program); });
+    for (Shader* pass : {&deferred_shader, &specular_shader})
+    {
+        shaderReloader.Watch(*pass, [&gbuffer](Shader& shader)
+        {
+            SetupTextureUnits(shader.Program);
+            gbuffer.SetupTextureUnits(shader.Program);
+        });
+    }
     // we print on console the name of the first subroutine used
     // we load the model(s) (code of Model class is in include/utils/model_v2.h)
     Model cubeModel("../../models/cube.obj");
     Model sphereModel("../../models/sphere.obj");
 
+    // the instances of the models: the scene is built again when the stress test changes
+    Scene scene;
+    scene.Culling = frustumCulling;
+    BuildScene(scene, sphereModel, cubeModel);
+    GLboolean builtStressTest = stressTest;
+    GLint builtGridSize = stressGridSize;
+
     // we load the images and store them in a vector
-    stbi_set_flip_vertically_on_load(true);    
-    textureID.push_back(LoadTexture(brdfLUTPath.c_str(), false));
-    textureID.push_back(LoadTexture(hvLUTPath.c_str(), false));
-    stbi_set_flip_vertically_on_load(false);
-    textureID.push_back(LoadTexture((materialPath + "albedo.jpg").c_str(), true));
-    textureID.push_back(LoadTexture((materialPath + "normal.jpg").c_str(), true));
-    textureID.push_back(LoadTexture((materialPath + "depth.png").c_str(), true));
-    textureID.push_back(LoadTexture((materialPath + "ao.jpg").c_str(), true));
-    textureID.push_back(LoadTexture((materialPath + "metallic.jpg").c_str(), true));
-    textureID.push_back(LoadTexture((materialPath + "quaternion.png").c_str(), true));
-    textureID.push_back(LoadTexture((materialPath + "rotation.png").c_str(), true));    
-    textureID.push_back(LoadCubeMap(environmentPath.c_str(), "hdr"));
-    textureID.push_back(LoadCubeMap(irradiancePath.c_str(), "hdr"));
+    TextureLoader textureLoader;
+    if (asyncTextureLoading)
+    {
+        // the vector must not be resized while the loader writes in it
+        textureID = vector<GLuint>(NUM_TEXTURE_UNITS);
+        // until it is ready, each texture is replaced by a 1x1 placeholder with a neutral value for its content
+        textureLoader.LoadArray(&textureID[BRDF_LUT_UNIT], LUTPaths("brdfIntegration"), false, true,
+                                vector<glm::u8vec4>(shininessPairs.size(), glm::u8vec4(128, 128, 128, 255)));
+        textureLoader.LoadArray(&textureID[HALF_VECTOR_UNIT], LUTPaths("halfVectorSampling"), false, true,
+                                vector<glm::u8vec4>(shininessPairs.size(), glm::u8vec4(128, 128, 255, 255))); // H = N
+        vector<glm::u8vec4> placeholders;
+        for (GLuint i = 0; i < materialFolders.size(); i++)
+            placeholders.insert(placeholders.end(), materialPlaceholders.begin(), materialPlaceholders.end());
+        textureLoader.LoadArray(&textureID[MATERIAL_UNIT], MaterialMapPaths(), true, false, placeholders);
+    }
+    else
+    {
+        stbi_set_flip_vertically_on_load(true);    
+        textureID.push_back(LoadTextureArray(LUTPaths("brdfIntegration"), false));
+        textureID.push_back(LoadTextureArray(LUTPaths("halfVectorSampling"), false));
+        stbi_set_flip_vertically_on_load(false);
+        textureID.push_back(LoadTextureArray(MaterialMapPaths(), true));
+        // the cube maps are given by the environment library
+        textureID.resize(NUM_TEXTURE_UNITS);
+    }
+    // the baker samples the equirectangular image with the unit after the ones of the G-buffer
+    EnvironmentBaker environmentBaker(textureLoader, NUM_TEXTURE_UNITS + TemporalAccumulation::TEXTURE_UNITS + GBuffer::TEXTURE_UNITS, 512, 32, bakeBudget);
+    EnvironmentLibrary environmentLibrary(textureLoader, environmentBaker, cubeMapFormat, (size_t) environmentBudgetMB << 20);
+    environmentLibrary.Scan(texturesFolder);
+    environmentLibrary.Scan(texturesFolder + "cube/");
+    if (bakeAtStart)
+    {
+        if (!EnvironmentBaker::Supported())
+        {
+            std::cout << "The environment baker requires OpenGL 4.3" << std::endl;
+            return -1;
+        }
+        environmentLibrary.Select(environmentLibrary.AddEquirectangular(equirectPath));
+    }
+    else
+    {
+        int environment = environmentLibrary.Find(environmentName);
+        if (environment < 0)
+        {
+            std::cout << "Unknown environment: " << environmentName << std::endl;
+            return -1;
+        }
+        environmentLibrary.Select(environment);
+    }
+    // the benchmarks must not measure the placeholders
+    if (headless)
+        textureLoader.Finish();
+    // without asynchronous loading, the environment is ready before the first frame too (but the bake with --equirect is still sliced)
+    if ((headless || !asyncTextureLoading) && !bakeAtStart)
+        environmentLibrary.Finish();
+
+    // the first packet is produced before the first frame, then the GUI can move the steps on the simulation thread
+    SimulationThread<SimulationInput, FramePacket> simulation(SimulateStep, SIMULATION_TIME_STEP);
+    simulation.Step(0.0f);
+    simulation.Acquire();
+    frame = simulation.Frame();
 
     // Projection matrix: FOV angle, aspect ratio, near and far planes
     glm::mat4 projection = glm::perspective(45.0f, (float)width/(float)height, 0.1f, 10000.0f);
 
     // View matrix: the camera moves, so we just set to indentity now
     glm::mat4 view = glm::mat4(1.0f);
+    // the matrices of the previous frame, for the motion vectors
+    glm::mat4 previousView = frame.View, previousProjection = projection;
 
-    // Model and Normal transformation matrices for the objects in the scene: we set to identity
-    glm::mat4 sphereModelMatrix = glm::mat4(1.0f);
-    glm::mat3 sphereNormalMatrix = glm::mat3(1.0f);
-    glm::mat4 cubeModelMatrix = glm::mat4(1.0f);
-    glm::mat3 cubeNormalMatrix = glm::mat3(1.0f);
+    setupTime = GetTime();
+    // the time to the first frame is printed after the first swap, to compare cold (empty shader cache) and warm starts
+    GLboolean firstFrame = GL_TRUE;
 
-    setupTime = glfwGetTime();
+    // the GPU timers of the passes
+    GPUTimer prepassTimer("prepass"), objectsTimer("objects"), specularTimer("specular"), shadingTimer("shading"), skyboxTimer("skybox"), resolveTimer("resolve"), guiTimer("gui");
+    passTimers = {&prepassTimer, &objectsTimer, &specularTimer, &shadingTimer, &skyboxTimer, &resolveTimer, &guiTimer};
+
+    // headless mode: CPU time of each frame, while the pass timers record the GPU time of every frame
+    vector<GLfloat> headlessCPUTimes, headlessFrameTimes;
+    if (headless)
+    {
+        // from the first frame of the loop
+        for (GPUTimer* timer : passTimers)
+            timer->StartRecording(0);
+    }
 
     // Rendering loop: this code is executed at each frame
-    while(!glfwWindowShouldClose(window))
+    while(headless ? headlessCPUTimes.size() < headlessFrames : !glfwWindowShouldClose(window))
     {
 
         // SCENE RENDERING
 
-        glfwMakeContextCurrent(window);
+        frameProfiler.BeginFrame();
+        if (!headless)
+            glfwMakeContextCurrent(window);
+        // the sweep moves to the next combination of subroutines
+        if (sweepFrames > 0 && headlessCPUTimes.size() % (SWEEP_WARMUP_FRAMES + sweepFrames) == 0)
+            SelectCombination(headlessCPUTimes.size() / (SWEEP_WARMUP_FRAMES + sweepFrames));
 
         // we determine the time passed from the beginning
         // and we calculate time difference between current frame rendering and the previous one
-        GLfloat currentFrame = glfwGetTime();
-        deltaTime = currentFrame - lastFrame;
+        GLfloat currentFrame = GetTime();
+        deltaTime = headless ? HEADLESS_TIME_STEP : currentFrame - lastFrame;
         lastFrame = currentFrame;
 
+        // we stream to the GPU part of the textures decoded in background
+        textureLoader.Update();
+        // we dispatch a slice of the environment bake, and the environment selected last replaces the current one when both of its
+        // cube maps are ready
+        if (environmentLibrary.Update() || textureID[ENVIRONMENT_UNIT] != environmentLibrary.EnvironmentMap())
+        {
+            textureID[ENVIRONMENT_UNIT] = environmentLibrary.EnvironmentMap();
+            textureID[IRRADIANCE_UNIT] = environmentLibrary.IrradianceMap();
+            hdrEnvironment = environmentLibrary.HDR();
+            rebindTextures = GL_TRUE;
+        }
+        // we swap the Shader Programs rebuilt in background, and we start the rebuild of the modified ones
+        shaderReloader.Update();
+        frameProfiler.Mark(SCOPE_UPDATE);
+
         // Check fs an I/O event is happening
-        glfwPollEvents();
-        // we apply FPS camera movements if mouse cursor is disabled
-        if (!optionsOverlayActive)
-            apply_camera_movements();
+        if (!headless)
+            glfwPollEvents();
+        // we publish the state of the input for the next step of the simulation
+        SimulationInput input;
+        const int movementKeys[6] = {GLFW_KEY_W, GLFW_KEY_S, GLFW_KEY_A, GLFW_KEY_D, GLFW_KEY_SPACE, GLFW_KEY_LEFT_SHIFT};
+        for (GLuint i = 0; i < 6; i++)
+            input.Movements[i] = keys[movementKeys[i]];
+        input.MouseOffset = mouseOffset;
+        input.CameraActive = !optionsOverlayActive;
+        input.Spinning = spinning;
+        simulation.SetInput(input);
+        // in headless mode the frames must be reproducible: the main thread runs a step of the fixed time of the frame
+        if (simulationThread && !headless)
+            simulation.Start();
+        else
+        {
+            simulation.Stop();
+            simulation.Step(deltaTime);
+        }
+        // we render the most recent packet (the same of the previous frame, if no step has been completed in the meantime)
+        simulation.Acquire();
+        frame = simulation.Frame();
         // View matrix (=camera): position, view direction, camera "up" vector
-        view = camera.GetViewMatrix();
+        view = frame.View;
+        frameProfiler.Mark(SCOPE_POLL);
 
         // we "clear" the frame and z buffer
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        // with temporal accumulation, the scene is rendered in the framebuffer of the accumulation, and then resolved in the output framebuffer
+        // (offscreenFBO in headless mode, otherwise the default framebuffer)
+        if (temporalAccumulation && !accumulating)
+            temporal.Reset();
+        accumulating = temporalAccumulation;
+        if (temporalAccumulation)
+            temporal.BeginScene(clear_color);
+        else
+        {
+            glBindFramebuffer(GL_FRAMEBUFFER, offscreenFBO);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        }
+        // with deferred shading, the objects are rendered in the G-buffer, and then shaded in the framebuffer of the frame
+        GLuint sceneFBO = temporalAccumulation ? temporal.SceneFramebuffer() : offscreenFBO;
+        if (deferredShading)
+            gbuffer.Begin();
 
         // we set the rendering mode
         if (wireframe)
@@ -329,112 +890,27 @@ int main()
         else
             glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 
-        // if animated rotation is activated, than we increment the rotation angle using delta time and the rotation speed parameter
-        if (spinning)
-            orientationY+=(deltaTime*spin_speed);
-
-        // activate the illumination shader
-        illumination_shader.Use();
-
-        // we determine the position in the Shader Program of the uniform variables
-        GLint brdfLUTLocation = glGetUniformLocation(illumination_shader.Program, "brdfLUT");
-        GLint hvLUTLocation = glGetUniformLocation(illumination_shader.Program, "halfVector");
-        GLint albedoLocation = glGetUniformLocation(illumination_shader.Program, "albedo");
-        GLint normalLocation = glGetUniformLocation(illumination_shader.Program, "normMap");
-        GLint quaternionLocation = glGetUniformLocation(illumination_shader.Program, "quaternionMap");
-        GLint rotationLocation = glGetUniformLocation(illumination_shader.Program, "rotationMap");
-        GLint depthLocation = glGetUniformLocation(illumination_shader.Program, "depthMap");
-        GLint aoLocation = glGetUniformLocation(illumination_shader.Program, "aoMap");
-        GLint metallicLocation = glGetUniformLocation(illumination_shader.Program, "metallicMap");
-
-        // cube maps
-        GLint environmentLocation = glGetUniformLocation(illumination_shader.Program, "environmentMap");
-        GLint irradianceLocation = glGetUniformLocation(illumination_shader.Program, "irradianceMap");
-
-        GLint sampleCountLocation = glGetUniformLocation(illumination_shader.Program, "sampleCount");
-        GLint repeatLocation = glGetUniformLocation(illumination_shader.Program, "repeat");
-        GLint f0Location = glGetUniformLocation(illumination_shader.Program, "F0");
-        GLint heightScaleLocation = glGetUniformLocation(illumination_shader.Program, "heightScale");
-        
-        // we assign the value to the uniform variables
-        glUniform1ui(sampleCountLocation, sampleCount);
-        glUniform2fv(repeatLocation, 1, glm::value_ptr(repeat));
-        glUniform3fv(f0Location, 1, glm::value_ptr(F0));
-        glUniform1f(heightScaleLocation, heightScale);
-
-        // we pass projection and view matrices to the Shader Program
-        glUniformMatrix4fv(glGetUniformLocation(illumination_shader.Program, "projectionMatrix"), 1, GL_FALSE, glm::value_ptr(projection));
-        glUniformMatrix4fv(glGetUniformLocation(illumination_shader.Program, "viewMatrix"), 1, GL_FALSE, glm::value_ptr(view));
-        glUniform4fv(glGetUniformLocation(illumination_shader.Program, "wCamera"), 1, glm::value_ptr(glm::vec4(camera.Position, 1.0)));
-
-        /////////////////// OBJECTS ////////////////////////////////////////////////
-        // we search inside the Shader Program the name of the subroutine currently selected, and we get the numerical index
-
-        GLuint indices[MY_MAX_SUB_UNIF];
-        for (int i = 0; i < countActiveSU; i++) {
-            indices[i] = glGetSubroutineIndex(illumination_shader.Program, GL_FRAGMENT_SHADER, subroutines_names[current_subroutines[i]].c_str());
+        // Textures
+        // the LUTs, the maps of all of the materials (a single texture array) and the cube maps keep their units for the whole frame:
+        // we bind them again only if the loader may have changed them
+        if (rebindTextures || textureLoader.Pending() > 0)
+        {
+            for (GLuint i = 0; i < NUM_TEXTURE_UNITS; i++)
+            {
+                glActiveTexture(GL_TEXTURE0 + i);
+                glBindTexture(textureUnitTargets[i], textureID[i]);
+            }
+            rebindTextures = textureLoader.Pending() > 0;
         }
-        
-        // we activate the desired subroutines using the indices (this is where shaders swapping happens)
-        glUniformSubroutinesuiv( GL_FRAGMENT_SHADER, countActiveSU, &indices[0]);
-
-        // Textures and Normal Maps
-        // integrated brdf
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, textureID[0]);
-        glUniform1i(brdfLUTLocation, 0);
-
-        // mapped half vectors
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, textureID[1]);
-        glUniform1i(hvLUTLocation, 1);
-
-        // albedo
-        glActiveTexture(GL_TEXTURE2);
-        glBindTexture(GL_TEXTURE_2D, textureID[2]);
-        glUniform1i(albedoLocation, 2);
-
-        // normal map
-        glActiveTexture(GL_TEXTURE3);
-        glBindTexture(GL_TEXTURE_2D, textureID[3]);
-        glUniform1i(normalLocation, 3);
-
-        // quaternion map
-        glActiveTexture(GL_TEXTURE4);
-        glBindTexture(GL_TEXTURE_2D, textureID[4]);
-        glUniform1i(depthLocation, 4);
-
-        // tangent plane rotation map
-        glActiveTexture(GL_TEXTURE5);
-        glBindTexture(GL_TEXTURE_2D, textureID[5]);
-        glUniform1i(aoLocation, 5);
-
-        // depth (1 - height) map
-        glActiveTexture(GL_TEXTURE6);
-        glBindTexture(GL_TEXTURE_2D, textureID[6]);
-        glUniform1i(metallicLocation, 6);
-
-        // ambient occlusion map
-        glActiveTexture(GL_TEXTURE7);
-        glBindTexture(GL_TEXTURE_2D, textureID[7]);
-        glUniform1i(quaternionLocation, 7);
-
-        // metalness map
-        glActiveTexture(GL_TEXTURE8);
-        glBindTexture(GL_TEXTURE_2D, textureID[8]);
-        glUniform1i(rotationLocation, 8);
-
-        // environment cube map
-        glActiveTexture(GL_TEXTURE9);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, textureID[9]);
-        glUniform1i(environmentLocation, 9);
-
-        // irradiance cube map
-        glActiveTexture(GL_TEXTURE10);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, textureID[10]);
-        glUniform1i(irradianceLocation, 10);
-
-        // SPHERE
+        // SCENE
+        if (builtStressTest != stressTest || builtGridSize != stressGridSize)
+        {
+            BuildScene(scene, sphereModel, cubeModel);
+            builtStressTest = stressTest;
+            builtGridSize = stressGridSize;
+        }
+
+        // CENTRAL SPHERE
         /*
           we create the transformation matrix
 
@@ -444,126 +920,242 @@ int main()
           An explanation (where XT means the transpose of X, etc):
             "Two column vectors X and Y are perpendicular if and only if XT.Y=0. If We're going to transform X by a matrix M, we need to transform Y by some matrix N so that (M.X)T.(N.Y)=0. Using the identity (A.B)T=BT.AT, this becomes (XT.MT).(N.Y)=0 => XT.(MT.N).Y=0. If MT.N is the identity matrix then this reduces to XT.Y=0. And MT.N is the identity matrix if and only if N=(MT)-1, i.e. N is the inverse of the transpose of M.
 
+          The vertex shader computes the normal matrix of the instances (it is not one of their attributes, see InstanceData)
         */
-       // we reset to identity at each frame
-        sphereModelMatrix = glm::mat4(1.0f);
-        sphereNormalMatrix = glm::mat3(1.0f);
-        sphereModelMatrix = glm::rotate(sphereModelMatrix, glm::radians(orientationY), glm::vec3(0.0f, 1.0f, 0.0f));
-        sphereModelMatrix = glm::scale(sphereModelMatrix, glm::vec3(0.8f, 0.8f, 0.8f));
-        // if we cast a mat4 to a mat3, we are automatically considering the upper left 3x3 submatrix
-        sphereNormalMatrix = glm::inverseTranspose(glm::mat3(sphereModelMatrix));
-        glUniformMatrix4fv(glGetUniformLocation(illumination_shader.Program, "modelMatrix"), 1, GL_FALSE, glm::value_ptr(sphereModelMatrix));
-        glUniformMatrix3fv(glGetUniformLocation(illumination_shader.Program, "normalMatrix"), 1, GL_FALSE, glm::value_ptr(sphereNormalMatrix));
-
-        glUniform2fv(repeatLocation, 1, glm::value_ptr(glm::vec2(2.0f, 1.0f)*repeat));
-        // we render the sphere
-        sphereModel.Draw();
-        glUniform2fv(repeatLocation, 1, glm::value_ptr(repeat));
-
-        // SKYBOX
-
-        skybox_shader.Use();
-        glUniformMatrix4fv(glGetUniformLocation(skybox_shader.Program, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
-        glUniformMatrix4fv(glGetUniformLocation(skybox_shader.Program, "view"), 1, GL_FALSE, glm::value_ptr(view));
-        environmentLocation = glGetUniformLocation(skybox_shader.Program, "environmentMap");
-
-        // environment cube map
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, textureID[9]);
-        glUniform1i(environmentLocation, 0);
-        glDepthFunc(GL_LEQUAL);
-        cubeModel.Draw();
-        glDepthFunc(GL_LESS);
+        // the transformations of this frame become the previous ones. The transformation of the sphere is computed by the simulation (see SimulateStep)
+        scene.NextFrame();
+        scene.SetTransform(CENTRAL_SPHERE, frame.SphereModelMatrix);
+        // the central sphere uses the parameters of the GUI. Binding a material (or a shininess) is just the choice of its layers in the arrays
+        InstanceData& sphere = scene.Data(CENTRAL_SPHERE);
+        sphere.F0 = F0;
+        // the UVs of the sphere are stretched along the equator
+        sphere.Repeat = glm::vec2(2.0f, 1.0f) * repeat;
+        sphere.Material = glm::ivec2(currentMaterial, currentShininess);
+
+        // the table of the half vectors follows the sample count (it is used only without temporal accumulation)
+        tableSampleCount = sampleTable.Update(shininessPairs, sampleCount);
+
+        // we collect the instances inside the view frustum
+        const vector<Scene::Batch>& batches = scene.Cull(Frustum(projection, view));
+        if (instancedRendering)
+            scene.UploadVisible();
+
+        /////////////////// DEPTH PRE-PASS ////////////////////////////////////////////////
+        // the objects are rendered only in the depth buffer, with a permutation of the illumination shader (see DEPTH_PREPASS in env_bump_aniso.frag).
+        // Then the shading pass runs only on the fragments with the same depth (with parallaxDepth, both passes write the displaced depth)
+        GLboolean compiledPrepass = GL_FALSE;
+        GLboolean displacedDepth = depthPrepass && parallaxDepth;
+        GLuint depthPasses = displacedDepth ? PASS_PARALLAX_DEPTH : PASS_FORWARD;
+        if (depthPrepass)
+        {
+            Shader& depth_shader = CurrentPermutation(PASS_DEPTH_PREPASS | depthPasses, compiledPrepass, shaderReloader);
+            prepassTimer.Begin(frameProfiler.CurrentFrame());
+            depth_shader.Use();
+            SetViewUniforms(depth_shader.Program, projection, view, previousProjection, previousView);
+            glUniform1f(glGetUniformLocation(depth_shader.Program, "heightScale"), heightScale);
+            glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+            DrawObjects(depth_shader.Program, batches);
+            glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+            glDepthFunc(GL_EQUAL);
+            glDepthMask(GL_FALSE);
+            prepassTimer.End();
+        }
 
+        // we select the Shader Program for the objects: a compile-time specialization for the current subroutines, or the generic one.
+        // The geometry pass of the deferred shading, and the shading pass which writes the displaced depth, are always compile-time specializations
+        GLboolean compiledPermutation = GL_FALSE;
+        GLboolean dynamicDispatch = !staticPermutations && !deferredShading && !displacedDepth;
+        Shader& object_shader = deferredShading ? CurrentPermutation(PASS_GBUFFER | depthPasses, compiledPermutation, shaderReloader)
+                              : !dynamicDispatch ? CurrentPermutation(depthPasses, compiledPermutation, shaderReloader) : illumination_shader;
 
-        // GUI RENDERING
+        // activate the illumination shader
+        object_shader.Use();
 
-        // Start the Dear ImGui frame
-        ImGui_ImplOpenGL3_NewFrame();
-        ImGui_ImplGlfw_NewFrame();
-        ImGui::NewFrame();
+        // we assign the value to the uniform variables
+        // (the samplers have been assigned to their texture units when the Shader Program was created)
+        SetLightingUniforms(object_shader.Program, temporal.FrameIndex);
+        glUniform1f(glGetUniformLocation(object_shader.Program, "heightScale"), heightScale);
+        // we pass projection and view matrices to the Shader Program
+        SetViewUniforms(object_shader.Program, projection, view, previousProjection, previousView);
 
-        if (optionsOverlayActive)
+        /////////////////// OBJECTS ////////////////////////////////////////////////
+        objectsTimer.Begin(frameProfiler.CurrentFrame());
+        // with the fallback path, we activate the selected subroutines
+        // current_subroutines already stores the index of the selected subroutine for each uniform location (see SetupShader), so no lookup by name is needed
+        if (dynamicDispatch)
         {
-            
+            GLuint indices[MY_MAX_SUB_UNIF];
+            for (int i = 0; i < countActiveSU; i++) {
+                indices[i] = current_subroutines[i];
+            }
 
-            ImGui::Begin("Shader Selection");
+            // we activate the desired subroutines using the indices (this is where shaders swapping happens)
+            glUniformSubroutinesuiv( GL_FRAGMENT_SHADER, countActiveSU, &indices[0]);
+        }
 
-                ImGui::Text("Shaders");
-                ImGui::Indent();
-                for (GLuint i = 0; i < countActiveSU; i++) 
-                {
-                    ImGui::BulletText(sub_uniforms_names[i].c_str());
+        DrawObjects(object_shader.Program, batches);
+        if (depthPrepass)
+        {
+            glDepthFunc(GL_LESS);
+            glDepthMask(GL_TRUE);
+        }
+        objectsTimer.End();
+
+        // we measure the average GPU time of the objects pass with each dispatch method (only in the forward path without pre-pass).
+        // The timer gives the measurement of NUM_QUERIES frames ago: after a change of the Shader Program or of the subroutines,
+        // we wait until the measured frames use the current ones (this skips also the frames which compile a permutation)
+        if (deferredShading || depthPrepass)
+            measuredShader = nullptr;
+        else if (&object_shader != measuredShader || current_subroutines != measuredSubroutines)
+        {
+            measuredShader = &object_shader;
+            measuredSubroutines = current_subroutines;
+            measuredFrames = 0;
+        }
+        else if (++measuredFrames > GPUTimer::NUM_QUERIES)
+            dispatchGPUTime[staticPermutations] = 0.95f * dispatchGPUTime[staticPermutations] + 0.05f * objectsTimer.Last;
 
-                    ImGui::Indent();
-                    for (GLuint j = 0; j < num_compatible_subroutines[i]; j++) {
-                        ImGui::RadioButton(subroutines_names[compatible_subroutines[i][j]].c_str(), &current_subroutines[i], compatible_subroutines[i][j]);
-                    }
-                    ImGui::Unindent();
-                }
-                ImGui::Unindent();
+        // DEFERRED SHADING
+        if (deferredShading)
+        {
+            glm::mat4 inverseViewProjection = glm::inverse(projection * view);
+            // the specular term at low resolution, read by the shading pass
+            if (specularDownsample > 1)
+            {
+                specularTimer.Begin(frameProfiler.CurrentFrame());
+                specular_shader.Use();
+                SetLightingUniforms(specular_shader.Program, temporal.FrameIndex);
+                glUniformMatrix4fv(glGetUniformLocation(specular_shader.Program, "inverseViewProjection"), 1, GL_FALSE, glm::value_ptr(inverseViewProjection));
+                glUniform4fv(glGetUniformLocation(specular_shader.Program, "wCamera"), 1, glm::value_ptr(glm::vec4(frame.CameraPosition, 1.0)));
+                glUniform1i(glGetUniformLocation(specular_shader.Program, "specularDownsample"), specularDownsample);
+                gbuffer.ShadeSpecular(specularDownsample);
+                specularTimer.End();
+            }
 
-            ImGui::End();
+            shadingTimer.Begin(frameProfiler.CurrentFrame());
+            deferred_shader.Use();
+            SetLightingUniforms(deferred_shader.Program, temporal.FrameIndex);
+            glUniformMatrix4fv(glGetUniformLocation(deferred_shader.Program, "inverseViewProjection"), 1, GL_FALSE, glm::value_ptr(inverseViewProjection));
+            glUniform4fv(glGetUniformLocation(deferred_shader.Program, "wCamera"), 1, glm::value_ptr(glm::vec4(frame.CameraPosition, 1.0)));
+            glUniform1i(glGetUniformLocation(deferred_shader.Program, "specularDownsample"), specularDownsample);
+            gbuffer.Shade(sceneFBO);
+            shadingTimer.End();
+        }
 
-            ImGui::Begin("Parameters");
+        // SKYBOX
+        // a full-screen triangle on the far plane (see skybox.vert): the pixels covered by the objects are discarded by the early depth test
 
-            ImGui::Text("Shader Parameters");
+        skyboxTimer.Begin(frameProfiler.CurrentFrame());
+        skybox_shader.Use();
+        glUniformMatrix4fv(glGetUniformLocation(skybox_shader.Program, "inverseViewProjection"), 1, GL_FALSE, glm::value_ptr(glm::inverse(projection * glm::mat4(glm::mat3(view)))));
+        glUniformMatrix4fv(glGetUniformLocation(skybox_shader.Program, "previousProjection"), 1, GL_FALSE, glm::value_ptr(previousProjection));
+        glUniformMatrix4fv(glGetUniformLocation(skybox_shader.Program, "previousView"), 1, GL_FALSE, glm::value_ptr(previousView));
+        glUniform1i(glGetUniformLocation(skybox_shader.Program, "hdrEnvironment"), hdrEnvironment);
 
-            ImGui::SliderFloat3("Normal incidence Fresnel reflectance", glm::value_ptr(F0), 0.0001f, 1.0f, "F0 = %.4f", ImGuiSliderFlags_AlwaysClamp);
+        // the environment cube map is already bound to its unit. The triangle is filled also in wireframe mode
+        glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+        glDepthFunc(GL_LEQUAL);
+        glBindVertexArray(skyboxVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(0);
+        glDepthFunc(GL_LESS);
+        skyboxTimer.End();
 
-            ImGui::Separator();
+        // TEMPORAL ACCUMULATION
+        if (temporalAccumulation)
+        {
+            resolveTimer.Begin(frameProfiler.CurrentFrame());
+            temporal.Resolve(offscreenFBO, historyLength, hdrEnvironment);
+            resolveTimer.End();
+        }
+        previousView = view;
+        previousProjection = projection;
+        frameProfiler.Mark(SCOPE_DRAW);
 
-            if (currentCompSubIs("Displacement", "ParallaxMapping"))
-            {
-                ImGui::SliderFloat("Height Scale", &heightScale, 0.0001, 0.1, "hS = %.4f", ImGuiSliderFlags_AlwaysClamp);
-                ImGui::Separator();
-            }
 
-            if (currentCompSubIs("Specular", "Specular_Irradiance"))
-            {
-                ImGui::SliderInt("Sample Count", &sampleCount, 1, 200, "sample count = %.4d", ImGuiSliderFlags_AlwaysClamp);
-                ImGui::Separator();
-            }
+        // GUI RENDERING
+        if (!headless)
+        {
+            guiTimer.Begin(frameProfiler.CurrentFrame());
+            RenderGUI(textureLoader, environmentBaker, environmentLibrary, shaderReloader, simulation, scene);
+            guiTimer.End();
+            UpdateCapture();
+        }
+        frameProfiler.Mark(SCOPE_GUI);
 
-            if (ImGui::TreeNode("Metrics"))
+        if (headless)
+        {
+            headlessCPUTimes.push_back(GetTime() - currentFrame);
+            // without a swap, nothing limits the number of queued frames: we wait for the frame, which gives also its complete time
+            // (software renderers like llvmpipe rasterize when the commands are flushed, so their timer queries do not measure the whole work)
+            glFinish();
+            headlessFrameTimes.push_back(GetTime() - currentFrame);
+            if (!dumpFolder.empty())
             {
-                ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
-                ImGui::Text("Application delta_time %.3f ms/frame (%.1f FPS)", deltaTime * 1000, deltaTime == 0 ? 0 : 1/deltaTime);
-                ImGui::TreePop();
+                // the rows of OpenGL images start from the bottom
+                vector<unsigned char> pixels(width * height * 4);
+                glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+                char name[32];
+                snprintf(name, sizeof(name), "frame_%05d.png", (int) headlessCPUTimes.size() - 1);
+                stbi_flip_vertically_on_write(true);
+                stbi_write_png((dumpFolder + "/" + name).c_str(), width, height, STBI_rgb_alpha, pixels.data(), width * STBI_rgb_alpha);
             }
-            
-
-            ImGui::End();
         }
-        else // optionsOverlayActive == false
+        else
+            // Swapping back and front buffers
+            glfwSwapBuffers(window);
+        frameProfiler.Mark(SCOPE_SWAP);
+        frameProfiler.EndFrame();
+        // the statistics are used by this same thread: we collect the record of the frame immediately
+        frameProfiler.Collect();
+
+        if (firstFrame)
         {
-            ImGui::Begin("Tips");
-
-            ImGui::Text("Controls:");
-            ImGui::Text("W, A, S, D to move");
-            ImGui::Text("LShift to descend, Space to ascend");
-            ImGui::Text("P to toggle animations");
-            ImGui::Text("L to toggle wireframe rendering");
-            ImGui::Text("E for options");
-            ImGui::Text("Esc to close appliation");
-
-            ImGui::End();
+            glFinish();
+            std::cout << "Setup time: " << setupTime << " s - time to first frame: " << GetTime() << " s"
+                      << " (shader cache: " << Shader::CacheHits << " hits, " << Shader::CacheMisses << " misses)" << std::endl;
+            firstFrame = GL_FALSE;
         }
+    }
 
-        ImGui::Render();
-        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
-
-        // Swapping back and front buffers
-        glfwSwapBuffers(window);
+    if (headless)
+    {
+        if (sweepFrames > 0)
+            ReportSweep(headlessFrameTimes);
+        else
+            ReportHeadlessTimings(headlessCPUTimes, headlessFrameTimes);
+        glDeleteRenderbuffers(2, offscreenBuffers);
+        glDeleteFramebuffers(1, &offscreenFBO);
     }
 
    // when I exit from the graphics loop, it is because the application is closing
+    // the reloader releases the shared context before it is destroyed
+    shaderReloader.Stop();
+    simulation.Stop();
+    DestroyWorkerContext();
     // we delete the Shader Program
     illumination_shader.Delete();
+    skybox_shader.Delete();
+    glDeleteVertexArrays(1, &skyboxVAO);
+    deferred_shader.Delete();
+    specular_shader.Delete();
+    for (auto& permutation : shader_permutations)
+        permutation.second.Delete();
+    // the timers are destroyed with this function
+    passTimers.clear();
+    return 0;
+}
 
+//////////////////////////////////////////
+// The function releases the GUI and the OpenGL context
+void DestroyContext(GLFWwindow* window)
+{
     // Cleanup
-    ImGui_ImplOpenGL3_Shutdown();
-    ImGui_ImplGlfw_Shutdown();
+    if (!headless)
+    {
+        ImGui_ImplOpenGL3_Shutdown();
+        ImGui_ImplGlfw_Shutdown();
+    }
     ImGui::DestroyContext();
 
     // deallocate memory used by dynamic arrays
@@ -572,11 +1164,13 @@ int main()
         delete[] compatible_subroutines[i];
     }
 
-    glfwDestroyWindow(window);
+    if (headless)
+        DestroyHeadlessContext();
+    else
+        glfwDestroyWindow(window);
 
     // we close and delete the created context
     glfwTerminate();
-    return 0;
 }
 
 
@@ -606,6 +1200,7 @@ void SetupShader(int program)
     num_compatible_subroutines = vector<int>(countActiveSU);
     compatible_subroutines = vector<int*>(countActiveSU);
     current_subroutines = vector<GLuint>(countActiveSU);
+    fixed_subroutines = vector<GLboolean>(countActiveSU, GL_FALSE);
     subroutines_names = vector<std::string>(activeSub);
 
     // print info for every Subroutine uniform
@@ -649,6 +1244,84 @@ void SetupShader(int program)
     }
 }
 
+//////////////////////////////////////////
+// The function maps every subroutine uniform to the name of the subroutine currently selected for it.
+// The resulting block is injected in the illumination shader, where it replaces the subroutine uniforms (see STATIC_DISPATCH in env_bump_aniso.frag)
+std::string PermutationDefines()
+{
+    std::string defines = "#define STATIC_DISPATCH\n";
+    for (int i = 0; i < countActiveSU; i++)
+    {
+        defines += "#define " + sub_uniforms_names[i] + " " + subroutines_names[current_subroutines[i]] + "\n";
+    }
+    return defines;
+}
+
+//////////////////////////////////////////
+// Permutations are compiled lazily: the first time a combination is selected, and then kept in the cache until the application closes
+Shader& GetPermutation(const std::string& defines, GLboolean& compiled, ShaderReloader& shaderReloader)
+{
+    auto permutation = shader_permutations.find(defines);
+    compiled = permutation == shader_permutations.end();
+    if (compiled)
+    {
+        permutation = shader_permutations.emplace(defines, Shader("env_bump_aniso.vert", "env_bump_aniso.frag", defines)).first;
+        SetupTextureUnits(permutation->second.Program);
+        // the nodes of the map are never moved
+        shaderReloader.Watch(permutation->second, [](Shader& shader) { SetupTextureUnits(shader.Program); });
+    }
+    return permutation->second;
+}
+
+//////////////////////////////////////////
+// The cached permutation is valid while the selection of the subroutines is the same: each frame costs only the comparison of the indices
+Shader& CurrentPermutation(GLuint passes, GLboolean& compiled, ShaderReloader& shaderReloader)
+{
+    compiled = GL_FALSE;
+    if (cachedPermutations[passes] == nullptr || cachedSelections[passes] != current_subroutines)
+    {
+        // the defines of the passes follow the ones of the subroutines (the same blocks are the keys of the binary cache on disk)
+        std::string defines = PermutationDefines();
+        if (passes & PASS_GBUFFER)
+            defines += "#define GBUFFER_PASS\n";
+        if (passes & PASS_DEPTH_PREPASS)
+            defines += "#define DEPTH_PREPASS\n";
+        if (passes & PASS_PARALLAX_DEPTH)
+            defines += "#define PARALLAX_DEPTH\n";
+        // the nodes of the map are never moved: the pointer stays valid (also after a reload, which replaces the program in the same Shader)
+        cachedPermutations[passes] = &GetPermutation(defines, compiled, shaderReloader);
+        cachedSelections[passes] = current_subroutines;
+    }
+    return *cachedPermutations[passes];
+}
+
+//////////////////////////////////////////
+// The selections are kept by name: the indices of the subroutines (and the subroutine uniforms themselves) may change with the new sources
+void ReloadSubroutines(GLuint program)
+{
+    std::map<std::string, std::string> selections;
+    std::vector<std::string> fixed;
+    for (int i = 0; i < countActiveSU; i++)
+    {
+        selections[sub_uniforms_names[i]] = subroutines_names[current_subroutines[i]];
+        if (fixed_subroutines[i])
+            fixed.push_back(sub_uniforms_names[i]);
+        delete[] compatible_subroutines[i];
+    }
+    sub_uniform_location.clear();
+    subroutine_index.clear();
+
+    SetupShader(program);
+    for (int i = 0; i < countActiveSU; i++)
+    {
+        auto selection = selections.find(sub_uniforms_names[i]);
+        auto index = selection == selections.end() ? subroutine_index.end() : subroutine_index.find(selection->second);
+        if (index != subroutine_index.end() && std::count(compatible_subroutines[i], compatible_subroutines[i] + num_compatible_subroutines[i], (int) index->second))
+            current_subroutines[i] = index->second;
+        fixed_subroutines[i] = std::count(fixed.begin(), fixed.end(), sub_uniforms_names[i]) > 0;
+    }
+}
+
 //////////////////////////////////////////
 // we load the image from disk and we create an OpenGL texture
 GLint LoadTexture(const char* path, bool repeat)
@@ -709,42 +1382,888 @@ GLint LoadTexture(const char* path, bool repeat)
 
 }
 
-// we load the image from disk and we create an OpenGL texture
-GLint LoadCubeMap(const char* path, const char* format)
+// we load the images from disk and we create an OpenGL texture array, with one layer for each image
+// the images are converted to RGBA, and they must all have the same size of the first one
+GLint LoadTextureArray(const vector<std::string>& paths, bool repeat)
 {
-    int width, height, nrChannels;
-    unsigned char *data;  
-    std::string sPath(path);
-    std::string sFormat(format);
-    std::vector<std::string> textures_faces = {"right", "left", "up", "down", "back", "front"};
     GLuint textureImage;
+    int width = 0, height = 0;
     glGenTextures(1, &textureImage);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, textureImage);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, textureImage);
 
-    for(unsigned int i = 0; i < textures_faces.size(); i++)
+    for (GLuint i = 0; i < paths.size(); i++)
     {
-        data = stbi_load((sPath + textures_faces[i] + "." + sFormat).c_str(), &width, &height, &nrChannels, 0);
-        if (data == nullptr)
-            std::cout << "Failed to load texture!" << std::endl;
-        glTexImage2D( GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+        int w, h, channels;
+        unsigned char* image = stbi_load(paths[i].c_str(), &w, &h, &channels, STBI_rgb_alpha);
+        if (image == nullptr)
+        {
+            std::cout << "Failed to load texture! Image: " << paths[i] << std::endl;
+            continue;
+        }
+        // the first image determines the size of the array
+        if (width == 0)
+        {
+            width = w;
+            height = h;
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, width, height, paths.size(), 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        }
+        if (w == width && h == height)
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, w, h, 1, GL_RGBA, GL_UNSIGNED_BYTE, image);
+        else
+            std::cout << "Texture size mismatch, image skipped! Image: " << paths[i] << std::endl;
+        // we free the memory once we have copied the image in the OpenGL texture
+        stbi_image_free(image);
     }
-    
-    glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
-    // we set how to consider UVs outside [0,1] range
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);  
 
-    // we free the memory once we have created an OpenGL texture
-    stbi_image_free(data);
+    glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+    // we set how to consider UVs outside [0,1] range
+    GLenum wrap = repeat ? GL_REPEAT : GL_CLAMP_TO_EDGE;
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, wrap);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, wrap);
+    // we set the filtering for minification and magnification
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
     // we set the binding to 0 once we have finished
-    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
 
     return textureImage;
+}
+
+//////////////////////////////////////////
+// the maps of each material, one material after the other
+vector<std::string> MaterialMapPaths()
+{
+    vector<std::string> paths;
+    for (const std::string& folder : materialFolders)
+        for (const std::string& map : materialMaps)
+            paths.push_back(texturesFolder + folder + map);
+    return paths;
+}
+
+//////////////////////////////////////////
+// the names of the LUTs contain the shininess values, e.g. "brdfIntegration [20000,5].png"
+vector<std::string> LUTPaths(const std::string& name)
+{
+    vector<std::string> paths;
+    for (const glm::vec2& shininess : shininessPairs)
+    {
+        char pair[32];
+        snprintf(pair, sizeof(pair), " [%g,%g].png", shininess.x, shininess.y);
+        paths.push_back(texturesFolder + name + pair);
+    }
+    return paths;
+}
+
+//////////////////////////////////////////
+// the units never change, so the samplers are assigned only once for each Shader Program (samplers not used by the program are ignored)
+void SetupTextureUnits(GLuint program)
+{
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "brdfLUT"), BRDF_LUT_UNIT);
+    glUniform1i(glGetUniformLocation(program, "halfVector"), HALF_VECTOR_UNIT);
+    glUniform1i(glGetUniformLocation(program, "materialMaps"), MATERIAL_UNIT);
+    glUniform1i(glGetUniformLocation(program, "environmentMap"), ENVIRONMENT_UNIT);
+    glUniform1i(glGetUniformLocation(program, "irradianceMap"), IRRADIANCE_UNIT);
+    GLuint sampleTableBlock = glGetUniformBlockIndex(program, "SampleTable");
+    if (sampleTableBlock != GL_INVALID_INDEX)
+        glUniformBlockBinding(program, sampleTableBlock, SAMPLE_TABLE_BINDING);
+}
+
+//////////////////////////////////////////
+// the same sampling of the environment for the forward and the deferred shading
+void SetLightingUniforms(GLuint program, GLuint frameIndex)
+{
+    // with HDR cube maps, the shaders work in linear space and tone map their output
+    glUniform1i(glGetUniformLocation(program, "hdrEnvironment"), hdrEnvironment);
+    glUniform1ui(glGetUniformLocation(program, "sampleCount"), temporalAccumulation ? temporalSampleCount : sampleCount);
+    glUniform1i(glGetUniformLocation(program, "temporalSampling"), temporalAccumulation);
+    glUniform1ui(glGetUniformLocation(program, "frameIndex"), frameIndex);
+    glUniform1i(glGetUniformLocation(program, "adaptiveSampling"), adaptiveSampling);
+    glUniform1f(glGetUniformLocation(program, "adaptiveQuality"), adaptiveQuality);
+    glUniform1i(glGetUniformLocation(program, "sampleCountView"), sampleCountView);
+    // the deferred shading pass has no subroutines: it is told which specular model is selected (unused by the forward shaders)
+    glUniform1i(glGetUniformLocation(program, "filteredSampling"), currentCompSubIs("Specular", "Specular_Filtered"));
+    glUniform1i(glGetUniformLocation(program, "sampleProvider"), currentCompSubIs("Sample_Provider", "Table_Samples") ? 1 : currentCompSubIs("Sample_Provider", "Analytic_Samples") ? 2 : 0);
+    glUniform1ui(glGetUniformLocation(program, "tableSampleCount"), tableSampleCount);
+    // the shader can store up to 16 pairs
+    glUniform2fv(glGetUniformLocation(program, "shininessPairs"), shininessPairs.size(), glm::value_ptr(shininessPairs[0]));
+}
+
+//////////////////////////////////////////
+void SetViewUniforms(GLuint program, const glm::mat4& projection, const glm::mat4& view, const glm::mat4& previousProjection, const glm::mat4& previousView)
+{
+    glUniformMatrix4fv(glGetUniformLocation(program, "projectionMatrix"), 1, GL_FALSE, glm::value_ptr(projection));
+    glUniformMatrix4fv(glGetUniformLocation(program, "viewMatrix"), 1, GL_FALSE, glm::value_ptr(view));
+    glUniformMatrix4fv(glGetUniformLocation(program, "previousProjectionMatrix"), 1, GL_FALSE, glm::value_ptr(previousProjection));
+    glUniformMatrix4fv(glGetUniformLocation(program, "previousViewMatrix"), 1, GL_FALSE, glm::value_ptr(previousView));
+    glUniform4fv(glGetUniformLocation(program, "wCamera"), 1, glm::value_ptr(glm::vec4(frame.CameraPosition, 1.0)));
+}
+
+//////////////////////////////////////////
+// we build and render the windows of the GUI: the options overlay, or the tips
+void RenderGUI(TextureLoader& textureLoader, EnvironmentBaker& environmentBaker, EnvironmentLibrary& environmentLibrary, ShaderReloader& shaderReloader, SimulationThread<SimulationInput, FramePacket>& simulation, Scene& scene)
+{
+    // Start the Dear ImGui frame
+    ImGui_ImplOpenGL3_NewFrame();
+    ImGui_ImplGlfw_NewFrame();
+    ImGui::NewFrame();
+
+    if (optionsOverlayActive)
+    {
+        
+
+        ImGui::Begin("Shader Selection");
+
+            ImGui::Checkbox("Compile-time permutations", &staticPermutations);
+            // the geometry pass is always a compile-time permutation
+            ImGui::Checkbox("Deferred shading", &deferredShading);
+            if (deferredShading)
+            {
+                // the divisor is a power of two: the combo selects its exponent
+                const char* resolutions[] = {"Full", "Half", "Quarter"};
+                int resolution = specularDownsample == 4u ? 2 : specularDownsample - 1;
+                if (ImGui::Combo("Specular resolution", &resolution, resolutions, IM_ARRAYSIZE(resolutions)))
+                    specularDownsample = 1u << resolution;
+            }
+            ImGui::Checkbox("Depth pre-pass", &depthPrepass);
+            if (depthPrepass)
+                ImGui::Checkbox("Parallax depth", &parallaxDepth);
+            ImGui::Separator();
+
+            // the programs are rebuilt in background when their sources are saved: after an error, the previous version stays in use
+            ImGui::Checkbox("Shader hot reload", &shaderReloader.Enabled);
+            if (shaderReloader.Pending() > 0)
+                ImGui::Text("Rebuilding %d programs...", shaderReloader.Pending());
+            else if (shaderReloader.Reloads + shaderReloader.Failures > 0)
+                ImGui::Text("%d programs reloaded, %d failed", shaderReloader.Reloads, shaderReloader.Failures);
+            ImGui::Separator();
+
+            // without the simulation thread, the main thread runs a step in each frame, before the rendering
+            ImGui::Checkbox("Simulation thread", &simulationThread);
+            ImGui::Text("Simulation step %.3f ms, simulated time %.1f s", simulation.StepTime.load() * 1000, frame.Time);
+            ImGui::Separator();
+
+            ImGui::Text("Shaders");
+            ImGui::Indent();
+            for (GLuint i = 0; i < countActiveSU; i++) 
+            {
+                ImGui::BulletText(sub_uniforms_names[i].c_str());
+
+                ImGui::Indent();
+                for (GLuint j = 0; j < num_compatible_subroutines[i]; j++) {
+                    ImGui::RadioButton(subroutines_names[compatible_subroutines[i][j]].c_str(), &current_subroutines[i], compatible_subroutines[i][j]);
+                }
+                ImGui::Unindent();
+            }
+            ImGui::Unindent();
+
+        ImGui::End();
+
+        ImGui::Begin("Parameters");
+
+        ImGui::Text("Shader Parameters");
+
+        ImGui::SliderFloat3("Normal incidence Fresnel reflectance", glm::value_ptr(F0), 0.0001f, 1.0f, "F0 = %.4f", ImGuiSliderFlags_AlwaysClamp);
+
+        ImGui::Separator();
+
+        // all of the materials are already in the texture array: switching does not load anything
+        ImGui::Combo("Material", &currentMaterial, [](void* data, int i, const char** name)
+        {
+            *name = ((std::string*) data)[i].c_str();
+            return true;
+        }, materialFolders.data(), materialFolders.size());
+        // the LUTs of all of the shininess pairs are already in the texture arrays
+        ImGui::Combo("Shininess (nU, nV)", &currentShininess, [](void* data, int i, const char** name)
+        {
+            static char pair[32];
+            snprintf(pair, sizeof(pair), "%g, %g", ((glm::vec2*) data)[i].x, ((glm::vec2*) data)[i].y);
+            *name = pair;
+            return true;
+        }, (void*) shininessPairs.data(), shininessPairs.size());
+        ImGui::Separator();
+
+        if (ImGui::TreeNode("Scene"))
+        {
+            ImGui::Checkbox("Stress test grid", &stressTest);
+            ImGui::SliderInt("Grid size", &stressGridSize, 1, 100);
+            ImGui::Checkbox("Instanced rendering", &instancedRendering);
+            ImGui::Checkbox("Frustum culling", &scene.Culling);
+            // with instancing, a draw call for each model with visible instances
+            GLuint drawCalls = scene.VisibleInstances;
+            if (instancedRendering)
+                drawCalls = std::count_if(scene.Batches().begin(), scene.Batches().end(), [](const Scene::Batch& batch) { return !batch.instances.empty(); });
+            ImGui::Text("%d / %d visible objects, %d draw calls", scene.VisibleInstances, scene.Size(), drawCalls);
+            ImGui::Text("BVH: %d nodes tested, %d builds", scene.TestedNodes, scene.Builds);
+            ImGui::TreePop();
+        }
+        ImGui::Separator();
+
+        if (currentCompSubIs("Displacement", "ParallaxMapping") || currentCompSubIs("Displacement", "ConeStepMapping") ||
+            currentCompSubIs("Displacement", "QuadtreeDisplacementMapping"))
+        {
+            ImGui::SliderFloat("Height Scale", &heightScale, 0.0001, 0.1, "hS = %.4f", ImGuiSliderFlags_AlwaysClamp);
+            ImGui::Separator();
+        }
+
+        if (currentCompSubIs("Specular", "Specular_Irradiance") || currentCompSubIs("Specular", "Specular_Filtered"))
+        {
+            ImGui::SliderInt("Sample Count", &sampleCount, 1, 200, "sample count = %.4d", ImGuiSliderFlags_AlwaysClamp);
+            ImGui::Checkbox("Adaptive sample count", &adaptiveSampling);
+            if (adaptiveSampling)
+            {
+                ImGui::SliderFloat("Adaptive quality", &adaptiveQuality, 0.1f, 10.0f, "%.2f", ImGuiSliderFlags_Logarithmic);
+                ImGui::Checkbox("Show sample count", &sampleCountView);
+            }
+            // the sample count above is used only without accumulation
+            ImGui::Checkbox("Temporal accumulation", &temporalAccumulation);
+            if (temporalAccumulation)
+            {
+                ImGui::SliderInt("Samples per frame", &temporalSampleCount, 1, 32, "samples per frame = %d", ImGuiSliderFlags_AlwaysClamp);
+                ImGui::SliderInt("History length", &historyLength, 1, 64, "history = %d frames", ImGuiSliderFlags_AlwaysClamp);
+            }
+            ImGui::Separator();
+        }
+
+        // the environments of the library: the selected one is streamed in background, and it replaces the current one when it is ready
+        if (ImGui::ListBoxHeader("Environment", environmentLibrary.Count(), 6))
+        {
+            for (int i = 0; i < environmentLibrary.Count(); i++)
+            {
+                const char* states[] = {"", " (loading)", " (resident)", " (failed)"};
+                std::string label = environmentLibrary.Name(i) + (i == environmentLibrary.Current() ? "" : states[environmentLibrary.GetState(i)]);
+                if (ImGui::Selectable(label.c_str(), i == environmentLibrary.Selected()))
+                    environmentLibrary.Select(i);
+            }
+            ImGui::ListBoxFooter();
+        }
+        ImGui::Text("Resident environments: %.1f MB", environmentLibrary.ResidentBytes() / 1048576.0f);
+        // the image based lighting folders are reloaded in background with the new storage format
+        const GLenum cubeMapFormats[] = {GL_RGB9_E5, GL_R11F_G11F_B10F, GL_RGB16F, GL_NONE};
+        const char* cubeMapFormatNames[] = {"RGB9_E5", "R11F_G11F_B10F", "RGB16F", "RGB8 (tone mapped)"};
+        int currentFormat = std::find(cubeMapFormats, cubeMapFormats + 4, cubeMapFormat) - cubeMapFormats;
+        if (ImGui::Combo("Environment format", &currentFormat, cubeMapFormatNames, 4))
+        {
+            cubeMapFormat = cubeMapFormats[currentFormat];
+            environmentLibrary.SetHDRFormat(cubeMapFormat);
+        }
+        // the cube maps baked from an equirectangular image are added to the library
+        if (EnvironmentBaker::Supported())
+        {
+            static char equirectInput[256] = "";
+            if (equirectInput[0] == '\0')
+                strncpy(equirectInput, equirectPath.c_str(), sizeof(equirectInput) - 1);
+            if (ImGui::InputText("Equirectangular HDR", equirectInput, sizeof(equirectInput)))
+                equirectPath = equirectInput;
+            if (environmentBaker.Baking())
+                ImGui::ProgressBar(environmentBaker.Progress());
+            else if (ImGui::Button("Bake environment"))
+                environmentLibrary.Select(environmentLibrary.AddEquirectangular(equirectPath));
+            ImGui::SliderInt("Bake budget", &environmentBaker.TexelBudget, 1 << 12, 1 << 20, "texels per frame = %d", ImGuiSliderFlags_Logarithmic | ImGuiSliderFlags_AlwaysClamp);
+        }
+        ImGui::Separator();
+
+        if (ImGui::TreeNode("Metrics"))
+        {
+            ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
+            ImGui::Text("Application delta_time %.3f ms/frame (%.1f FPS)", deltaTime * 1000, deltaTime == 0 ? 0 : 1/deltaTime);
+            ImGui::Text("Subroutine dispatch: objects pass %.3f ms (GPU)", dispatchGPUTime[0]);
+            ImGui::Text("Compile-time permutations: objects pass %.3f ms (GPU, %d compiled)", dispatchGPUTime[1], (int)shader_permutations.size());
+            ImGui::Text("Shader binary cache: %d hits, %d misses", Shader::CacheHits, Shader::CacheMisses);
+
+            // GPU time of each pass, over the last frames
+            ImGui::Separator();
+            ImGui::Columns(5, "passes");
+            ImGui::Text("GPU pass (ms)"); ImGui::NextColumn();
+            ImGui::Text("last"); ImGui::NextColumn();
+            ImGui::Text("min"); ImGui::NextColumn();
+            ImGui::Text("avg"); ImGui::NextColumn();
+            ImGui::Text("p99"); ImGui::NextColumn();
+            for (GPUTimer* timer : passTimers)
+            {
+                ImGui::Text("%s", timer->Name.c_str()); ImGui::NextColumn();
+                ImGui::Text("%.3f", timer->Last); ImGui::NextColumn();
+                ImGui::Text("%.3f", timer->Min()); ImGui::NextColumn();
+                ImGui::Text("%.3f", timer->Average()); ImGui::NextColumn();
+                ImGui::Text("%.3f", timer->Percentile(0.99f)); ImGui::NextColumn();
+            }
+            ImGui::Columns(1);
+
+            ImGui::TreePop();
+        }
+
+        if (ImGui::TreeNode("Frame times"))
+        {
+            // the histogram covers up to 1.5 times the 99th percentile: the last bin collects the hitches
+            GLfloat p99 = frameProfiler.Percentile(0.99f);
+            GLfloat histogramMax = std::max(1.0f, 1.5f * p99);
+            ImGui::Text("p50 %.2f - p95 %.2f - p99 %.2f - max %.2f ms (last %d frames)",
+                        frameProfiler.Percentile(0.5f), frameProfiler.Percentile(0.95f), p99, frameProfiler.Max(), frameProfiler.Count());
+            std::vector<GLfloat> histogram = frameProfiler.Histogram(40, histogramMax);
+            char range[32];
+            snprintf(range, sizeof(range), "0 - %.1f ms", histogramMax);
+            ImGui::PlotHistogram("##histogram", histogram.data(), histogram.size(), 0, range, 0.0f, FLT_MAX, ImVec2(0, 80));
+            std::vector<GLfloat> history = frameProfiler.FrameTimes();
+            ImGui::PlotLines("##history", history.data(), history.size(), 0, "recent frames", 0.0f, histogramMax, ImVec2(0, 60));
+
+            // the CPU time of each scope of the frame
+            for (GLuint i = 0; i < frameProfiler.ScopeNames.size(); i++)
+                ImGui::Text("%-8s avg %.3f - p99 %.3f ms", frameProfiler.ScopeNames[i].c_str(), frameProfiler.Average(i), frameProfiler.Percentile(0.99f, i));
+            if (frameProfiler.Dropped > 0)
+                ImGui::Text("Dropped records: %d", (GLuint) frameProfiler.Dropped);
+            ImGui::TreePop();
+        }
+
+        if (captureEnd > 0.0f)
+            ImGui::Text("Capturing... %.1f s", captureEnd - GetTime());
+        else
+        {
+            ImGui::SliderFloat("Capture duration", &captureDuration, 1.0f, 60.0f, "%.0f s");
+            if (ImGui::Button("Capture timings"))
+                StartCapture();
+        }
+        
+
+        ImGui::End();
+    }
+    else // optionsOverlayActive == false
+    {
+        ImGui::Begin("Tips");
+
+        ImGui::Text("Controls:");
+        ImGui::Text("W, A, S, D to move");
+        ImGui::Text("LShift to descend, Space to ascend");
+        ImGui::Text("P to toggle animations");
+        ImGui::Text("L to toggle wireframe rendering");
+        ImGui::Text("E for options");
+        ImGui::Text("Esc to close appliation");
+        if (textureLoader.Pending() > 0)
+        {
+            ImGui::Separator();
+            ImGui::Text("Loading textures: %d/%d", textureLoader.Requested() - textureLoader.Pending(), textureLoader.Requested());
+        }
+        if (environmentBaker.Baking())
+        {
+            ImGui::Separator();
+            ImGui::Text("Baking environment: %.0f%%", environmentBaker.Progress() * 100.0f);
+        }
+
+        ImGui::End();
+    }
+
+    ImGui::Render();
+    ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+}
+
+//////////////////////////////////////////
+// HEADLESS MODE
+
+GLfloat GetTime()
+{
+    return std::chrono::duration<GLfloat>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+//////////////////////////////////////////
+bool ParseCommandLine(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string option = argv[i];
+        // the value of the options which need one
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        bool valid = true;
+
+        if (option == "--headless")
+            headless = GL_TRUE;
+        else if (option == "--dynamic")
+            staticPermutations = GL_FALSE;
+        else if (option == "--no-instancing")
+            instancedRendering = GL_FALSE;
+        else if (option == "--no-culling")
+            frustumCulling = GL_FALSE;
+        else if (option == "--no-hot-reload")
+            shaderHotReload = GL_FALSE;
+        else if (option == "--sample-view")
+            sampleCountView = GL_TRUE;
+        else if (option == "--deferred")
+            deferredShading = GL_TRUE;
+        else if (option == "--prepass")
+            depthPrepass = GL_TRUE;
+        else if (option == "--parallax-depth")
+        {
+            depthPrepass = GL_TRUE;
+            parallaxDepth = GL_TRUE;
+        }
+        else if (value == nullptr)
+            valid = false;
+        else
+        {
+            i++;
+            if (option == "--frames")
+                valid = sscanf(value, "%u", &headlessFrames) == 1 && headlessFrames > 0;
+            else if (option == "--size")
+                valid = sscanf(value, "%dx%d", &headlessWidth, &headlessHeight) == 2 && headlessWidth > 0 && headlessHeight > 0;
+            else if (option == "--dump")
+                dumpFolder = value;
+            else if (option == "--timings")
+                timingsPath = value;
+            else if (option == "--material")
+                valid = sscanf(value, "%d", &currentMaterial) == 1 && currentMaterial >= 0 && currentMaterial < (GLint) materialFolders.size();
+            else if (option == "--shininess")
+                valid = sscanf(value, "%d", &currentShininess) == 1 && currentShininess >= 0 && currentShininess < (GLint) shininessPairs.size();
+            else if (option == "--samples")
+                valid = sscanf(value, "%u", &sampleCount) == 1 && sampleCount > 0;
+            else if (option == "--adaptive")
+            {
+                valid = sscanf(value, "%f", &adaptiveQuality) == 1 && adaptiveQuality > 0.0f;
+                adaptiveSampling = GL_TRUE;
+            }
+            else if (option == "--temporal")
+            {
+                valid = sscanf(value, "%u", &temporalSampleCount) == 1 && temporalSampleCount > 0;
+                temporalAccumulation = GL_TRUE;
+            }
+            else if (option == "--specular-res")
+            {
+                valid = sscanf(value, "%u", &specularDownsample) == 1 && (specularDownsample == 1 || specularDownsample == 2 || specularDownsample == 4);
+                deferredShading = GL_TRUE;
+            }
+            else if (option == "--stress")
+            {
+                valid = sscanf(value, "%d", &stressGridSize) == 1 && stressGridSize > 0;
+                stressTest = GL_TRUE;
+            }
+            else if (option == "--subroutine")
+                subroutineSelections.push_back(value);
+            else if (option == "--environment")
+                environmentName = value;
+            else if (option == "--equirect")
+            {
+                equirectPath = value;
+                bakeAtStart = GL_TRUE;
+            }
+            else if (option == "--bake-budget")
+                valid = sscanf(value, "%u", &bakeBudget) == 1 && bakeBudget > 0;
+            else if (option == "--sweep")
+            {
+                valid = sscanf(value, "%u", &sweepFrames) == 1 && sweepFrames > 0;
+                headless = GL_TRUE;
+            }
+            else
+                valid = false;
+        }
+
+        if (!valid)
+        {
+            std::cout << "Invalid option: " << option << (value != nullptr ? std::string(" ") + value : "") << std::endl;
+            std::cout << "Usage: aniso [--headless] [--frames N] [--size WxH] [--dump FOLDER] [--timings FILE] [--material N] [--shininess N] [--stress N] [--no-instancing] [--no-culling] [--no-hot-reload] [--samples N] [--adaptive Q] [--sample-view] [--temporal N] [--deferred] [--specular-res N] [--prepass] [--parallax-depth] [--subroutine UNIFORM=SUBROUTINE]... [--dynamic] [--environment NAME] [--equirect FILE] [--bake-budget N] [--sweep N]" << std::endl;
+            return false;
+        }
+    }
+
+    if (!dumpFolder.empty())
+    {
+        std::error_code error;
+        std::filesystem::create_directories(dumpFolder, error);
+    }
+    return true;
+}
+
+//////////////////////////////////////////
+bool SelectSubroutines(const vector<std::string>& selections)
+{
+    for (const std::string& selection : selections)
+    {
+        size_t separator = selection.find('=');
+        auto location = sub_uniform_location.find(selection.substr(0, separator));
+        auto index = subroutine_index.find(separator == std::string::npos ? "" : selection.substr(separator + 1));
+        if (location == sub_uniform_location.end() || index == subroutine_index.end())
+        {
+            std::cout << "Unknown subroutine uniform or subroutine: " << selection << std::endl;
+            return false;
+        }
+        if (!std::count(compatible_subroutines[location->second], compatible_subroutines[location->second] + num_compatible_subroutines[location->second], (int) index->second))
+        {
+            std::cout << "The subroutine is not compatible with the subroutine uniform: " << selection << std::endl;
+            return false;
+        }
+        current_subroutines[location->second] = index->second;
+        fixed_subroutines[location->second] = GL_TRUE;
+    }
+    return true;
+}
+
+//////////////////////////////////////////
+#ifdef HEADLESS_EGL
+EGLDisplay eglDisplay = EGL_NO_DISPLAY;
+EGLContext eglContext = EGL_NO_CONTEXT;
+#endif
+
+bool CreateHeadlessContext(GLFWwindow*& window)
+{
+#ifdef HEADLESS_EGL
+    // the surfaceless platform of Mesa does not need a display server: the context has no default framebuffer
+    window = nullptr;
+    PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplayEXT = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (eglGetPlatformDisplayEXT == nullptr)
+        return false;
+    eglDisplay = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    EGLint major, minor;
+    if (eglDisplay == EGL_NO_DISPLAY || !eglInitialize(eglDisplay, &major, &minor) || !eglBindAPI(EGL_OPENGL_API))
+        return false;
+    // same versions and profile of the windowed context
+    for (int minor : CONTEXT_MINOR_VERSIONS)
+    {
+        const EGLint attributes[] = {EGL_CONTEXT_MAJOR_VERSION, 4, EGL_CONTEXT_MINOR_VERSION, minor,
+                                     EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE};
+        eglContext = eglCreateContext(eglDisplay, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, attributes);
+        if (eglContext != EGL_NO_CONTEXT)
+            break;
+    }
+    if (eglContext == EGL_NO_CONTEXT || !eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, eglContext))
+        return false;
+    return gladLoadGLLoader((GLADloadproc) eglGetProcAddress);
+#else
+    // a hidden window: the rendering happens in the offscreen framebuffer anyway
+    if (!glfwInit())
+        return false;
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+    for (int minor : CONTEXT_MINOR_VERSIONS)
+    {
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, minor);
+        window = glfwCreateWindow(64, 64, "Anisotropic - headless", NULL, NULL);
+        if (window)
+            break;
+    }
+    if (!window)
+        return false;
+    glfwMakeContextCurrent(window);
+    return gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
+#endif
+}
+
+void DestroyHeadlessContext()
+{
+#ifdef HEADLESS_EGL
+    eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(eglDisplay, eglContext);
+    eglTerminate(eglDisplay);
+#endif
+}
+
+//////////////////////////////////////////
+#ifdef HEADLESS_EGL
+EGLContext eglWorkerContext = EGL_NO_CONTEXT;
+#endif
+GLFWwindow* workerWindow = nullptr;
+
+bool CreateWorkerContext(GLFWwindow* window)
+{
+    // same version of the context of the application
+    GLint major, minor;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+#ifdef HEADLESS_EGL
+    if (headless)
+    {
+        const EGLint attributes[] = {EGL_CONTEXT_MAJOR_VERSION, major, EGL_CONTEXT_MINOR_VERSION, minor,
+                                     EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE};
+        eglWorkerContext = eglCreateContext(eglDisplay, EGL_NO_CONFIG_KHR, eglContext, attributes);
+        return eglWorkerContext != EGL_NO_CONTEXT;
+    }
+#endif
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, major);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, minor);
+    glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+    workerWindow = glfwCreateWindow(1, 1, "Anisotropic - shader compilation", NULL, window);
+    return workerWindow != nullptr;
+}
+
+void BindWorkerContext()
+{
+#ifdef HEADLESS_EGL
+    if (headless)
+    {
+        eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, eglWorkerContext);
+        return;
+    }
+#endif
+    glfwMakeContextCurrent(workerWindow);
+}
+
+void ReleaseWorkerContext()
+{
+#ifdef HEADLESS_EGL
+    if (headless)
+    {
+        eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        return;
+    }
+#endif
+    glfwMakeContextCurrent(NULL);
+}
+
+void DestroyWorkerContext()
+{
+#ifdef HEADLESS_EGL
+    if (eglWorkerContext != EGL_NO_CONTEXT)
+        eglDestroyContext(eglDisplay, eglWorkerContext);
+    eglWorkerContext = EGL_NO_CONTEXT;
+#endif
+    if (workerWindow)
+        glfwDestroyWindow(workerWindow);
+    workerWindow = nullptr;
+}
+
+//////////////////////////////////////////
+// TIMINGS CAPTURE
+
+void StartCapture()
+{
+    // the GPU samples start from the next frame: some passes of the current one may have been measured already
+    for (GPUTimer* timer : passTimers)
+        timer->StartRecording(frameProfiler.CurrentFrame() + 1);
+    frameProfiler.StartCapture();
+    captureEnd = GetTime() + captureDuration;
+}
+
+void UpdateCapture()
+{
+    if (captureEnd == 0.0f || GetTime() < captureEnd)
+        return;
+    // the samples of the last frames are still in the queries
+    for (GPUTimer* timer : passTimers)
+    {
+        timer->Flush();
+        timer->StopRecording();
+    }
+    frameProfiler.StopCapture();
+    captureEnd = 0.0f;
+    if (GPUTimer::SaveCSV(passTimers, capturePath + "_gpu.csv") && GPUTimer::SaveJSON(passTimers, capturePath + "_gpu.json")
+        && frameProfiler.SaveCSV(capturePath + "_frames.csv"))
+        std::cout << "Timings saved in " << capturePath << "_gpu.csv, " << capturePath << "_gpu.json and " << capturePath << "_frames.csv" << std::endl;
+    else
+        std::cout << "Unable to save the timings: " << capturePath << std::endl;
+}
+
+//////////////////////////////////////////
+void ReportHeadlessTimings(const vector<GLfloat>& cpuTimes, const vector<GLfloat>& frameTimes)
+{
+    vector<GLfloat> gpuTimes = HeadlessGPUTimes(cpuTimes.size());
+
+    if (!timingsPath.empty())
+    {
+        std::ofstream timings(timingsPath);
+        timings << "frame,cpu_ms,gpu_ms,frame_ms";
+        for (GPUTimer* timer : passTimers)
+            if (!timer->Recorded().empty())
+                timings << "," << timer->Name << "_ms";
+        timings << "\n";
+        for (GLuint i = 0; i < cpuTimes.size(); i++)
+        {
+            timings << i << "," << cpuTimes[i] * 1000.0f << "," << gpuTimes[i] << "," << frameTimes[i] * 1000.0f;
+            // the cell of a pass which did not run in the frame is empty
+            for (GPUTimer* timer : passTimers)
+                if (!timer->Recorded().empty())
+                {
+                    const GPUTimer::Sample* sample = timer->RecordedFrame(i);
+                    timings << ",";
+                    if (sample)
+                        timings << sample->time;
+                }
+            timings << "\n";
+        }
+    }
+
+    // the first frame includes the compilation of the permutation: it is excluded from the statistics, if there are other frames
+    GLuint first = cpuTimes.size() > 1 ? 1 : 0;
+    auto report = [first](const char* name, vector<GLfloat> times, GLfloat scale)
+    {
+        times.erase(times.begin(), times.begin() + first);
+        std::sort(times.begin(), times.end());
+        GLfloat sum = 0.0f;
+        for (GLfloat time : times)
+            sum += time * scale;
+        std::cout << name << " ms/frame - avg: " << sum / times.size() << " min: " << times.front() * scale
+                  << " median: " << times[times.size() / 2] * scale << " max: " << times.back() * scale << std::endl;
+    };
+    std::cout << "Headless: " << cpuTimes.size() << " frames at " << headlessWidth << "x" << headlessHeight << std::endl;
+    report("CPU", cpuTimes, 1000.0f);
+    report("GPU", gpuTimes, 1.0f);
+    report("Frame", frameTimes, 1000.0f);
+}
+
+//////////////////////////////////////////
+vector<GLfloat> HeadlessGPUTimes(GLuint frames)
+{
+    // the last results of the pass timers are still pending: we wait for them.
+    // The GPU time of a frame is the sum of its passes (there is no GUI pass in headless mode): the samples are tagged with the index
+    // of the frame profiler, which starts from 0 with the first frame of the loop
+    vector<GLfloat> gpuTimes(frames, 0.0f);
+    for (GPUTimer* timer : passTimers)
+    {
+        timer->Flush();
+        for (const GPUTimer::Sample& sample : timer->Recorded())
+            if (sample.frame < gpuTimes.size())
+                gpuTimes[sample.frame] += sample.time;
+    }
+    return gpuTimes;
+}
+
+//////////////////////////////////////////
+// SUBROUTINE SWEEP
+
+GLuint NumCombinations()
+{
+    GLuint combinations = 1;
+    for (int i = 0; i < countActiveSU; i++)
+        if (!fixed_subroutines[i])
+            combinations *= num_compatible_subroutines[i];
+    return combinations;
+}
+
+void SelectCombination(GLuint combination)
+{
+    for (int i = 0; i < countActiveSU; i++)
+    {
+        if (fixed_subroutines[i])
+            continue;
+        current_subroutines[i] = compatible_subroutines[i][combination % num_compatible_subroutines[i]];
+        combination /= num_compatible_subroutines[i];
+    }
+}
+
+//////////////////////////////////////////
+void ReportSweep(const vector<GLfloat>& frameTimes)
+{
+    vector<GLfloat> gpuTimes = HeadlessGPUTimes(frameTimes.size());
+
+    // the statistics of the measured frames of each combination
+    struct SweepResult
+    {
+        GLuint combination;
+        GLfloat gpuMedian, gpuAverage, gpuMin, frameMedian;
+    };
+    auto median = [](vector<GLfloat> times)
+    {
+        std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+        return times[times.size() / 2];
+    };
+    vector<SweepResult> results;
+    for (GLuint c = 0; c < NumCombinations(); c++)
+    {
+        GLuint first = c * (SWEEP_WARMUP_FRAMES + sweepFrames) + SWEEP_WARMUP_FRAMES;
+        vector<GLfloat> gpu(gpuTimes.begin() + first, gpuTimes.begin() + first + sweepFrames);
+        vector<GLfloat> frame(frameTimes.begin() + first, frameTimes.begin() + first + sweepFrames);
+        GLfloat sum = 0.0f;
+        for (GLfloat time : gpu)
+            sum += time;
+        results.push_back({c, median(gpu), sum / sweepFrames, *std::min_element(gpu.begin(), gpu.end()), median(frame) * 1000.0f});
+    }
+    std::sort(results.begin(), results.end(), [](const SweepResult& a, const SweepResult& b) { return a.gpuMedian < b.gpuMedian; });
 
+    std::ofstream table;
+    if (!timingsPath.empty())
+    {
+        table.open(timingsPath);
+        table << "rank";
+        for (int i = 0; i < countActiveSU; i++)
+            table << "," << sub_uniforms_names[i];
+        table << ",gpu_median_ms,gpu_avg_ms,gpu_min_ms,frame_median_ms\n";
+    }
+    std::cout << "Sweep: " << results.size() << " combinations, " << sweepFrames << " frames each at " << headlessWidth << "x" << headlessHeight
+              << (staticPermutations ? " (compile-time permutations)" : " (subroutine uniforms)") << std::endl;
+    std::cout << "rank  gpu median  gpu avg  frame median  combination" << std::endl;
+    for (GLuint r = 0; r < results.size(); r++)
+    {
+        SelectCombination(results[r].combination);
+        std::string combination;
+        for (int i = 0; i < countActiveSU; i++)
+            combination += (i == 0 ? "" : ", ") + sub_uniforms_names[i] + "=" + subroutines_names[current_subroutines[i]];
+        char row[64];
+        snprintf(row, sizeof(row), "%4u  %10.3f  %7.3f  %12.3f  ", r + 1, results[r].gpuMedian, results[r].gpuAverage, results[r].frameMedian);
+        std::cout << row << combination << std::endl;
+
+        if (table.is_open())
+        {
+            table << r + 1;
+            for (int i = 0; i < countActiveSU; i++)
+                table << "," << subroutines_names[current_subroutines[i]];
+            table << "," << results[r].gpuMedian << "," << results[r].gpuAverage << "," << results[r].gpuMin << "," << results[r].frameMedian << "\n";
+        }
+    }
+}
+
+//////////////////////////////////////////
+// SCENE
+
+void BuildScene(Scene& scene, Model& sphereModel, Model& cubeModel)
+{
+    scene.Clear();
+    // the central sphere: its transformation and parameters are updated at each frame
+    scene.Add(sphereModel, InstanceData());
+    if (!stressTest)
+        return;
+
+    // a few values of F0, from dielectrics to metals (silver, gold, copper)
+    const glm::vec3 reflectances[] = {glm::vec3(0.04f), glm::vec3(0.14f), glm::vec3(0.95f, 0.93f, 0.88f), glm::vec3(1.0f, 0.78f, 0.34f), glm::vec3(0.95f, 0.64f, 0.54f)};
+
+    // the grid lies on the ground below the central sphere, and it extends away from the starting position of the camera
+    for (GLint i = 0; i < stressGridSize; i++)
+        for (GLint j = 0; j < stressGridSize; j++)
+        {
+            GLboolean sphere = (i + j) % 2 == 0;
+            InstanceData instance;
+            instance.ModelMatrix = glm::translate(glm::mat4(1.0f), glm::vec3((i - 0.5f * (stressGridSize - 1)) * STRESS_GRID_SPACING, -2.0f, -2.0f - j * STRESS_GRID_SPACING));
+            instance.ModelMatrix = glm::rotate(instance.ModelMatrix, glm::radians(37.0f * (i * stressGridSize + j)), glm::vec3(0.0f, 1.0f, 0.0f));
+            instance.ModelMatrix = glm::scale(instance.ModelMatrix, glm::vec3(sphere ? 0.8f : 0.6f));
+            instance.F0 = reflectances[(i * 3 + j) % 5];
+            // the UVs of the sphere are stretched along the equator
+            instance.Repeat = sphere ? glm::vec2(2.0f, 1.0f) : glm::vec2(1.0f, 1.0f);
+            instance.Material = glm::ivec2((i + 2 * j) % materialFolders.size(), (i * 7 + j) % shininessPairs.size());
+            scene.Add(sphere ? sphereModel : cubeModel, instance);
+        }
+}
+
+//////////////////////////////////////////
+void DrawObjects(GLuint program, const vector<Scene::Batch>& batches)
+{
+    // we determine the position in the Shader Program of the uniform variables of the objects
+    GLint materialLocation = glGetUniformLocation(program, "material");
+    GLint shininessLocation = glGetUniformLocation(program, "shininess");
+    GLint repeatLocation = glGetUniformLocation(program, "repeat");
+    GLint f0Location = glGetUniformLocation(program, "F0");
+
+    if (instancedRendering)
+    {
+        glUniform1i(glGetUniformLocation(program, "instanced"), GL_TRUE);
+        for (const Scene::Batch& batch : batches)
+            if (!batch.instances.empty())
+                batch.model->DrawInstanced(batch.instances.size());
+    }
+    else
+    {
+        // the same parameters, with the uniforms of the objects
+        glUniform1i(glGetUniformLocation(program, "instanced"), GL_FALSE);
+        for (const Scene::Batch& batch : batches)
+            for (const InstanceData& instance : batch.instances)
+            {
+                glUniformMatrix4fv(glGetUniformLocation(program, "modelMatrix"), 1, GL_FALSE, glm::value_ptr(instance.ModelMatrix));
+                glUniformMatrix4fv(glGetUniformLocation(program, "previousModelMatrix"), 1, GL_FALSE, glm::value_ptr(instance.PreviousModelMatrix));
+                // if we cast a mat4 to a mat3, we are automatically considering the upper left 3x3 submatrix
+                glm::mat3 normalMatrix = glm::inverseTranspose(glm::mat3(instance.ModelMatrix));
+                glUniformMatrix3fv(glGetUniformLocation(program, "normalMatrix"), 1, GL_FALSE, glm::value_ptr(normalMatrix));
+                glUniform3fv(f0Location, 1, glm::value_ptr(instance.F0));
+                glUniform2fv(repeatLocation, 1, glm::value_ptr(instance.Repeat));
+                glUniform1i(materialLocation, instance.Material.x);
+                glUniform1i(shininessLocation, instance.Material.y);
+                batch.model->Draw();
+            }
+    }
 }
 
 //////////////////////////////////////////
@@ -821,23 +2340,55 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
 
 //////////////////////////////////////////
 // If one of the WASD keys is pressed, the camera is moved accordingly (the code is in utils/camera.h)
-void apply_camera_movements()
-{
-    if(keys[GLFW_KEY_W])
-        camera.ProcessKeyboard(FORWARD, deltaTime);
-    if(keys[GLFW_KEY_S])
-        camera.ProcessKeyboard(BACKWARD, deltaTime);
-    if(keys[GLFW_KEY_A])
-        camera.ProcessKeyboard(LEFT, deltaTime);
-    if(keys[GLFW_KEY_D])
-        camera.ProcessKeyboard(RIGHT, deltaTime);
-    if(keys[GLFW_KEY_SPACE])
-        camera.ProcessKeyboard(UP, deltaTime);
-    if(keys[GLFW_KEY_LEFT_SHIFT])
-        camera.ProcessKeyboard(DOWN, deltaTime);
+void apply_camera_movements(const SimulationInput& input, GLfloat timeStep)
+{
+    if(input.Movements[FORWARD])
+        camera.ProcessKeyboard(FORWARD, timeStep);
+    if(input.Movements[BACKWARD])
+        camera.ProcessKeyboard(BACKWARD, timeStep);
+    if(input.Movements[LEFT])
+        camera.ProcessKeyboard(LEFT, timeStep);
+    if(input.Movements[RIGHT])
+        camera.ProcessKeyboard(RIGHT, timeStep);
+    if(input.Movements[UP])
+        camera.ProcessKeyboard(UP, timeStep);
+    if(input.Movements[DOWN])
+        camera.ProcessKeyboard(DOWN, timeStep);
     
 }
 
+//////////////////////////////////////////
+// a step of the simulation: it runs on the simulation thread (or on the main thread, see SIMULATION THREAD)
+FramePacket SimulateStep(const SimulationInput& input, GLfloat timeStep)
+{
+    // the sum of the mouse offsets read by the previous step
+    static glm::vec2 lastMouseOffset = glm::vec2(0.0f);
+    glm::vec2 mouseMovement = input.MouseOffset - lastMouseOffset;
+    lastMouseOffset = input.MouseOffset;
+
+    // we apply FPS camera movements if mouse cursor is disabled
+    if (input.CameraActive)
+    {
+        if (mouseMovement != glm::vec2(0.0f))
+            camera.ProcessMouseMovement(mouseMovement.x, mouseMovement.y);
+        apply_camera_movements(input, timeStep);
+    }
+
+    // if animated rotation is activated, than we increment the rotation angle using the time step and the rotation speed parameter
+    if (input.Spinning)
+        orientationY+=(timeStep*spin_speed);
+
+    FramePacket packet;
+    packet.View = camera.GetViewMatrix();
+    packet.CameraPosition = camera.Position;
+    packet.SphereModelMatrix = glm::rotate(glm::mat4(1.0f), glm::radians(orientationY), glm::vec3(0.0f, 1.0f, 0.0f));
+    packet.SphereModelMatrix = glm::scale(packet.SphereModelMatrix, glm::vec3(0.8f, 0.8f, 0.8f));
+    static GLfloat time = 0.0f;
+    time += timeStep;
+    packet.Time = time;
+    return packet;
+}
+
 //////////////////////////////////////////
 // callback for mouse events
 void mouse_callback(GLFWwindow* window, double xpos, double ypos)
@@ -860,8 +2411,8 @@ void mouse_callback(GLFWwindow* window, double xpos, double ypos)
     lastX = xpos;
     lastY = ypos;
 
-    // we pass the offset to the Camera class instance in order to update the rendering
-    camera.ProcessMouseMovement(xoffset, yoffset);
+    // the offset is applied to the Camera class instance by the next step of the simulation
+    mouseOffset += glm::vec2(xoffset, yoffset);
 
 }
 
@@ -884,6 +2435,17 @@ bool ImGui::SliderInt(const char* label, GLuint* v, GLuint v_min, GLuint v_max,
     return SliderScalar(label, ImGuiDataType_U32, v, &v_min, &v_max, format, flags);
 }
 
+// Same as above, for the GLboolean flags of the application
+// @Overload
+bool ImGui::Checkbox(const char* label, GLboolean* v)
+{
+    bool value = *v;
+    const bool pressed = Checkbox(label, &value);
+    if (pressed)
+        *v = value;
+    return pressed;
+}
+
 // this function takes the value "perturbedNormal" of the normal map in a texel and returns the quaternion that rotates N = (0.0, 0.0, 1.0) to perturbedNormal (in tangent space coordinates)
 // it returns a vec3 because the quaternion q = a + bi + cj + dk we calculate always has d == 0
 // to speed up calculations, I omit the last coordinate
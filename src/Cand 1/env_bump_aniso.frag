@@ -5,11 +5,41 @@ TODO:
 
 #version 410 core
 
-const float PI = 3.14159265359;
+// with PARALLAX_DEPTH the fragments write their depth (see ParallaxDepth): the extension must be enabled before any declaration
+#ifdef PARALLAX_DEPTH
+    #extension GL_ARB_conservative_depth : enable
+#endif
 
-// output shader variable
-out vec4 colorFrag;
+const float PI = 3.14159265359;
 
+// DEFERRED SHADING
+// the same source builds the three passes of the illumination shader:
+// - forward (no define): each fragment of the objects is shaded
+// - GBUFFER_PASS: geometry pass of the deferred shading. The fragment does the displacement and the map lookups, and it stores the
+//   resulting surface in the G-buffer (see utils/gbuffer.h): world normal and tangent, albedo and ambient occlusion, F0 and shininess, motion vector
+// - DEFERRED_SHADING: full-screen pass (with fullscreen_triangle.vert), which reads the G-buffer and integrates the environment once per pixel,
+//   whatever the overdraw of the geometry pass
+// - DEPTH_PREPASS: the objects are rendered only in the depth buffer, before the forward or the geometry pass (see main).
+//   With PARALLAX_DEPTH, the depth of the point hit by the displacement is written instead of the depth of the triangle, by the pre-pass
+//   and by the forward or geometry pass, so that the shading pass keeps the equal depth test
+// - DEFERRED_SHADING and SPECULAR_PASS: the specular term of the deferred shading, integrated in a low resolution target
+
+// output shader variables
+#ifdef GBUFFER_PASS
+// octahedral encodings of the world normal (xy) and tangent (zw), remapped to [0,1]
+layout (location = 0) out vec4 frameFrag;
+// albedo (rgb) and ambient occlusion (a)
+layout (location = 1) out vec4 materialFrag;
+// F0 (rgb) and index of the shininess pair (a, divided by 65535)
+layout (location = 2) out vec4 surfaceFrag;
+layout (location = 3) out vec2 velocityFrag;
+#else
+layout (location = 0) out vec4 colorFrag;
+// motion vector of the fragment (from the previous frame to this one, in UV units of the screen), for the temporal accumulation
+layout (location = 1) out vec2 velocityFrag;
+#endif
+
+#ifndef DEFERRED_SHADING
 // vector from fragment to camera
 in vec3 tViewDirection; // in tangent coordinates (for illumination calculations)
 
@@ -19,31 +49,85 @@ in mat3 wTBNt;
 // interpolated texture coordinates
 in vec2 interp_UV;
 
+// the parameters of the object (uniforms, or attributes of the instance with instanced rendering), from the vertex shader
 // texture repetitions
-uniform vec2 repeat;
-
-// texture sampler
-uniform sampler2D albedo;
-
-// normal map sampler
-uniform sampler2D normMap;
-// depth map sampler
-uniform sampler2D depthMap;
-// ambient occlusion map sampler
-uniform sampler2D aoMap;
-// metalness map sampler
-uniform sampler2D metallicMap;
-
-// quaternion map sampler
-uniform sampler2D quaternionMap;
-// differential map sampler
-uniform sampler2D rotationMap;
-
+flat in vec2 objectRepeat;
+// index of the material of the object
+flat in int objectMaterial;
+// index of the (nU, nV) shininess pair, i.e. of the layer of the LUTs
+flat in int objectShininess;
 // (spectral) fresnel reflectance at normal incidence
-uniform vec3 F0;
+flat in vec3 objectF0;
+
+// position of the fragment in clip coordinates, in this frame and in the previous one
+in vec4 currentClip;
+in vec4 previousClip;
+#else
+// the G-buffer of the geometry pass (see the outputs of GBUFFER_PASS), read at the pixel
+uniform sampler2D gFrame;
+uniform sampler2D gMaterial;
+uniform sampler2D gSurface;
+uniform sampler2D gVelocity;
+uniform sampler2D gDepth;
+
+// the position of the pixel in world coordinates is reconstructed from its depth
+uniform mat4 inverseViewProjection;
+// camera position in world coordinates
+uniform vec4 wCamera;
+
+// the specular term can be integrated at a lower resolution, in a target with 1 / specularDownsample of the pixels in each direction
+// (SPECULAR_PASS), and upsampled by the shading pass (1: the shading pass integrates it for each pixel)
+uniform int specularDownsample;
+uniform sampler2D lowResSpecular;
+// tolerances of the bilateral upsampling: relative difference of the distance from the camera, and exponent of the cosine between the normals
+const float BILATERAL_DEPTH_TOLERANCE = 0.02;
+const float BILATERAL_NORMAL_POWER = 16.0;
+// the shading pass has no subroutines: the application sets it to true if the selected specular model is Specular_Filtered
+uniform bool filteredSampling;
+#endif // DEFERRED_SHADING
+
+// the maps of all of the materials are layers of a single texture array:
+// the maps of a material are stored in consecutive layers, in this order (see MATERIALS in aniso.cpp)
+const int ALBEDO_MAP = 0;
+// normal map
+const int NORMAL_MAP = 1;
+// depth (1 - height) map
+const int DEPTH_MAP = 2;
+// ambient occlusion map
+const int AO_MAP = 3;
+// metalness map
+const int METALLIC_MAP = 4;
+// quaternion map
+const int QUATERNION_MAP = 5;
+// differential (tangent plane rotation) map
+const int ROTATION_MAP = 6;
+// relaxed cone map: depth in the red channel, square root of the cone ratio (over MAX_CONE_RATIO) in the green one (see ConeStepMapping)
+const int CONE_MAP = 7;
+// min-depth quadtree of the depth map (see QuadtreeNode)
+const int QUADTREE_MAP = 8;
+const int NUM_MATERIAL_MAPS = 9;
+// the largest cone ratio of the cone maps (MAX_RATIO in coneStepMapping.cpp)
+const float MAX_CONE_RATIO = 0.125;
+
+// texture array sampler
+uniform sampler2DArray materialMaps;
 
 // uniform for Parallax Mapping
 uniform float heightScale;
+// depth of the point hit by the displacement, in [0,1] (in units of heightScale), set by the displacement method.
+// It is precise: with PARALLAX_DEPTH, the depth buffer is written by the pre-pass and tested with GL_EQUAL by the shading pass,
+// so the two programs must compute exactly the same value, and the compiler must not optimize the operations differently
+precise float displacementDepth = 0.0;
+
+#ifdef PARALLAX_DEPTH
+// the transformations of the vertex shader, for the depth of the displaced point
+uniform mat4 viewMatrix;
+uniform mat4 projectionMatrix;
+// the displaced point is never in front of the triangle: the driver can reject the fragments behind the depth buffer before running the shader
+#ifdef GL_ARB_conservative_depth
+layout (depth_greater) out float gl_FragDepth;
+#endif
+#endif
 
 // the same cubemap used for the skybox
 uniform samplerCube environmentMap;
@@ -51,27 +135,114 @@ uniform samplerCube environmentMap;
 // the convoluted environment map
 uniform samplerCube irradianceMap;
 
-// the number of samples in the integration
+// true if the cube maps store linear HDR radiance: the albedo is then converted to linear space, and the output is tone mapped
+// false if they store the 8 bit tone mapped images, and the whole calculation is done in gamma space
+uniform bool hdrEnvironment;
+
+// the number of samples in the integration (with adaptiveSampling, the maximum number of samples of a fragment)
 uniform uint sampleCount;
 
-// the RGBA LUT for half-vector sampling
+// ADAPTIVE SAMPLING
+// if true, each fragment chooses its number of samples (see AdaptiveSampleCount)
+uniform bool adaptiveSampling;
+// scale of the adaptive number of samples (1: about one sample for each footprint of the pixel in the lobe)
+uniform float adaptiveQuality;
+// if true, the output is the number of samples used by the fragment, relative to sampleCount (blue: 1 sample, red: sampleCount)
+uniform bool sampleCountView;
+// the (nU, nV) shininess of each layer of the LUTs
+const int MAX_SHININESS_PAIRS = 16;
+uniform vec2 shininessPairs[MAX_SHININESS_PAIRS];
+// the number of samples used by Specular_Irradiance, for the debug view
+uint usedSamples = 0u;
+
+// TEMPORAL ACCUMULATION
+// if true, the samples are rotated differently for each pixel and each frame (Cranley-Patterson rotation, see SampleRotation):
+// the estimates of the following frames are independent, and their average (the history of the temporal accumulation) converges
+uniform bool temporalSampling;
+// number of the frame
+uniform uint frameIndex;
+
+// the RGBA LUTs for half-vector sampling, one layer for each (nU, nV) shininess pair
 // alpha channel is the probability density function for that vector
 // u parameter is the first random number, v parameter is the second
-uniform sampler2D halfVector; //in tangent space coordinates
+uniform sampler2DArray halfVector; //in tangent space coordinates
+// FILTERED IMPORTANCE SAMPLING (see Specular_Filtered)
+// with few samples, each one reads the environment map at the mip level whose texels cover its share of the lobe:
+// the solid angle of a sample is 1 / (samples * pdf), compared with the solid angle of a texel. The bias blurs the lookups a bit more,
+// which hides the overlaps and gaps between the footprints of the samples
+const float FILTERED_LOD_BIAS = 1.0;
+
+// SAMPLE PROVIDERS (see Sample_Provider)
+// the half vectors of the Hammersley points, computed on the CPU (see utils/sample_table.h): tableSampleCount consecutive entries
+// for each shininess pair. tableSampleCount is 0 if the table does not hold the current sample count
+const int MAX_TABLE_SAMPLES = 1024;
+layout (std140) uniform SampleTable
+{
+    vec4 tableSamples[MAX_TABLE_SAMPLES];
+};
+uniform uint tableSampleCount;
 
-// the RG LUT for the Monte-Carlo integration of the BRDF (for fixed (alphaX, alphaY) directional roughness)
+// the RG LUTs for the Monte-Carlo integration of the BRDF (one layer for each (alphaX, alphaY) directional roughness)
 // red channel is size (versus F0), green channel is bias
 // u parameter is NdotV, v parameter is TdotV
-uniform sampler2D brdfLUT;
+uniform sampler2DArray brdfLUT;
 
 ////////////////////////////////////////////////////////////////////
 
+// SHADER PERMUTATIONS
+// when STATIC_DISPATCH is defined, the application has specialized this shader for one fixed selection of methods:
+// each subroutine uniform name below is #defined (by the application) to the name of the chosen implementation,
+// so the calls are resolved at compile time and the driver can inline them
+// without STATIC_DISPATCH, the methods are swapped at runtime through the subroutine uniforms (fallback path)
+// the deferred shading pass does not use the methods of the geometry: they are not compiled.
+// It has no subroutines: the sample providers are plain functions, chosen with the sampleProvider uniform
+#if defined(STATIC_DISPATCH) || defined(DEFERRED_SHADING)
+    #define SUBROUTINE(type)
+#else
+    #define SUBROUTINE(type) subroutine(type)
+#endif
+
+#ifdef DEFERRED_SHADING
+// index of the method selected for Sample_Provider in the application: 0 LUT_Samples, 1 Table_Samples, 2 Analytic_Samples
+uniform int sampleProvider;
+
+vec4 LUT_Samples(vec2 Xi, uint i, uint samples, int shininess);
+vec4 Table_Samples(vec2 Xi, uint i, uint samples, int shininess);
+vec4 Analytic_Samples(vec2 Xi, uint i, uint samples, int shininess);
+
+vec4 Sample_Provider(vec2 Xi, uint i, uint samples, int shininess)
+{
+    if (sampleProvider == 1)
+        return Table_Samples(Xi, i, samples, shininess);
+    if (sampleProvider == 2)
+        return Analytic_Samples(Xi, i, samples, shininess);
+    return LUT_Samples(Xi, i, samples, shininess);
+}
+#else
+
+// SURFACE CONTEXT
+// the displacement and the tangent frame of the fragment are computed once (see BuildSurface),
+// and then shared by main and by the diffuse and specular methods
+struct SurfaceContext
+{
+    // view vector in tangent space coordinates
+    vec3 V;
+    // UVs after the repetitions and the displacement
+    vec2 UV;
+    // tangent, bitangent and normal in tangent space coordinates, as returned by the maps
+    // NOTE: this is where bump mapping happens when enabled, so don't assume the vectors are axis-aligned (nor normalized)
+    vec3 N, T, B;
+    // derivatives of the reflection vector in world coordinates (see ReflectionDerivatives)
+    vec3 wRdx, wRdy;
+};
+
+#ifndef STATIC_DISPATCH
 // subroutine uniform for the choice of the specular lighting component method
-subroutine vec3 diffuse_model();
+subroutine vec3 diffuse_model(SurfaceContext surface);
 subroutine uniform diffuse_model Diffuse;
 
 // subroutine uniform for the choice of the specular lighting component method
-subroutine vec3 specular_model();
+subroutine vec3 specular_model(SurfaceContext surface);
 subroutine uniform specular_model Specular;
 
 ////////////////////////////////////////////////////////////////////
@@ -96,111 +267,147 @@ subroutine uniform bitangent_map Bitangent_Map;
 
 ////////////////////////////////////////////////////////////////////
 
+// subroutine uniform for the choice of the sample provider of the specular integration: the method which maps the point Xi of the unit square
+// (the i-th of the samples of the fragment) to a half vector of the lobe of the shininess pair. See SAMPLE PROVIDERS
+subroutine vec4 sample_provider(vec2 Xi, uint i, uint samples, int shininess);
+subroutine uniform sample_provider Sample_Provider;
+
+#else
+// the implementations are called before being defined, so we declare them in advance
+vec3 Lambert_Irradiance(SurfaceContext surface);
+vec3 Specular_Irradiance(SurfaceContext surface);
+vec3 Specular_Filtered(SurfaceContext surface);
+vec2 ParallaxMapping(vec2 texCoords, vec3 viewDir);
+vec2 ConeStepMapping(vec2 texCoords, vec3 viewDir);
+vec2 QuadtreeDisplacementMapping(vec2 texCoords, vec3 viewDir);
+vec3 Off_N(vec2 final_UV);
+vec3 NormalMapping(vec2 final_UV);
+vec3 QuaternionMap_N(vec2 final_UV);
+vec3 Off_T(vec2 final_UV);
+vec3 RotationMap_T(vec2 final_UV);
+vec3 QuaternionMap_T(vec2 final_UV);
+vec3 QuatAndRotMap_T(vec2 final_UV);
+vec3 Off_B(vec2 final_UV);
+vec3 RotationMap_B(vec2 final_UV);
+vec3 QuaternionMap_B(vec2 final_UV);
+vec3 QuatAndRotMap_B(vec2 final_UV);
+vec4 LUT_Samples(vec2 Xi, uint i, uint samples, int shininess);
+vec4 Table_Samples(vec2 Xi, uint i, uint samples, int shininess);
+vec4 Analytic_Samples(vec2 Xi, uint i, uint samples, int shininess);
+#endif // STATIC_DISPATCH
+#endif // DEFERRED_SHADING
+
+////////////////////////////////////////////////////////////////////
+
 // low discrepancy sequence generation
 float RadicalInverse_VdC(uint bits);
 vec2 Hammersley(uint i, uint N);
+// offset of the samples of the fragment in this frame
+vec2 SampleRotation();
+
+// number of samples for the integration of the environment over the specular lobe
+uint AdaptiveSampleCount(vec3 V, vec3 N, vec3 wRdx, vec3 wRdy, int shininess);
+
+// the lighting of a surface, shared by the forward and the deferred shading:
+// V, N, T and B are in the same space (tangent space, or world space in the deferred pass), and toWorld maps them to world coordinates.
+// wRdx and wRdy are the screen-space derivatives of the reflection vector in world coordinates (see ReflectionDerivatives)
+vec3 DiffuseLighting(vec3 wN, vec3 albedo);
+// with filtered, the lookups of the environment map are filtered according to the pdf of the samples (see FILTERED IMPORTANCE SAMPLING)
+vec3 SpecularLighting(vec3 V, vec3 N, vec3 T, vec3 B, mat3 toWorld, vec3 wRdx, vec3 wRdy, int shininess, vec3 F0, bool filtered);
+// the derivatives of the reflection vector select the footprint of the lookups and the adaptive number of samples.
+// They are undefined in non-uniform control flow: the passes compute them at the beginning of main, before any branch, return or discard
+void ReflectionDerivatives(vec3 V, vec3 N, mat3 toWorld, out vec3 wRdx, out vec3 wRdy);
+// tone mapping of the output color, and debug view of the adaptive sampling
+vec3 OutputColor(vec3 color);
+
+// compact storage of unit vectors in the G-buffer (octahedral mapping, in [-1,1])
+vec2 EncodeOctahedron(vec3 n);
+vec3 DecodeOctahedron(vec2 e);
 
 ////////////////////////////////////////////////////////////////////
-// Normalized Lambertian Diffuse Component
-subroutine(diffuse_model)
-vec3 Lambert_Irradiance() // this name is the one which is detected by the SetupShaders() function in the main application, and the one used to swap subroutines
-{
-    // we determine UVs based on wrapping (repeat) and displacement
-    vec3 V = normalize(tViewDirection);
-    vec2 disp_UV = Displacement(mod(interp_UV*repeat, 1.0), V);
-    vec2 final_UV = mod(disp_UV, 1.0);
-
-    vec3 N = Normal_Map(final_UV);
 
-    vec3 irradiance = texture(irradianceMap, wTBNt * N).xyz; // N is in tangent coordinates, with or without perturbation (bump mapping)
-    vec3 surfaceColor = texture(albedo, final_UV).xyz;
+#ifndef DEFERRED_SHADING
 
-    // division by PI is done in the convolution resulting in the irradiance map
-    return irradiance*surfaceColor;
+// we sample one of the maps of the current material from the texture array
+vec4 MaterialMap(int map, vec2 UV)
+{
+    return texture(materialMaps, vec3(UV, float(objectMaterial * NUM_MATERIAL_MAPS + map)));
 }
 
-// realtime environment lookup, preprocessed BRDF integral and half-vector
-subroutine(specular_model)
-vec3 Specular_Irradiance()
-{    
-    // we determine UVs based on wrapping (repeat) and displacement
-    vec3 V = normalize(tViewDirection); // view vector in tangent space coordinates
-    vec2 disp_UV = Displacement(mod(interp_UV*repeat, 1.0), V);
-    vec2 final_UV = mod(disp_UV, 1.0);
-
-    // 1): sample and integrate the environment map
-
-    // tangent, bitangent and normal in tangent space coordinates: for calculations
-    // NOTE: this is where bump mapping happens when enabled, so don't assume the vectors are axis-aligned
-    vec3 N = Normal_Map(final_UV);
-    vec3 T = Tangent_Map(final_UV);
-    vec3 B = Bitangent_Map(final_UV);
-
-    /*
-    The original article by Epic Games introduces this approximation to preprocess the prefiltered map (not knowing in advance the value of V):
-    vec3 R = N; // reflected vector
-    vec3 V = R; // view vector
-
-    Since we can't preprocess, we might as well use the actual value of V! (R is not needed in this instance)
-    */
-
-    float totalWeight = 0.0;
-    vec3 convolutedColor = vec3(0.0);  
-    for (uint i = 0u; i < sampleCount; i++)
-    {
-        // low discrepancy sequence on the unit square
-        vec2 Xi = Hammersley(i, sampleCount);
-
-        // H, V and L are all in tangent space
+// screen-space derivatives of the UVs, for the lookups of the displacement methods: their loops stop after a different number of
+// iterations in neighbouring pixels, where the implicit derivatives are undefined (and they could differ between the pre-pass and the shading pass)
+vec2 displacementDx, displacementDy;
 
-        // mapping the square to the upper hemisphere via texture lookup
-        vec3 H = 2.0 * texture(halfVector, Xi).xyz - 1.0;
-        // H should be perturbed along with the tangent space (the distribution is centered on the perturbed normal and rotated along the perturbed tangents)
-        H = H.x * T + H.y * B + H.z * N; // this is a matrix multiplication. Notice it maps tangent space to tangent space (it is an endomorphism)
-
-        // calculate L as the reflection of V against H
-        vec3 L = normalize(2.0 * dot(V, H) * H - V);
-
-        float NdotL = max(dot(N, L), 0.0);
-        if(NdotL > 0.0)
-        {
-            // map the light direction to world coordinates, usign the TBN matrix interpolated during rasterization
-            vec3 wL = wTBNt * L;
+// we sample one of the maps of the current material inside the displacement methods
+vec4 DisplacementMap(int map, vec2 UV)
+{
+    return textureGrad(materialMaps, vec3(UV, float(objectMaterial * NUM_MATERIAL_MAPS + map)), displacementDx, displacementDy);
+}
 
-            // look-up of the environment map along the (world) light direction
-            convolutedColor += texture(environmentMap, wL).rgb * NdotL; // NdotL is the weight of the Monte-Carlo integration
-            totalWeight += NdotL;
-        }
-    }
-    convolutedColor = convolutedColor / totalWeight;
+// we determine UVs based on wrapping (repeat) and displacement (V in tangent space coordinates)
+vec2 DisplacedUV(vec3 V)
+{
+    // the derivatives are computed in uniform control flow, before the wrapping
+    displacementDx = dFdx(interp_UV*objectRepeat);
+    displacementDy = dFdy(interp_UV*objectRepeat);
+    vec2 disp_UV = Displacement(mod(interp_UV*objectRepeat, 1.0), V);
+    return mod(disp_UV, 1.0);
+}
 
-    // 2): calculate the resulting specular component, using the preprocessed BRDF integral
+#ifdef PARALLAX_DEPTH
+// the depth of the point hit by the displacement (DisplacedUV must have been called), written by the pre-pass and by the shading pass
+float ParallaxDepth(vec3 V)
+{
+    // the displaced point is under the surface, along the view ray: the displacement moves the UVs by V.xy / V.z * heightScale for each unit of depth
+    precise vec3 wOffset = wTBNt * (-V / max(V.z, 0.01) * heightScale * displacementDepth);
+    // the clip coordinates are linear in the position: we move the ones of the fragment
+    precise vec4 clip = currentClip + projectionMatrix * viewMatrix * vec4(wOffset, 0.0);
+    precise float depth = clamp(0.5 * clip.z / clip.w + 0.5, 0.0, 1.0);
+    return depth;
+}
+#endif
 
-    // the BRDF has rectangular symmetry along the tangent and bitangent
-    // this means it is enough to calculate it assuming V is in the first quadrant of the tangent plane, as H is instead mapped to all of the quadrants (and only their relative position, regardless of simmetry, matters)
-    // this improves memory management by a factor of 4 at the same resolution
-    float absTdotV = abs(dot(T, V));
-    float absBdotV = abs(dot(B, V));
-    float NdotV = clamp(dot(V, N), 0.0, 1.0); // avoid raising a negative base
+// the displacement and the maps of the tangent frame are evaluated only here, once per fragment
+SurfaceContext BuildSurface()
+{
+    SurfaceContext surface;
+    surface.V = normalize(tViewDirection);
+    surface.UV = DisplacedUV(surface.V);
+    surface.N = Normal_Map(surface.UV);
+    surface.T = Tangent_Map(surface.UV);
+    surface.B = Bitangent_Map(surface.UV);
+    ReflectionDerivatives(surface.V, surface.N, wTBNt, surface.wRdx, surface.wRdy);
+    return surface;
+}
 
-    // Phi is the angle between T and V (projected onto the tangent plane). It ranges in [0, PI/2]
-    // I remap it to [0,1] by multiplying it by 2/PI
-    float normalizedPhi = absTdotV == 0.0 ? 1.0 : 2.0 * atan(absBdotV, absTdotV) / PI; // GLSL atan(y,x) is undefined for x==0; I fix the image for that value
-    
-    // look up size and bias coefficients from the BRDF LUT
-    vec2 envBRDF  = texture( brdfLUT, vec2(normalizedPhi, sqrt(NdotV)) ).rg;
+////////////////////////////////////////////////////////////////////
+// Normalized Lambertian Diffuse Component
+SUBROUTINE(diffuse_model)
+vec3 Lambert_Irradiance(SurfaceContext surface) // this name is the one which is detected by the SetupShaders() function in the main application, and the one used to swap subroutines
+{
+    vec3 surfaceColor = MaterialMap(ALBEDO_MAP, surface.UV).xyz;
+    if (hdrEnvironment)
+        surfaceColor = pow(surfaceColor, vec3(2.2));
 
-    vec3 F = vec3(pow(1.0 - NdotV, 5.0));
-    F *= (1.0 - F0);
-    F += F0;
+    // N is in tangent coordinates, with or without perturbation (bump mapping)
+    return DiffuseLighting(wTBNt * surface.N, surfaceColor);
+}
 
-    // compose all of the contributions
-    vec3 specular = convolutedColor * (F * envBRDF.x + envBRDF.y); // envBRDF.x is size, envBRDF.y is bias
+// realtime environment lookup, preprocessed BRDF integral and half-vector
+SUBROUTINE(specular_model)
+vec3 Specular_Irradiance(SurfaceContext surface)
+{
+    return SpecularLighting(surface.V, surface.N, surface.T, surface.B, wTBNt, surface.wRdx, surface.wRdy, objectShininess, objectF0, false);
+}
 
-    return specular;
+// the same integration, with filtered importance sampling: the same quality with much fewer samples
+SUBROUTINE(specular_model)
+vec3 Specular_Filtered(SurfaceContext surface)
+{
+    return SpecularLighting(surface.V, surface.N, surface.T, surface.B, wTBNt, surface.wRdx, surface.wRdy, objectShininess, objectF0, true);
 }
 
-subroutine(displacement)
+SUBROUTINE(displacement)
 vec2 ParallaxMapping(vec2 texCoords, vec3 viewDir)
 { 
     // number of depth layers
@@ -217,14 +424,14 @@ vec2 ParallaxMapping(vec2 texCoords, vec3 viewDir)
   
     // get initial values
     vec2  currentTexCoords     = texCoords;
-    float currentDepthMapValue = texture(depthMap, currentTexCoords).r;
+    float currentDepthMapValue = DisplacementMap(DEPTH_MAP, currentTexCoords).r;
       
     while(currentLayerDepth < currentDepthMapValue)
     {
         // shift texture coordinates along direction of P
         currentTexCoords -= deltaTexCoords;
         // get depthmap value at current texture coordinates
-        currentDepthMapValue = texture(depthMap, currentTexCoords).r;  
+        currentDepthMapValue = DisplacementMap(DEPTH_MAP, currentTexCoords).r;  
         // get depth of next layer
         currentLayerDepth += layerDepth;  
     }
@@ -234,31 +441,177 @@ vec2 ParallaxMapping(vec2 texCoords, vec3 viewDir)
 
     // get depth after and before collision for linear interpolation
     float afterDepth  = currentDepthMapValue - currentLayerDepth;
-    float beforeDepth = texture(depthMap, prevTexCoords).r - currentLayerDepth + layerDepth;
+    float beforeDepth = DisplacementMap(DEPTH_MAP, prevTexCoords).r - currentLayerDepth + layerDepth;
  
     // interpolation of texture coordinates
     float weight = afterDepth / (afterDepth - beforeDepth);
     vec2 finalTexCoords = prevTexCoords * weight + currentTexCoords * (1.0 - weight);
+    // the same interpolation between the depths of the two layers
+    displacementDepth = currentLayerDepth - weight * layerDepth;
 
     return finalTexCoords;
 }
 
-subroutine(normal_map)
+// relaxed cone step mapping: the ray steps by the distance to the border of the cone of the texel under it (CONE_MAP, built by
+// coneStepMapping.cpp), which it can cross at most once inside the solid: the intersection lies between the last two steps.
+// The cone map stores also the depth, so each step is one fetch. The stepping stops inside the solid, or on the surface within the
+// precision of the depth map; then a few bisections and the linear interpolation of ParallaxMapping. Where the cones are narrow
+// (next to steep walls, or at grazing angles), the steps are at least minConeStep: the ray goes on until it crosses into the solid
+SUBROUTINE(displacement)
+vec2 ConeStepMapping(vec2 texCoords, vec3 viewDir)
+{
+    const int maxConeSteps = 16;
+    const int binarySteps = 2;
+    const float minConeStep = 1.0 / 255.0;
+    const float depthPrecision = 0.5 / 255.0;
+    // the ray in the (UV, depth) space of the cone map, for each unit of depth (the same of vector P of ParallaxMapping)
+    vec3 ray = vec3(-viewDir.xy / viewDir.z * heightScale, 1.0);
+    float rayRatio = length(ray.xy);
+
+    // the current position and the previous one, with their heights over the surface (negative inside the solid)
+    vec3 position = vec3(texCoords, 0.0), previous = position;
+    float height = 0.0, previousHeight = 0.0;
+    for (int i = 0; i < maxConeSteps; i++)
+    {
+        vec2 cone = DisplacementMap(CONE_MAP, position.xy).rg;
+        height = cone.r - position.z;
+        if (height < depthPrecision)
+            break;
+        // the square root of the ratio is stored
+        float coneRatio = cone.g * cone.g * MAX_CONE_RATIO;
+        float coneStep = max(coneRatio * height / (rayRatio + coneRatio), minConeStep);
+        previous = position;
+        previousHeight = height;
+        position += ray * coneStep;
+    }
+
+    // the ray is inside the solid: the intersection is between the previous position and the current one
+    for (int i = 0; i < binarySteps && height < 0.0; i++)
+    {
+        vec3 middle = 0.5 * (previous + position);
+        float middleHeight = DisplacementMap(CONE_MAP, middle.xy).r - middle.z;
+        if (middleHeight < 0.0)
+        {
+            position = middle;
+            height = middleHeight;
+        }
+        else
+        {
+            previous = middle;
+            previousHeight = middleHeight;
+        }
+    }
+    if (height < 0.0)
+        position = mix(previous, position, previousHeight / (previousHeight - height));
+    displacementDepth = position.z;
+
+    return position.xy;
+}
+
+// the minimum depth of a node of the min-depth quadtree of the depth map (QUADTREE_MAP, built by depthQuadtree.cpp), in a map of
+// size x size texels. The cells of level 0 are the bilinear patches between the centers of 2x2 texels: their minimum is computed from
+// the depth map, with a single textureGather. Level k (from 1) is stored in row 0 of the quadtree map, from column size - 2 * (size >> k)
+float QuadtreeNode(int level, ivec2 node, int size)
+{
+    int layer = objectMaterial * NUM_MATERIAL_MAPS;
+    // the quadtree tiles like the maps
+    int nodes = size >> level;
+    node = (node % nodes + nodes) % nodes;
+    if (level == 0)
+    {
+        // the sample point between the 4 texels of the patch
+        vec4 corners = textureGather(materialMaps, vec3((vec2(node) + 1.0) / float(size), float(layer + DEPTH_MAP)));
+        return min(min(corners.x, corners.y), min(corners.z, corners.w));
+    }
+    return texelFetch(materialMaps, ivec3(size - 2 * nodes + node.x, node.y, layer + QUADTREE_MAP), 0).r;
+}
+
+// quadtree displacement mapping: hierarchical traversal of the min-depth quadtree. The ray skips each node whose minimum depth
+// it does not reach before leaving the node, and it goes one level up for the next one; otherwise it moves down to the top of the node,
+// and one level down. In a cell of level 0, it crosses the bilinear patch if it is under the depth map where it leaves the cell
+// (linear interpolation of the heights, as in ParallaxMapping). The number of fetches grows with the logarithm of the distance
+// covered by the ray, instead of linearly as the layers of ParallaxMapping.
+// The depth map is read at level 0, as the quadtree is built from it
+SUBROUTINE(displacement)
+vec2 QuadtreeDisplacementMapping(vec2 texCoords, vec3 viewDir)
+{
+    const int maxIterations = 64;
+    // the nudge across the border of a cell, in cells of level 0
+    const float crossing = 0.001;
+    int size = textureSize(materialMaps, 0).x;
+    int topLevel = findMSB(size);
+    float depthLayer = float(objectMaterial * NUM_MATERIAL_MAPS + DEPTH_MAP);
+
+    // the ray in cells of level 0 (texel centers at integer coordinates), for each unit of depth (vector P of ParallaxMapping)
+    vec3 ray = vec3(-viewDir.xy / viewDir.z * heightScale * float(size), 1.0);
+    vec2 rayLength = max(abs(ray.xy), vec2(1e-6));
+    vec3 position = vec3(texCoords * float(size) - 0.5, 0.0);
+
+    // the whole ray, down to depth 1, lies in at most 2x2 nodes of the first level whose cells are longer than it
+    int level = min(findMSB(int(max(rayLength.x, rayLength.y))) + 1, topLevel);
+    for (int i = 0; i < maxIterations && level >= 0; i++)
+    {
+        float cellSize = float(1 << level);
+        vec2 cell = floor(position.xy / cellSize);
+        float nodeDepth = QuadtreeNode(level, ivec2(cell), size);
+        // the depth at which the ray leaves the cell
+        vec2 border = (cell + step(0.0, ray.xy)) * cellSize;
+        vec2 borderDistance = abs(border - position.xy) / rayLength;
+        float exitDepth = position.z + min(borderDistance.x, borderDistance.y);
+
+        if (position.z < nodeDepth)
+        {
+            // the ray leaves the node above its minimum depth: the next node, one level up
+            if (exitDepth <= nodeDepth)
+            {
+                position += ray * (exitDepth - position.z);
+                position.xy += sign(ray.xy) * crossing;
+                level = min(level + 1, topLevel);
+                continue;
+            }
+            position += ray * (nodeDepth - position.z);
+        }
+        if (level > 0)
+        {
+            level--;
+            continue;
+        }
+
+        // the ray is inside the bounds of a bilinear patch: it crosses the surface if it is under it at the border of the cell
+        float height = textureLod(materialMaps, vec3((position.xy + 0.5) / float(size), depthLayer), 0.0).r - position.z;
+        vec3 exitPosition = position + ray * (exitDepth - position.z);
+        float exitHeight = textureLod(materialMaps, vec3((exitPosition.xy + 0.5) / float(size), depthLayer), 0.0).r - exitPosition.z;
+        if (exitHeight <= 0.0)
+        {
+            if (height > 0.0)
+                position = mix(position, exitPosition, height / (height - exitHeight));
+            break;
+        }
+        position = exitPosition;
+        position.xy += sign(ray.xy) * crossing;
+        level = min(1, topLevel);
+    }
+    displacementDepth = position.z;
+
+    return (position.xy + 0.5) / float(size);
+}
+
+SUBROUTINE(normal_map)
 vec3 Off_N(vec2 final_UV)
 {
     return vec3(0.0, 0.0, 1.0);
 }
 
-subroutine(normal_map)
+SUBROUTINE(normal_map)
 vec3 NormalMapping(vec2 final_UV)
 {
-    return 2.0 * texture(normMap, final_UV).xyz - 1.0;
+    return 2.0 * MaterialMap(NORMAL_MAP, final_UV).xyz - 1.0;
 }
 
-subroutine(normal_map)
+SUBROUTINE(normal_map)
 vec3 QuaternionMap_N(vec2 final_UV)
 {
-    vec3 q = 2.0 * texture(quaternionMap, final_UV).xyz - 1.0;
+    vec3 q = 2.0 * MaterialMap(QUATERNION_MAP, final_UV).xyz - 1.0;
     float a = q.x;
     float b = q.y;
     float c = q.z;
@@ -266,23 +619,23 @@ vec3 QuaternionMap_N(vec2 final_UV)
     return vec3(-2.0*a*c, 2.0*a*b, a*a - b*b - c*c);
 }
 
-subroutine(tangent_map)
+SUBROUTINE(tangent_map)
 vec3 Off_T(vec2 final_UV)
 {
     return vec3(1.0, 0.0, 0.0);
 }
 
-subroutine(tangent_map)
+SUBROUTINE(tangent_map)
 vec3 RotationMap_T(vec2 final_UV)
 {
-    vec2 V = 2.0 * texture(rotationMap, final_UV).xy - 1.0;
+    vec2 V = 2.0 * MaterialMap(ROTATION_MAP, final_UV).xy - 1.0;
     return vec3(V.x, V.y, 0.0);
 }
 
-subroutine(tangent_map)
+SUBROUTINE(tangent_map)
 vec3 QuaternionMap_T(vec2 final_UV)
 {
-    vec3 q = 2.0 * texture(quaternionMap, final_UV).xyz - 1.0;
+    vec3 q = 2.0 * MaterialMap(QUATERNION_MAP, final_UV).xyz - 1.0;
     float a = q.x;
     float b = q.y;
     float c = q.z;
@@ -290,11 +643,11 @@ vec3 QuaternionMap_T(vec2 final_UV)
     return vec3(a*a + b*b - c*c, 2.0*b*c, 2.0*a*c);
 }
 
-subroutine(tangent_map)
+SUBROUTINE(tangent_map)
 vec3 QuatAndRotMap_T(vec2 final_UV)
 {
-    vec2 V = 2.0 * texture(rotationMap, final_UV).xy - 1.0;
-    vec3 q = 2.0 * texture(quaternionMap, final_UV).xyz - 1.0;
+    vec2 V = 2.0 * MaterialMap(ROTATION_MAP, final_UV).xy - 1.0;
+    vec3 q = 2.0 * MaterialMap(QUATERNION_MAP, final_UV).xyz - 1.0;
     float a = q.x;
     float b = q.y;
     float c = q.z;
@@ -302,23 +655,23 @@ vec3 QuatAndRotMap_T(vec2 final_UV)
     return V.x * vec3(a*a + b*b - c*c, 2.0*b*c, 2.0*a*c) + V.y * vec3(2.0*b*c, a*a - b*b + c*c, -2.0*a*b);
 }
 
-subroutine(bitangent_map)
+SUBROUTINE(bitangent_map)
 vec3 Off_B(vec2 final_UV)
 {
     return vec3(0.0, 1.0, 0.0);
 }
 
-subroutine(bitangent_map)
+SUBROUTINE(bitangent_map)
 vec3 RotationMap_B(vec2 final_UV)
 {
-    vec2 V = 2.0 * texture(rotationMap, final_UV).xy - 1.0;
+    vec2 V = 2.0 * MaterialMap(ROTATION_MAP, final_UV).xy - 1.0;
     return vec3(-V.y, V.x, 0.0);
 }
 
-subroutine(bitangent_map)
+SUBROUTINE(bitangent_map)
 vec3 QuaternionMap_B(vec2 final_UV)
 {
-    vec3 q = 2.0 * texture(quaternionMap, final_UV).xyz - 1.0;
+    vec3 q = 2.0 * MaterialMap(QUATERNION_MAP, final_UV).xyz - 1.0;
     float a = q.x;
     float b = q.y;
     float c = q.z;
@@ -326,11 +679,11 @@ vec3 QuaternionMap_B(vec2 final_UV)
     return vec3(2.0*b*c, a*a - b*b + c*c, -2.0*a*b);
 }
 
-subroutine(bitangent_map)
+SUBROUTINE(bitangent_map)
 vec3 QuatAndRotMap_B(vec2 final_UV)
 {
-    vec2 V = 2.0 * texture(rotationMap, final_UV).xy - 1.0;
-    vec3 q = 2.0 * texture(quaternionMap, final_UV).xyz - 1.0;
+    vec2 V = 2.0 * MaterialMap(ROTATION_MAP, final_UV).xy - 1.0;
+    vec3 q = 2.0 * MaterialMap(QUATERNION_MAP, final_UV).xyz - 1.0;
     float a = q.x;
     float b = q.y;
     float c = q.z;
@@ -338,33 +691,424 @@ vec3 QuatAndRotMap_B(vec2 final_UV)
     return -V.y * vec3(a*a + b*b - c*c, 2.0*b*c, 2.0*a*c) + V.x * vec3(2.0*b*c, a*a - b*b + c*c, -2.0*a*b);
 }
 
+#ifdef DEPTH_PREPASS
+// the color outputs are masked: only the depth is written
 void main(void)
 {
-    // we determine UVs based on wrapping (repeat) and displacement
+#ifdef PARALLAX_DEPTH
     vec3 V = normalize(tViewDirection);
-    vec2 disp_UV = Displacement(mod(interp_UV*repeat, 1.0), V);
-    vec2 final_UV = mod(disp_UV, 1.0);
+    DisplacedUV(V);
+    gl_FragDepth = ParallaxDepth(V);
+#endif
+}
 
-    // determine N for Fresnel reflectance calculation (in tangent space)
-    vec3 N = normalize(Normal_Map(final_UV));
+#else
+
+void main(void)
+{
+    SurfaceContext surface = BuildSurface();
+    vec3 V = surface.V;
+    vec2 final_UV = surface.UV;
+#ifdef PARALLAX_DEPTH
+    // the same depth of the pre-pass, for the equal depth test
+    gl_FragDepth = ParallaxDepth(V);
+#endif
 
+    // determine N for Fresnel reflectance calculation (in tangent space)
+    vec3 N = normalize(surface.N);
+
+#ifdef GBUFFER_PASS
+    // the frame is stored in world coordinates, and orthonormal: T is orthogonalized against N, and the shading pass uses B = cross(N, T)
+    // (the same orientation of the frames of the maps)
+    vec3 wN = normalize(wTBNt * N);
+    vec3 wT = wTBNt * surface.T;
+    wT = normalize(wT - dot(wT, wN) * wN);
+    frameFrag = 0.5 * vec4(EncodeOctahedron(wN), EncodeOctahedron(wT)) + 0.5;
+
+    // the maps are read here, with the derivatives of the triangle: the shading pass does not need the UVs
+    materialFrag = vec4(MaterialMap(ALBEDO_MAP, final_UV).xyz, MaterialMap(AO_MAP, final_UV).x);
+    surfaceFrag = vec4(objectF0, float(objectShininess) / 65535.0);
+#else
     // look up metalness and ambient occlusion
-    float metallic = texture(metallicMap, final_UV).x;
-    float ao = texture(aoMap, final_UV).x;
+    float metallic = MaterialMap(METALLIC_MAP, final_UV).x;
+    float ao = MaterialMap(AO_MAP, final_UV).x;
 
     vec3 F = vec3(pow(1.0 - dot(V, N), 5.0));
-    F *= (1.0 - F0);
-    F += F0;
+    F *= (1.0 - objectF0);
+    F += objectF0;
 
     // ks + kd = 1.0, and we have ks = F
     vec3 kd = 1.0 - F;
 
     // notice ks = F is already included in Specular() calculations
-    vec3 color = (kd * Diffuse() + Specular()) * ao;
+    vec3 color = (kd * Diffuse(surface) + Specular(surface)) * ao;
 
-    colorFrag = vec4(color, 1.0);
+    colorFrag = vec4(OutputColor(color), 1.0);
+#endif // GBUFFER_PASS
+    velocityFrag = 0.5 * (currentClip.xy / currentClip.w - previousClip.xy / previousClip.w);
 }
+#endif // DEPTH_PREPASS
+
+#else // DEFERRED_SHADING
 
+// the surface stored in a pixel of the G-buffer
+struct GBufferSample
+{
+    float depth;
+    // position in world coordinates, reconstructed from the depth
+    vec3 position;
+    // tangent frame in world coordinates
+    vec3 N, T, B;
+    // albedo (linear with HDR cube maps) and ambient occlusion
+    vec3 albedo;
+    float ao;
+    vec3 F0;
+    int shininess;
+};
+
+// in the deferred passes, the "tangent space" of the lighting is the world space
+GBufferSample ReadGBuffer(ivec2 pixel)
+{
+    GBufferSample g;
+    g.depth = texelFetch(gDepth, pixel, 0).r;
+    vec4 ndc = vec4(2.0 * (vec2(pixel) + 0.5) / vec2(textureSize(gDepth, 0)) - 1.0, 2.0 * g.depth - 1.0, 1.0);
+    vec4 wPosition = inverseViewProjection * ndc;
+    g.position = wPosition.xyz / wPosition.w;
+
+    vec4 frame = 2.0 * texelFetch(gFrame, pixel, 0) - 1.0;
+    g.N = DecodeOctahedron(frame.xy);
+    g.T = DecodeOctahedron(frame.zw);
+    g.B = cross(g.N, g.T);
+
+    vec4 material = texelFetch(gMaterial, pixel, 0);
+    g.albedo = hdrEnvironment ? pow(material.rgb, vec3(2.2)) : material.rgb;
+    g.ao = material.a;
+    vec4 surface = texelFetch(gSurface, pixel, 0);
+    g.F0 = surface.rgb;
+    g.shininess = int(round(surface.a * 65535.0));
+    return g;
+}
+
+// LOW RESOLUTION SPECULAR
+// the pixel of the G-buffer which represents a pixel of the low resolution target: the center of its block
+ivec2 SpecularSamplePixel(ivec2 lowResPixel)
+{
+    return min(lowResPixel * specularDownsample + specularDownsample / 2, textureSize(gDepth, 0) - 1);
+}
+
+// joint bilateral upsampling (Kopf et al. 2007): the 4 nearest samples of the low resolution target are blended with their bilinear weights,
+// multiplied by the similarity of their surface (distance from the camera and normal) with the one of the pixel,
+// so that the specular term does not leak across the silhouettes and the creases.
+// Returns false if none of the samples is compatible with the pixel (e.g. thin objects, missed by the low resolution target)
+bool UpsampleSpecular(ivec2 pixel, GBufferSample g, out vec3 specular)
+{
+    vec2 lowResPosition = (vec2(pixel) + 0.5) / float(specularDownsample) - 0.5;
+    ivec2 base = ivec2(floor(lowResPosition));
+    vec2 f = lowResPosition - vec2(base);
+    float pixelDistance = length(wCamera.xyz - g.position);
+
+    vec4 weightedSum = vec4(0.0);
+    float totalWeight = 0.0;
+    for (int i = 0; i < 4; i++)
+    {
+        ivec2 offset = ivec2(i & 1, i >> 1);
+        ivec2 lowResPixel = clamp(base + offset, ivec2(0), textureSize(lowResSpecular, 0) - 1);
+        GBufferSample s = ReadGBuffer(SpecularSamplePixel(lowResPixel));
+        vec2 bilinear = mix(1.0 - f, f, vec2(offset));
+        // the tolerance on the distance grows with the distance, as the depth of the neighbouring pixels of a surface
+        float depthWeight = exp(-abs(length(wCamera.xyz - s.position) - pixelDistance) / (BILATERAL_DEPTH_TOLERANCE * pixelDistance));
+        float normalWeight = pow(max(dot(s.N, g.N), 0.0), BILATERAL_NORMAL_POWER);
+        float weight = s.depth == 1.0 ? 0.0 : bilinear.x * bilinear.y * depthWeight * normalWeight;
+        weightedSum += weight * texelFetch(lowResSpecular, lowResPixel, 0);
+        totalWeight += weight;
+    }
+    if (totalWeight < 1e-3)
+        return false;
+
+    weightedSum /= totalWeight;
+    specular = weightedSum.rgb;
+    usedSamples = uint(round(weightedSum.a));
+    return true;
+}
+
+#ifdef SPECULAR_PASS
+// the specular term of the surface represented by each pixel of the low resolution target (see SpecularSamplePixel).
+// The alpha channel is the number of samples, for the debug view of the adaptive sampling
+void main(void)
+{
+    GBufferSample g = ReadGBuffer(SpecularSamplePixel(ivec2(gl_FragCoord.xy)));
+    vec3 V = normalize(wCamera.xyz - g.position);
+    // before the return of the background pixels
+    vec3 wRdx, wRdy;
+    ReflectionDerivatives(V, g.N, mat3(1.0), wRdx, wRdy);
+    if (g.depth == 1.0)
+    {
+        colorFrag = vec4(0.0);
+        return;
+    }
+    colorFrag = vec4(SpecularLighting(V, g.N, g.T, g.B, mat3(1.0), wRdx, wRdy, g.shininess, g.F0, filteredSampling), float(usedSamples));
+}
+
+#else
+
+void main(void)
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    GBufferSample g = ReadGBuffer(pixel);
+    vec3 V = normalize(wCamera.xyz - g.position);
+    // before the discard of the background pixels, and before the choice between upsampling and integration
+    vec3 wRdx, wRdy;
+    ReflectionDerivatives(V, g.N, mat3(1.0), wRdx, wRdy);
+    // no object in the pixel: the background is drawn by the skybox
+    if (g.depth == 1.0)
+        discard;
+
+    vec3 F = vec3(pow(1.0 - dot(V, g.N), 5.0));
+    F *= (1.0 - g.F0);
+    F += g.F0;
+    vec3 kd = 1.0 - F;
+
+    // the specular term is upsampled from the low resolution target, or integrated for the pixel
+    vec3 specular;
+    if (specularDownsample <= 1 || !UpsampleSpecular(pixel, g, specular))
+        specular = SpecularLighting(V, g.N, g.T, g.B, mat3(1.0), wRdx, wRdy, g.shininess, g.F0, filteredSampling);
+
+    vec3 color = (kd * DiffuseLighting(g.N, g.albedo) + specular) * g.ao;
+
+    colorFrag = vec4(OutputColor(color), 1.0);
+    velocityFrag = texelFetch(gVelocity, pixel, 0).xy;
+    // the depth of the objects is written in the framebuffer of the frame, for the depth test of the skybox
+    gl_FragDepth = g.depth;
+}
+#endif // SPECULAR_PASS
+#endif // DEFERRED_SHADING
+
+
+////////////////////////////////////////////////////////////////////
+// Sample providers
+// the half vector is in tangent space (xyz, before the perturbation of the tangent frame), w is its pdf without the normalization constant
+
+// the RGBA LUTs built by halfVectorSampling.cpp: a dependent fetch, with 8 bits per component
+SUBROUTINE(sample_provider)
+vec4 LUT_Samples(vec2 Xi, uint i, uint samples, int shininess)
+{
+    return 2.0 * textureLod(halfVector, vec3(Xi, float(shininess)), 0.0) - 1.0;
+}
+
+// the closed form of the Ashikhmin-Shirley importance sampling, in full precision
+vec4 AshikhminHalfVector(vec2 Xi, int shininess)
+{
+    vec2 n = shininessPairs[shininess];
+    // halfVectorSampling.cpp maps u quadrant by quadrant (AshikhminPhi): the result is the angle of atan(sqrt((nU + 1) / (nV + 1)) * tan(2 PI u))
+    // in the quadrant of 2 PI u, so its cosine and sine are the ones of the direction (cos(2 PI u), sqrt((nU + 1) / (nV + 1)) * sin(2 PI u))
+    vec2 phi = normalize(vec2(cos(2.0 * PI * Xi.x), sqrt((n.x + 1.0) / (n.y + 1.0)) * sin(2.0 * PI * Xi.x)));
+    float exponent = n.x * phi.x * phi.x + n.y * phi.y * phi.y;
+    // AshikhminCosTheta
+    float cosTheta = pow(1.0 - Xi.y, 1.0 / (exponent + 1.0));
+    float sinTheta = sqrt(max(1.0 - cosTheta * cosTheta, 0.0));
+    return vec4(sinTheta * phi, cosTheta, pow(cosTheta, exponent));
+}
+
+SUBROUTINE(sample_provider)
+vec4 Analytic_Samples(vec2 Xi, uint i, uint samples, int shininess)
+{
+    return AshikhminHalfVector(Xi, shininess);
+}
+
+// the table of the Hammersley points of the sample count: the points are the same for all of the fragments only without
+// adaptive sampling (which moves them) and temporal accumulation (which rotates them). Otherwise we use the closed form
+SUBROUTINE(sample_provider)
+vec4 Table_Samples(vec2 Xi, uint i, uint samples, int shininess)
+{
+    if (samples != tableSampleCount || adaptiveSampling || temporalSampling)
+        return AshikhminHalfVector(Xi, shininess);
+    return tableSamples[uint(shininess) * samples + i];
+}
+
+////////////////////////////////////////////////////////////////////
+// Lighting
+
+// division by PI is done in the convolution resulting in the irradiance map
+vec3 DiffuseLighting(vec3 wN, vec3 albedo)
+{
+    vec3 irradiance = texture(irradianceMap, wN).xyz;
+    return irradiance*albedo;
+}
+
+void ReflectionDerivatives(vec3 V, vec3 N, mat3 toWorld, out vec3 wRdx, out vec3 wRdy)
+{
+    vec3 wR = toWorld * reflect(-V, N);
+    wRdx = dFdx(wR);
+    wRdy = dFdy(wR);
+}
+
+// realtime environment lookup, preprocessed BRDF integral and half-vector (see Specular_Irradiance)
+vec3 SpecularLighting(vec3 V, vec3 N, vec3 T, vec3 B, mat3 toWorld, vec3 wRdx, vec3 wRdy, int shininess, vec3 F0, bool filtered)
+{
+    // 1): sample and integrate the environment map
+
+    /*
+    The original article by Epic Games introduces this approximation to preprocess the prefiltered map (not knowing in advance the value of V):
+    vec3 R = N; // reflected vector
+    vec3 V = R; // view vector
+
+    Since we can't preprocess, we might as well use the actual value of V! (R is not needed in this instance)
+    */
+
+    uint samples = adaptiveSampling ? AdaptiveSampleCount(V, N, wRdx, wRdy, shininess) : sampleCount;
+    usedSamples = samples;
+    vec2 rotation = temporalSampling ? SampleRotation() : vec2(0.0);
+    // the rotated samples change from pixel to pixel, so the implicit derivatives of the lookups would select the coarsest mip levels:
+    // the LUT is read at its base level, and the environment map with the derivatives of the reflection vector
+    // filtered importance sampling: normalization of the half-vector pdf stored in the LUT, and solid angle of the samples
+    // relative to the solid angle of a texel at the center of a face of the base level
+    vec2 n = shininessPairs[shininess];
+    float pdfNormalization = sqrt((n.x + 1.0) * (n.y + 1.0)) / (2.0 * PI);
+    float texelSize = float(textureSize(environmentMap, 0).x);
+    float sampleSolidAngle = texelSize * texelSize / (4.0 * float(samples));
+
+    float totalWeight = 0.0;
+    vec3 convolutedColor = vec3(0.0);  
+    for (uint i = 0u; i < samples; i++)
+    {
+        // low discrepancy sequence on the unit square
+        vec2 Xi = Hammersley(i, samples);
+        // with few samples the first points of the sequence (at the corner of the square) bias the estimate: we center them in their cells
+        if (adaptiveSampling)
+            Xi = fract(Xi + 0.5 / float(samples));
+        Xi = fract(Xi + rotation);
+
+        // H, V and L are all in tangent space
+
+        // mapping the square to the upper hemisphere (see SAMPLE PROVIDERS)
+        vec4 halfVectorSample = Sample_Provider(Xi, i, samples, shininess);
+        vec3 H = halfVectorSample.xyz;
+        // H should be perturbed along with the tangent space (the distribution is centered on the perturbed normal and rotated along the perturbed tangents)
+        H = H.x * T + H.y * B + H.z * N; // this is a matrix multiplication. Notice it maps tangent space to tangent space (it is an endomorphism)
+
+        // calculate L as the reflection of V against H
+        vec3 L = normalize(2.0 * dot(V, H) * H - V);
+
+        float NdotL = max(dot(N, L), 0.0);
+        if(NdotL > 0.0)
+        {
+            // map the light direction to world coordinates, usign the TBN matrix interpolated during rasterization
+            vec3 wL = toWorld * L;
+
+            // look-up of the environment map along the (world) light direction
+            vec3 radiance;
+            if (filtered)
+            {
+                // the LUT stores the pdf of H without its normalization, with 8 bits: we clamp it to the smallest value it can represent.
+                // The pdf of L is the pdf of H divided by the jacobian of the reflection, 4 * VdotH
+                float pdf = pdfNormalization * max(halfVectorSample.w, 1.0 / 255.0) / (4.0 * max(dot(V, H), 1e-4));
+                // solid angle of a texel along wL: at the center of a face it is 4 / texelSize^2, and it shrinks with the cube of the major axis
+                vec3 absL = abs(wL);
+                float majorAxis = max(absL.x, max(absL.y, absL.z)) / length(wL);
+                float lod = max(0.5 * log2(sampleSolidAngle / (pdf * majorAxis * majorAxis * majorAxis)) + FILTERED_LOD_BIAS, 0.0);
+                radiance = textureLod(environmentMap, wL, lod).rgb;
+            }
+            else
+                radiance = temporalSampling ? textureGrad(environmentMap, wL, wRdx, wRdy).rgb : texture(environmentMap, wL).rgb;
+            convolutedColor += radiance * NdotL; // NdotL is the weight of the Monte-Carlo integration
+            totalWeight += NdotL;
+        }
+    }
+    convolutedColor = convolutedColor / totalWeight;
+
+    // 2): calculate the resulting specular component, using the preprocessed BRDF integral
+
+    // the BRDF has rectangular symmetry along the tangent and bitangent
+    // this means it is enough to calculate it assuming V is in the first quadrant of the tangent plane, as H is instead mapped to all of the quadrants (and only their relative position, regardless of simmetry, matters)
+    // this improves memory management by a factor of 4 at the same resolution
+    float absTdotV = abs(dot(T, V));
+    float absBdotV = abs(dot(B, V));
+    float NdotV = clamp(dot(V, N), 0.0, 1.0); // avoid raising a negative base
+
+    // Phi is the angle between T and V (projected onto the tangent plane). It ranges in [0, PI/2]
+    // I remap it to [0,1] by multiplying it by 2/PI
+    float normalizedPhi = absTdotV == 0.0 ? 1.0 : 2.0 * atan(absBdotV, absTdotV) / PI; // GLSL atan(y,x) is undefined for x==0; I fix the image for that value
+    
+    // look up size and bias coefficients from the BRDF LUT
+    vec2 envBRDF  = texture( brdfLUT, vec3(normalizedPhi, sqrt(NdotV), float(shininess)) ).rg;
+
+    vec3 F = vec3(pow(1.0 - NdotV, 5.0));
+    F *= (1.0 - F0);
+    F += F0;
+
+    // compose all of the contributions
+    vec3 specular = convolutedColor * (F * envBRDF.x + envBRDF.y); // envBRDF.x is size, envBRDF.y is bias
+
+    return specular;
+}
+
+vec3 OutputColor(vec3 color)
+{
+    // HDR tonemap and gamma correct (same as the skybox)
+    if (hdrEnvironment)
+    {
+        color = color / (color + vec3(1.0));
+        color = pow(color, vec3(1.0/2.2));
+    }
+
+    // debug view of the adaptive sampling (black if the specular component doesn't use samples)
+    if (sampleCountView)
+    {
+        float t = usedSamples == 0u ? 0.0 : float(usedSamples) / float(sampleCount);
+        color = usedSamples == 0u ? vec3(0.0) : clamp(vec3(2.0 * t - 0.5, 1.0 - 2.0 * abs(t - 0.5), 1.5 - 2.0 * t), 0.0, 1.0);
+    }
+
+    return color;
+}
+
+////////////////////////////////////////////////////////////////////
+
+// Adaptive number of samples
+
+// The samples are spent where the integral is hard to estimate:
+// - the lobe of the Ashikhmin-Shirley distribution is about 1/sqrt(n + 1) radians wide along each tangent direction: the wider it is, the more samples
+// - at grazing angles the reflected lobe is stretched along the tangent (the Jacobian of the reflection grows as 1/NdotV)
+// - the reflected directions change across the pixel (screen-space derivatives, which include the detail of the normal map):
+//   neighbouring pixels already cover the lobe in steps of that size. The footprint is never smaller than LOBE_RESOLUTION,
+//   the angular size of the environment features we want to resolve
+// The estimate is the widest extent of the lobe in units of the footprint, clamped to [1, sampleCount]
+const float LOBE_RESOLUTION = 0.05;
+uint AdaptiveSampleCount(vec3 V, vec3 N, vec3 wRdx, vec3 wRdy, int shininess)
+{
+    vec2 width = inversesqrt(shininessPairs[shininess] + 1.0);
+    float NdotV = clamp(dot(N, V), 0.0, 1.0);
+    float stretch = 1.0 / max(NdotV, 0.1);
+
+    // the spread of the reflection vector across the pixel (fwidth)
+    float footprint = max(length(abs(wRdx) + abs(wRdy)), LOBE_RESOLUTION);
+
+    float lobeSamples = adaptiveQuality * max(width.x * stretch, width.y) / footprint;
+    return uint(clamp(ceil(lobeSamples), 1.0, float(sampleCount)));
+}
+
+////////////////////////////////////////////////////////////////////
+
+// Octahedral mapping of unit vectors (Cigolle et al. 2014): the sphere is projected on the octahedron |x| + |y| + |z| = 1,
+// and the lower half is folded over the upper one. Two components are enough, with an almost uniform precision over the sphere
+
+vec2 EncodeOctahedron(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    vec2 e = n.xy;
+    if (n.z < 0.0)
+        e = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return e;
+}
+
+vec3 DecodeOctahedron(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (n.z < 0.0)
+        n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return normalize(n);
+}
+
+////////////////////////////////////////////////////////////////////
 
 // Low discrepancy sequence generation
 
@@ -381,4 +1125,17 @@ float RadicalInverse_VdC(uint bits)
 vec2 Hammersley(uint i, uint N)
 {
     return vec2(float(i)/float(N), RadicalInverse_VdC(i));
+}
+
+// the offset is the sum of:
+// - a per-pixel offset (interleaved gradient noise, Jimenez 2014): neighbouring pixels use different samples in the same frame,
+//   so that the neighbourhood of a pixel spans the error of the estimates (see the clamping in temporal_resolve.frag)
+// - a per-frame offset from the R2 sequence (Roberts 2018), which covers the unit square evenly in consecutive frames
+vec2 SampleRotation()
+{
+    vec2 pixel = gl_FragCoord.xy;
+    float noiseX = fract(52.9829189 * fract(dot(pixel, vec2(0.06711056, 0.00583715))));
+    float noiseY = fract(52.9829189 * fract(dot(pixel + vec2(47.0, 17.0), vec2(0.06711056, 0.00583715))));
+    // (the sequence restarts every 4096 frames, so that the products keep their precision)
+    return fract(vec2(noiseX, noiseY) + float(frameIndex % 4096u) * vec2(0.7548776662, 0.5698402910));
 }  
\ No newline at end of file
@@ -31,6 +31,16 @@ layout (location = 4) in vec3 bitangent;
 // the numbers used for the location in the layout qualifier are the positions of the vertex attribute
 // as defined in the Mesh class
 
+// with instanced rendering, the attributes of the instance replace the uniforms of the object (see InstanceData in the Mesh class)
+layout (location = 5) in mat4 instanceModelMatrix;
+// model matrix of the previous frame
+layout (location = 9) in mat4 instancePreviousModelMatrix;
+layout (location = 13) in vec3 instanceF0;
+layout (location = 14) in vec2 instanceRepeat;
+// index of the material and of the (nU, nV) shininess pair
+layout (location = 15) in ivec2 instanceMaterial;
+uniform bool instanced;
+
 // camera position in model coordinates
 // passing this as a uniform lets me avoid passing the inverse of the view matrix to the vertex shader, since this is enough to let me calculate the view direction in world coordinates
 uniform vec4 wCamera;
@@ -44,8 +54,23 @@ uniform mat4 projectionMatrix;
 
 // normals transformation matrix (= transpose of the inverse of the model matrix)
 // used for tangent, bitangent AND normal
+// (the instances don't have this attribute: their normal matrix is computed from the model matrix)
 uniform mat3 normalMatrix;
 
+// the transformations of the previous frame, for the motion vectors of the temporal accumulation
+uniform mat4 previousModelMatrix;
+uniform mat4 previousViewMatrix;
+uniform mat4 previousProjectionMatrix;
+
+// the parameters of the object, used by the fragment shader
+// texture repetitions
+uniform vec2 repeat;
+// index of the material (layers of the texture array), and index of the (nU, nV) shininess pair (layer of the LUTs)
+uniform int material;
+uniform int shininess;
+// (spectral) fresnel reflectance at normal incidence
+uniform vec3 F0;
+
 // the fragment shader needs to be given the transformation mapping tangent space to world coordinates
 out mat3 wTBNt;
 
@@ -56,12 +81,35 @@ out vec3 tViewDirection;
 // the output variable for UV coordinates
 out vec2 interp_UV;
 
+// the parameters of the object, the same for all of the fragments of the instance
+flat out vec2 objectRepeat;
+flat out int objectMaterial;
+flat out int objectShininess;
+flat out vec3 objectF0;
+
+// the position of the vertex in clip coordinates, in this frame and in the previous one: the fragment shader computes its motion vector
+out vec4 currentClip;
+out vec4 previousClip;
+
+// the depth pre-pass and the shading pass are different Shader Programs, with the same vertex shader:
+// the positions must be computed in the same way, so that the equal depth test of the shading pass succeeds
+invariant gl_Position;
+
 
 void main(){
 
+  // the transformations and the parameters of the object, or of the instance
+  mat4 model = instanced ? instanceModelMatrix : modelMatrix;
+  mat4 previousModel = instanced ? instancePreviousModelMatrix : previousModelMatrix;
+  mat3 normalModel = instanced ? transpose(inverse(mat3(instanceModelMatrix))) : normalMatrix;
+  objectRepeat = instanced ? instanceRepeat : repeat;
+  objectMaterial = instanced ? instanceMaterial.x : material;
+  objectShininess = instanced ? instanceMaterial.y : shininess;
+  objectF0 = instanced ? instanceF0 : F0;
+
   // Normal, tangent and bitangent (in world coordinates) are used to create the TBN matrix, which maps tangent space to world (model) space
-  vec3 T = normalize( normalMatrix * tangent );
-  vec3 N = normalize( normalMatrix * normal );
+  vec3 T = normalize( normalModel * tangent );
+  vec3 N = normalize( normalModel * normal );
   // Apply Gram-Schmidt to T, B, N. It is vital for the TBN matrix to be orthogonal
   T = normalize(T - dot(T, N) * N);
   vec3 B = cross(N,T); // cross(T,N) would invert orientation
@@ -69,7 +117,7 @@ void main(){
   mat3 iTBN = transpose(wTBNt); // inverse of TBN matrix
 
   // vertex position in Model coordinate
-  vec4 wPosition = modelMatrix * vec4( position, 1.0 );
+  vec4 wPosition = model * vec4( position, 1.0 );
   
   // view direction, in world coordinates
   tViewDirection = wCamera.xyz - wPosition.xyz;
@@ -82,4 +130,7 @@ void main(){
   // we apply the view and projection transformations
   gl_Position = projectionMatrix * viewMatrix * wPosition;
 
+  currentClip = gl_Position;
+  previousClip = previousProjectionMatrix * previousViewMatrix * previousModel * vec4( position, 1.0 );
+
 }
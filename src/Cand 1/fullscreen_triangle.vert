@@ -0,0 +1,19 @@
+/*
+fullscreen_triangle.vert: full-screen triangle for the passes which shade each pixel once (temporal accumulation resolve, deferred shading)
+
+N.B.) there are no vertex attributes: the three vertices are generated from gl_VertexID, and the triangle covers the whole viewport
+
+Real-Time Graphics Programming - a.a. 2019/2020
+Master degree in Computer Science
+Universita' degli Studi di Milano
+
+*/
+
+#version 410 core
+
+void main()
+{
+    // (-1,-1), (3,-1), (-1,3)
+    vec2 position = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(2.0 * position - 1.0, 0.0, 1.0);
+}
@@ -1,17 +1,26 @@
 #version 410 core
-out vec4 FragColor;
+layout (location = 0) out vec4 FragColor;
+// motion vector (see env_bump_aniso.frag)
+layout (location = 1) out vec2 Velocity;
 in vec3 WorldPos;
+in vec4 currentClip;
+in vec4 previousClip;
 
 uniform samplerCube environmentMap;
 
+// true if the cube map stores linear HDR radiance
+uniform bool hdrEnvironment;
+
 void main()
 {		
     vec3 envColor = textureLod(environmentMap, WorldPos, 0.0).rgb;
     
     // HDR tonemap and gamma correct
-    /*
-    envColor = envColor / (envColor + vec3(1.0));
-    envColor = pow(envColor, vec3(1.0/2.2)); 
-    */
+    if (hdrEnvironment)
+    {
+        envColor = envColor / (envColor + vec3(1.0));
+        envColor = pow(envColor, vec3(1.0/2.2)); 
+    }
     FragColor = vec4(envColor, 1.0);
+    Velocity = 0.5 * (currentClip.xy / currentClip.w - previousClip.xy / previousClip.w);
 }
\ No newline at end of file
@@ -1,17 +1,27 @@
 #version 410 core
-layout (location = 0) in vec3 aPos;
+// the skybox is a full-screen triangle on the far plane (see fullscreen_triangle.vert), drawn after the objects:
+// the early depth test discards the pixels covered by them. The direction of each vertex is found by unprojecting it
 
-uniform mat4 projection;
-uniform mat4 view;
+// inverse of projection * mat4(mat3(view)) (the rotation of the view)
+uniform mat4 inverseViewProjection;
+// the matrices of the previous frame, for the motion vectors of the temporal accumulation
+uniform mat4 previousProjection;
+uniform mat4 previousView;
 
 out vec3 WorldPos;
+// the direction in clip coordinates, in this frame and in the previous one
+out vec4 currentClip;
+out vec4 previousClip;
 
 void main()
 {
-    WorldPos = aPos;
+    // (-1,-1), (3,-1), (-1,3)
+    vec2 position = 2.0 * vec2((gl_VertexID << 1) & 2, gl_VertexID & 2) - 1.0;
+    // the point on the near plane has the same direction of the one on the far plane, with a better precision
+    vec4 nearPoint = inverseViewProjection * vec4(position, -1.0, 1.0);
+    WorldPos = nearPoint.xyz / nearPoint.w;
 
-	mat4 rotView = mat4(mat3(view));
-	vec4 clipPos = projection * rotView * vec4(WorldPos, 1.0);
-
-	gl_Position = clipPos.xyww;
-}
\ No newline at end of file
+	gl_Position = vec4(position, 1.0, 1.0);
+	currentClip = gl_Position;
+	previousClip = previousProjection * mat4(mat3(previousView)) * vec4(WorldPos, 1.0);
+}
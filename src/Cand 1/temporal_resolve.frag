@@ -0,0 +1,95 @@
+/*
+temporal_resolve.frag: resolve pass of the temporal accumulation
+
+- the color of the current frame is blended into the history, which is the average of the previous frames
+- the history is read at the position of the pixel in the previous frame (the motion vector of the pixel is subtracted from its UV)
+- the history is clamped in the bounding box of the colors of the 3x3 neighbourhood of the pixel in the current frame (in YCoCg space):
+  a history which is not compatible with the current frame (disocclusions, moving reflections, changed parameters) is pulled towards it
+- the alpha channel of the history counts the accumulated frames: the current frame has weight 1 / count, so the history is the
+  average of the frames until historyLength frames are reached, and then an exponential moving average
+- the shaders of the scene output tone mapped colors: the history is the average of the linear colors (the average of the tone mapped
+  estimates would be darker than the tone mapped integral, since the tone mapping is concave), while the neighbourhood is compared
+  in the tone mapped space. The tone mapped history is written in a second output, which is shown on screen
+
+Real-Time Graphics Programming - a.a. 2019/2020
+Master degree in Computer Science
+Universita' degli Studi di Milano
+
+*/
+
+#version 410 core
+
+// the new history (linear colors), and its tone mapped version
+layout (location = 0) out vec4 historyFrag;
+layout (location = 1) out vec4 displayFrag;
+
+// color and motion vectors of the current frame
+uniform sampler2D currentColor;
+uniform sampler2D velocity;
+// the history of the previous frame
+uniform sampler2D history;
+
+// if true, the history is discarded (e.g. in the first frame)
+uniform bool resetHistory;
+// maximum number of accumulated frames
+uniform float historyLength;
+// true if the scene is tone mapped (HDR cube maps, see env_bump_aniso.frag)
+uniform bool hdrEnvironment;
+
+// the tone mapping of the scene, and its inverse
+vec3 ToneMap(vec3 color)
+{
+    return hdrEnvironment ? pow(color / (color + vec3(1.0)), vec3(1.0/2.2)) : color;
+}
+
+vec3 InverseToneMap(vec3 color)
+{
+    // 8 bit white is the limit of the tone mapping: we keep it finite
+    vec3 mapped = min(pow(color, vec3(2.2)), vec3(0.999));
+    return hdrEnvironment ? mapped / (vec3(1.0) - mapped) : color;
+}
+
+vec3 RGBToYCoCg(vec3 color)
+{
+    return vec3(dot(color, vec3(0.25, 0.5, 0.25)), dot(color, vec3(0.5, 0.0, -0.5)), dot(color, vec3(-0.25, 0.5, -0.25)));
+}
+
+vec3 YCoCgToRGB(vec3 color)
+{
+    return vec3(color.x + color.y - color.z, color.x + color.z, color.x - color.y - color.z);
+}
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    ivec2 size = textureSize(currentColor, 0);
+    vec3 current = texelFetch(currentColor, pixel, 0).rgb;
+
+    // the bounding box of the neighbourhood
+    vec3 minColor = RGBToYCoCg(current);
+    vec3 maxColor = minColor;
+    for (int y = -1; y <= 1; y++)
+        for (int x = -1; x <= 1; x++)
+        {
+            vec3 neighbour = RGBToYCoCg(texelFetch(currentColor, clamp(pixel + ivec2(x, y), ivec2(0), size - 1), 0).rgb);
+            minColor = min(minColor, neighbour);
+            maxColor = max(maxColor, neighbour);
+        }
+
+    // position of the pixel in the previous frame: if it was outside of the screen, there is no history
+    vec2 previousUV = (vec2(pixel) + 0.5) / vec2(size) - texelFetch(velocity, pixel, 0).xy;
+    vec3 linearCurrent = InverseToneMap(current);
+    vec3 accumulated = linearCurrent;
+    float count = 0.0;
+    if (!resetHistory && all(greaterThanEqual(previousUV, vec2(0.0))) && all(lessThanEqual(previousUV, vec2(1.0))))
+    {
+        vec4 previous = texture(history, previousUV);
+        accumulated = InverseToneMap(YCoCgToRGB(clamp(RGBToYCoCg(ToneMap(previous.rgb)), minColor, maxColor)));
+        count = previous.a;
+    }
+
+    count = min(count + 1.0, historyLength);
+    vec3 color = mix(accumulated, linearCurrent, 1.0 / count);
+    historyFrag = vec4(color, count);
+    displayFrag = vec4(ToneMap(color), 1.0);
+}
@@ -11,3 +11,5 @@ set cubeLinkerflags=/LIBPATH:../../libs/win glfw3.lib assimp-vc142-mt.lib zlib.l
 cl.exe %compilerflags% %includedirs% brdfIntegration.cpp /Fe:brdfIntegration.exe /link %linkerflags%
 cl.exe %compilerflags% %includedirs% halfVectorSampling.cpp /Fe:halfVectorSampling.exe /link %linkerflags%
 cl.exe %compilerflags% %includedirs% ../../include/glad/glad.c cubeMapping_fromEquirectangular.cpp /Fe:cubeMapping_fromEquirectangular.exe /link %cubeLinkerflags%
+cl.exe %compilerflags% %includedirs% coneStepMapping.cpp /Fe:coneStepMapping.exe /link %linkerflags%
+cl.exe %compilerflags% %includedirs% depthQuadtree.cpp /Fe:depthQuadtree.exe /link %linkerflags%
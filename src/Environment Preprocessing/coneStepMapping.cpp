@@ -0,0 +1,206 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+
+// we load the GLM classes used in the application
+#include <glm/glm.hpp>
+
+// we include the library for images loading
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image/stb_image.h>
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image/stb_image_write.h>
+
+/*
+Relaxed cone step mapping (Policarpo and Oliveira, "Relaxed Cone Stepping for Relief Mapping", GPU Gems 3, chapter 18)
+
+For each texel of the depth map, we compute the widest cone, with the apex on the surface at the texel and opening towards the top
+of the surface (depth 0), such that every view ray which enters the cone from the top and goes into the solid leaves the solid again
+before leaving the cone: then the shader can step along the ray by the distance to the border of the cone of the current texel,
+crossing at most one intersection, and the first intersection lies between the last two steps (where a few bisections find it).
+See ConeStepMapping in env_bump_aniso.frag
+
+- the rays of the map start from the top above the texel (src) and pass through another texel (dst) of the surface: we march the ray
+  from dst until it leaves the solid, and the point where it leaves must not lie inside the cone.
+  The cone ratio is the horizontal distance (in UV units) over the vertical one (in units of depth) from the apex to the border
+- the map tiles like the materials: the distances wrap around the borders of the texture
+- the cone ratios do not depend on heightScale: the displacement uses the same (UV, depth) space of the map
+
+The output (cone.png in the folder of each material) stores the depth in the red channel, with the same 8 bits of the depth map
+when it is loaded in the texture array of the application, and the square root of the cone ratio (over MAX_RATIO) in the green channel
+(more precision for the narrow cones). The shader reads both with a single fetch for each step.
+
+N.B.) the cost of the search is bounded in two ways, which never change the resulting cones:
+  - the texels of a ring at distance r from the texel can only give ratios larger than r / depth, so the search stops when this is
+    larger than the current ratio (or than MAX_RATIO)
+  - along the ray, the ratio given by the exit point grows with the distance from the texel, so the march stops when it is larger
+    than the current ratio
+*/
+
+// -------------- GLOBAL VARIABLES -------------- //
+
+// the folders of the materials (the same of the application)
+const std::vector<std::string> materialFolders = {"hammered_metal", "metal_pattern", "metal_tiles"};
+const std::string texturesFolder = "../../textures/";
+
+// the largest stored ratio (the green channel stores the square root of ratio / MAX_RATIO).
+// The rays of the shader move by |V.xy| / V.z * heightScale in UV for each unit of depth (about 0.02 at the default heightScale):
+// a wider cone would only make the steps a little longer, while the search for the wide cones of the flat regions is the slowest part
+const float MAX_RATIO = 0.125f;
+
+// the depth map of the current material, in [0,1]
+std::vector<float> depth;
+int width, height;
+
+float Depth(int x, int y);
+float BilinearDepth(glm::vec2 texel);
+float ConeRatio(int x, int y);
+
+int main()
+{
+    unsigned int threadCount = glm::max(std::thread::hardware_concurrency(), 1u);
+
+    for (const std::string& folder : materialFolders)
+    {
+        std::string sourcePath = texturesFolder + folder + "/depth.png";
+        std::string fullPath = texturesFolder + folder + "/cone.png";
+
+        // read the depth map (16 bits if available): only the red channel
+        int channels;
+        unsigned short* source = stbi_load_16(sourcePath.c_str(), &width, &height, &channels, STBI_grey);
+        if (source == NULL)
+        {
+            std::cout << "Error in loading the image: there is no texture called"
+                      << std::endl << sourcePath << std::endl;
+            exit(1);
+        }
+        // the application loads the depth maps with 8 bits: we compute the cones of the same surface which the shader sees
+        depth.resize(width * height);
+        for (int l = 0; l < width * height; l++)
+            depth[l] = (float) (source[l] >> 8) / 255.0f;
+        stbi_image_free(source);
+
+        std::cout << "Computing the cone map of " << folder << " (" << width << "x" << height << ", " << threadCount << " threads)" << std::endl;
+
+        // the rows are shared among the threads: each one takes the next row which is not computed yet
+        unsigned char* image = new unsigned char[4 * width * height];
+        std::atomic<int> nextRow(0);
+        std::mutex progressMutex;
+        int completedRows = 0;
+        std::vector<std::thread> threads;
+        for (unsigned int t = 0; t < threadCount; t++)
+        {
+            threads.emplace_back([&]()
+            {
+                for (int j = nextRow++; j < height; j = nextRow++)
+                {
+                    for (int i = 0; i < width; i++)
+                    {
+                        unsigned int bufferPosition = 4 * (width * j + i);
+                        // the ratio is rounded down: narrower cones are still safe
+                        image[bufferPosition] = (unsigned char) (Depth(i, j) * 255.0f + 0.5f);
+                        image[bufferPosition + 1] = (unsigned char) (glm::sqrt(ConeRatio(i, j) / MAX_RATIO) * 255.0f);
+                        image[bufferPosition + 2] = 0; // blue channel
+                        image[bufferPosition + 3] = 255;
+                    }
+
+                    // progress counter
+                    std::lock_guard<std::mutex> lock(progressMutex);
+                    std::cout << "\rWorking on row " << ++completedRows << " of " << height << std::flush;
+                }
+            });
+        }
+        for (std::thread& thread : threads)
+            thread.join();
+        std::cout << std::endl;
+
+        // save the texture (the map is derived from the depth map: it is always overwritten)
+        stbi_write_png(fullPath.c_str(), width, height, STBI_rgb_alpha, image, width * STBI_rgb_alpha);
+
+        // free space
+        delete[] image;
+    }
+
+    return 0;
+}
+
+// the depth of a texel, wrapping around the borders
+float Depth(int x, int y)
+{
+    x = ((x % width) + width) % width;
+    y = ((y % height) + height) % height;
+    return depth[width * y + x];
+}
+
+// the depth between the texels (in texel units, the centers of the texels at integer coordinates), as the bilinear filter of the shader
+float BilinearDepth(glm::vec2 texel)
+{
+    glm::vec2 base = glm::floor(texel);
+    glm::vec2 f = texel - base;
+    int x = (int) base.x, y = (int) base.y;
+    return glm::mix(glm::mix(Depth(x, y), Depth(x + 1, y), f.x), glm::mix(Depth(x, y + 1), Depth(x + 1, y + 1), f.x), f.y);
+}
+
+// the ratio of the relaxed cone of the texel (x, y)
+float ConeRatio(int x, int y)
+{
+    float srcDepth = Depth(x, y);
+    // a texel at the top: the rays reach it without crossing the surface
+    if (srcDepth <= 0.0f)
+        return MAX_RATIO;
+
+    // the ratios are in UV units, the search in texel units
+    float texelSize = 1.0f / (float) width;
+    float ratio = MAX_RATIO;
+    int maxRadius = glm::min((int) glm::ceil(MAX_RATIO * srcDepth / texelSize), width / 2);
+
+    for (int r = 1; r <= maxRadius; r++)
+    {
+        // the exit points of the rays through the ring are at least r texels away, and at most srcDepth above the apex
+        if (r * texelSize / srcDepth >= ratio)
+            break;
+
+        // the texels of the square ring at distance r
+        for (int k = -r; k < r; k++)
+        {
+            const glm::ivec2 ring[4] = {glm::ivec2(k, -r), glm::ivec2(r, k), glm::ivec2(-k, r), glm::ivec2(-r, -k)};
+            for (const glm::ivec2& offset : ring)
+            {
+                float dstDepth = Depth(x + offset.x, y + offset.y);
+                // the ray from the top above the texel reaches dst at the depth of the surface: the march goes on one texel at a time
+                // (dstDepth / length for each texel), until the ray leaves the solid
+                float length = glm::length(glm::vec2(offset));
+                if (dstDepth <= 0.0f)
+                    continue;
+                glm::vec2 direction = glm::vec2(offset) / length;
+                float depthStep = dstDepth / length;
+
+                float distance = length, rayDepth = dstDepth;
+                while (true)
+                {
+                    distance += 1.0f;
+                    rayDepth += depthStep;
+                    // below the apex, or outside of the map: no constraint
+                    if (rayDepth >= srcDepth || rayDepth > 1.0f)
+                        break;
+                    // the ratio of the exit point can only grow along the ray
+                    float exitRatio = distance * texelSize / (srcDepth - rayDepth);
+                    if (exitRatio >= ratio)
+                        break;
+                    // the ray is in the air again: the exit point constrains the cone
+                    if (rayDepth < BilinearDepth(glm::vec2(x, y) + direction * distance))
+                    {
+                        ratio = exitRatio;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    return ratio;
+}
@@ -0,0 +1,117 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+// we load the GLM classes used in the application
+#include <glm/glm.hpp>
+
+// we include the library for images loading
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image/stb_image.h>
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image/stb_image_write.h>
+
+/*
+Min-depth quadtree of the depth maps, for the hierarchical traversal of QuadtreeDisplacementMapping (see env_bump_aniso.frag),
+as in quadtree displacement mapping (Drobot, "Quadtree Displacement Mapping with Height Blending", GPU Pro, 2010)
+
+- the cells of level 0 are the bilinear patches between the centers of 2x2 texels: each one stores the minimum depth of its 4 texels
+  (the highest point of the patch, since depth is 1 - height). The node n of level k covers the cells from n * 2^k to (n + 1) * 2^k - 1,
+  and it stores the minimum of its 4 children: a ray above the value of a node cannot hit the surface inside it
+- the quadtree tiles like the materials: the last cell of each row (and column) is the patch between the last texel and the first one
+- level 0 is not stored: the shader computes it with a textureGather of the 4 texels from the depth map.
+  Levels 1 to log2(size) are stored side by side in the top rows of an image with the size of the depth map (quadtree.png in the folder
+  of each material, the next layer of the texture array): level k starts at column size - 2 * (size >> k), in row 0
+- the values are the 8 bit depths of the depth map, as the application loads it in the texture array, in the RGB channels
+
+N.B.) the depth maps must be square, with a power of two size
+*/
+
+// -------------- GLOBAL VARIABLES -------------- //
+
+// the folders of the materials (the same of the application)
+const std::vector<std::string> materialFolders = {"hammered_metal", "metal_pattern", "metal_tiles"};
+const std::string texturesFolder = "../../textures/";
+
+int main()
+{
+    for (const std::string& folder : materialFolders)
+    {
+        std::string sourcePath = texturesFolder + folder + "/depth.png";
+        std::string fullPath = texturesFolder + folder + "/quadtree.png";
+
+        // read the depth map (16 bits if available): only the red channel
+        int size, height, channels;
+        unsigned short* source = stbi_load_16(sourcePath.c_str(), &size, &height, &channels, STBI_grey);
+        if (source == NULL)
+        {
+            std::cout << "Error in loading the image: there is no texture called"
+                      << std::endl << sourcePath << std::endl;
+            exit(1);
+        }
+        if (size != height || (size & (size - 1)) != 0)
+        {
+            std::cout << "Error: the depth map of " << folder << " is not square with a power of two size" << std::endl;
+            exit(1);
+        }
+
+        // the application loads the depth maps with 8 bits
+        std::vector<unsigned char> depth(size * size);
+        for (int l = 0; l < size * size; l++)
+            depth[l] = (unsigned char) (source[l] >> 8);
+        stbi_image_free(source);
+
+        // level 0: the minimum of the 2x2 texels of each patch, wrapping around the borders
+        std::vector<unsigned char> level(size * size);
+        for (int j = 0; j < size; j++)
+        {
+            for (int i = 0; i < size; i++)
+            {
+                int nextI = (i + 1) % size, nextJ = (j + 1) % size;
+                level[size * j + i] = glm::min(glm::min(depth[size * j + i], depth[size * j + nextI]),
+                                               glm::min(depth[size * nextJ + i], depth[size * nextJ + nextI]));
+            }
+        }
+
+        unsigned char* image = new unsigned char[3 * size * size]();
+        int levelSize = size;
+        for (int k = 1; levelSize > 1; k++)
+        {
+            // each node is the minimum of its 4 children
+            int childSize = levelSize;
+            levelSize /= 2;
+            std::vector<unsigned char> parent(levelSize * levelSize);
+            for (int j = 0; j < levelSize; j++)
+            {
+                for (int i = 0; i < levelSize; i++)
+                {
+                    const unsigned char* children = &level[childSize * 2 * j + 2 * i];
+                    parent[levelSize * j + i] = glm::min(glm::min(children[0], children[1]), glm::min(children[childSize], children[childSize + 1]));
+                }
+            }
+            level.swap(parent);
+
+            // level k starts at column size - 2 * levelSize
+            int column = size - 2 * levelSize;
+            for (int j = 0; j < levelSize; j++)
+            {
+                for (int i = 0; i < levelSize; i++)
+                {
+                    unsigned int bufferPosition = 3 * (size * j + column + i);
+                    image[bufferPosition] = image[bufferPosition + 1] = image[bufferPosition + 2] = level[levelSize * j + i];
+                }
+            }
+        }
+
+        // save the texture (the quadtree is derived from the depth map: it is always overwritten)
+        stbi_write_png(fullPath.c_str(), size, size, STBI_rgb, image, size * STBI_rgb);
+        std::cout << "Saved the quadtree of " << folder << std::endl;
+
+        // free space
+        delete[] image;
+    }
+
+    return 0;
+}